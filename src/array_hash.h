@@ -24,8 +24,20 @@
 
 #include <cstring>
 #include <stdint.h>
+#include <memory>
+#include <new>
+#include <string>
 #include <utility>
 #include <iterator>
+#include <algorithm>
+#if __cplusplus >= 201103L
+#include <type_traits>
+#endif
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+#include "epoch.h"
 
 namespace stx {
 
@@ -38,6 +50,7 @@ namespace stx {
  * array_hash_traits traits;
  * traits.slot_count = 256;
  * traits.allocation_chunk_size = 64;
+ * traits.max_load_factor = 4;
  * hat_set<string> rawr(traits);
  * rawr.insert(...);
  * ...
@@ -46,16 +59,19 @@ namespace stx {
 class array_hash_traits
 {
 public:
-    array_hash_traits(int slot_count = 512, int allocation_chunk_size = 32) :
-        slot_count(slot_count), allocation_chunk_size(allocation_chunk_size)
+    array_hash_traits(int slot_count = 16, int allocation_chunk_size = 32,
+            int max_load_factor = 8) :
+        slot_count(slot_count), allocation_chunk_size(allocation_chunk_size),
+        max_load_factor(max_load_factor)
     {
     }
 
     /**
-     * Number of slots in the hash table. Higher values use more
-     * memory but may show faster access times.
+     * Number of slots a new hash table starts with. The table doubles
+     * its slots as it fills up (see max_load_factor), so this only
+     * needs to be large enough for a typical small table.
      *
-     * Default 512. Must be a positive power of 2.
+     * Default 16. Must be a positive power of 2.
      */
     int slot_count;
 
@@ -65,8 +81,8 @@ public:
      * size until there is enough space for a word.  In general, higher values
      * use more memory but require fewer memory copy operations.  Try to guess
      * how many average characters your strings will use, then multiply that
-     * by (hat_trie_traits.burst_threshold / array_hash_traits::slot_count) to
-     * get a good estimate for this value.
+     * by array_hash_traits::max_load_factor to get a good estimate for this
+     * value.
      *
      * If you want memory allocations to be exactly as big as they need to
      * be (rather than in block chunks), set this value to 0. This may be
@@ -76,24 +92,381 @@ public:
      * Default 32. Must be non-negative.
      */
     int allocation_chunk_size;
+
+    /**
+     * Average number of strings per slot that makes the table double
+     * its number of slots. Lower values use more memory for slot
+     * pointers but make searches in each slot shorter.
+     *
+     * Set this value to 0 to keep slot_count slots forever.
+     *
+     * Default 8. Must be non-negative.
+     */
+    int max_load_factor;
+};
+
+/**
+ * @brief The hash function from the original HAT-trie paper
+ *
+ * Hashes one byte at a time with shifts, adds and xors. It is cheap for
+ * short keys, but its cost grows with every byte of the key.
+ *
+ * A hash policy is any default constructible type with a
+ * <code>size_t operator()(const char *str, size_t length) const</code>.
+ * Array hashes use the low bits of the hash to pick a slot.
+ */
+struct shift_add_xor_hash
+{
+    size_t operator()(const char *str, size_t length) const
+    {
+        uint32_t h = 23;
+        for (size_t i = 0; i < length; ++i) {
+            h = h ^ ((h << 5) + (h >> 2) + (unsigned char) str[i]);
+        }
+        return h;
+    }
+};
+
+/**
+ * @brief Hashes keys eight bytes at a time
+ *
+ * Each 64-bit word of the key is folded in with a multiply and an
+ * xor-shift, and the result goes through the splitmix64 finalizer so
+ * that every input bit reaches the low bits used to pick a slot. Keys
+ * shorter than eight bytes are read with two overlapping loads instead
+ * of a byte loop.
+ *
+ * Hash values depend on the machine's byte order, so they must not be
+ * stored anywhere that outlives the process.
+ */
+struct word_hash
+{
+    size_t operator()(const char *str, size_t length) const
+    {
+        const uint64_t k = 0x9e3779b97f4a7c15ULL;
+        uint64_t h = (length + 1) * k;
+        uint64_t w;
+        while (length > 8) {
+            memcpy(&w, str, 8);
+            h = (h ^ w) * k;
+            h ^= h >> 29;
+            str += 8;
+            length -= 8;
+        }
+
+        // Fold in the last 1 to 8 bytes.
+        if (length >= 4) {
+            uint32_t a, b;
+            memcpy(&a, str, 4);
+            memcpy(&b, str + length - 4, 4);
+            w = ((uint64_t) a << 32) | b;
+        } else if (length > 0) {
+            w = ((uint64_t) (unsigned char) str[0] << 16) |
+                ((uint64_t) (unsigned char) str[length >> 1] << 8) |
+                (unsigned char) str[length - 1];
+        } else {
+            w = 0;
+        }
+        h = (h ^ w) * k;
+
+        // splitmix64 finalizer
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        return (size_t) h;
+    }
+};
+
+/**
+ * @brief Adds a fingerprint byte to every entry of an array hash that
+ * uses hash policy @a H
+ *
+ * The fingerprint is eight bits of the key's hash that the slot index
+ * doesn't use. Searching a slot then compares each entry's length,
+ * fingerprint and first byte in a single 32-bit load, and only calls
+ * memcmp on entries that match all three. This makes misses in long
+ * slots much cheaper for the cost of one byte per entry.
+ *
+ * @code
+ * hat_set<string, fingerprinted<word_hash> > set;
+ * @endcode
+ */
+template <class H>
+struct fingerprinted : public H { };
+
+/// Determines whether hash policy @a H stores fingerprints
+template <class H>
+struct fingerprint_traits
+{
+    static const size_t size = 0;
+};
+
+template <class H>
+struct fingerprint_traits<fingerprinted<H> >
+{
+    static const size_t size = 1;
+};
+
+/**
+ * Type that keys are passed to lookup functions as.
+ *
+ * A key_view points at the bytes of a key without owning or copying
+ * them, so strings, string literals and parts of larger buffers can all
+ * be looked up without building a std::string. Under C++17 this is
+ * std::string_view. Older standards get the small class below, which
+ * converts from the same things. Keys of any bytes can also be passed
+ * as a (const char *, size_t) pair.
+ */
+#if __cplusplus >= 201703L
+typedef std::string_view key_view;
+#else
+class key_view {
+  public:
+    key_view() : _data(""), _size(0) { }
+
+    /// Views the bytes of @a s, which must outlive the view
+    key_view(const std::string &s) : _data(s.data()), _size(s.size()) { }
+
+    /// Views the NULL terminated string @a s
+    key_view(const char *s) : _data(s), _size(strlen(s)) { }
+
+    /// Views the @a size bytes at @a data
+    key_view(const char *data, size_t size) : _data(data), _size(size) { }
+
+    const char *data() const { return _data; }
+    size_t size() const { return _size; }
+    size_t length() const { return _size; }
+    bool empty() const { return _size == 0; }
+    const char &operator[](size_t i) const { return _data[i]; }
+    const char *begin() const { return _data; }
+    const char *end() const { return _data + _size; }
+
+    /// Copies the viewed bytes into a string
+    operator std::string() const { return std::string(_data, _size); }
+
+    friend bool operator==(key_view lhs, key_view rhs) {
+        return lhs._size == rhs._size &&
+               memcmp(lhs._data, rhs._data, lhs._size) == 0;
+    }
+
+    friend bool operator!=(key_view lhs, key_view rhs) {
+        return !(lhs == rhs);
+    }
+
+    friend bool operator<(key_view lhs, key_view rhs) {
+        int cmp = memcmp(lhs._data, rhs._data, std::min(lhs._size,
+                                                        rhs._size));
+        return cmp < 0 || (cmp == 0 && lhs._size < rhs._size);
+    }
+
+    template <class stream>
+    friend stream &operator<<(stream &out, key_view key) {
+        out.write(key._data, key._size);
+        return out;
+    }
+
+  private:
+    const char *_data;
+    size_t _size;
+};
+#endif
+
+/// Placeholder mapped type for records that carry no data besides their key
+struct no_value { };
+
+/// Counts the bits that are set in @a x
+inline int popcount64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/// Counts the trailing zero bits in @a x. @a x must not be 0
+inline int ctz64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    return popcount64((x & -x) - 1);
+#endif
+}
+
+/// Counts the leading zero bits in @a x. @a x must not be 0
+inline int clz64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_clzll(x);
+#else
+    int result = 0;
+    while ((x & (1ULL << 63)) == 0) {
+        x <<= 1;
+        ++result;
+    }
+    return result;
+#endif
+}
+
+/// Hints that the memory at @a p will be read soon, so the cache line it
+/// is in can be loaded while other work is done
+inline void prefetch_read(const void *p) {
+#if defined(__GNUC__)
+    __builtin_prefetch(p, 0);
+#else
+    (void) p;
+#endif
+}
+
+/// Gets the type of allocator @a A rebound to allocate objects of type @a U
+template <class A, class U>
+struct rebind_alloc
+{
+#if __cplusplus >= 201103L
+    typedef typename std::allocator_traits<A>::template rebind_alloc<U> type;
+#else
+    typedef typename A::template rebind<U>::other type;
+#endif
+};
+
+/**
+ * Tells whether copies of allocator @a A may allocate and free from
+ * several threads at once, and free memory another copy allocated.
+ * False unless specialized; std::allocator is. Specialize it for a
+ * thread-safe allocator of your own to let hat_trie::parallel_load()
+ * use threads with it.
+ */
+template <class A>
+struct is_thread_safe_allocator
+{
+    static const bool value = false;
+};
+
+template <class T>
+struct is_thread_safe_allocator<std::allocator<T> >
+{
+    static const bool value = true;
+};
+
+/// Gets the alignment requirement of @a T
+template <class T>
+struct alignment_of
+{
+    struct aligned { char c; T t; };
+    static const size_t value = sizeof(aligned) - sizeof(T);
 };
 
+/**
+ * @brief Describes the records stored in array hashes and HAT-tries.
+ *
+ * A record is either a bare std::string (sets) or a
+ * pair<std::string, T> (maps). Maps store their mapped value right
+ * after the key, so the mapped type must be safe to copy with memcpy
+ * (integers, pointers, PODs).
+ */
 template <class T>
-class array_hash;
+struct record_traits;
 
-/// Time- and space-efficient hash table for strings
 template <>
-class array_hash<std::string>
+struct record_traits<std::string>
+{
+    typedef std::string key_type;
+    typedef no_value mapped_type;
+
+    /// What dereferencing an iterator gives: the key itself
+    typedef const std::string &reference;
+
+    /// Number of bytes stored after each key
+    static const size_t value_size = 0;
+
+    /// Alignment of the bytes stored after each key
+    static const size_t alignment = 1;
+
+    static const std::string &key(const std::string &s) { return s; }
+    static mapped_type mapped(const std::string &) { return no_value(); }
+    static reference make(const std::string &key, const mapped_type &)
+    {
+        return key;
+    }
+};
+
+template <class T>
+struct record_traits<std::pair<std::string, T> >
+{
+#if __cplusplus >= 201103L
+    static_assert(std::is_trivially_copyable<T>::value,
+            "mapped values are moved around with memcpy");
+#endif
+
+    typedef std::string key_type;
+    typedef T mapped_type;
+
+    /// What dereferencing an iterator gives: a copy of the record
+    typedef std::pair<std::string, T> reference;
+
+    /// Number of bytes stored after each key
+    static const size_t value_size = sizeof(T);
+
+    /// Alignment of the bytes stored after each key
+    static const size_t alignment = alignment_of<T>::value;
+
+    static const std::string &key(const std::pair<std::string, T> &p)
+    {
+        return p.first;
+    }
+    static const T &mapped(const std::pair<std::string, T> &p)
+    {
+        return p.second;
+    }
+    static std::pair<std::string, T> make(const std::string &key,
+            const T &value)
+    {
+        return std::make_pair(key, value);
+    }
+};
+
+/**
+ * @brief Time- and space-efficient hash table for strings
+ *
+ * @a T is the record type: std::string for a set of strings, or
+ * pair<std::string, M> for a map from strings to values of type M. Map
+ * values are stored inline, aligned, directly after their key.
+ *
+ * @a H is the hash policy that picks a key's slot. See
+ * shift_add_xor_hash and word_hash.
+ *
+ * @a A is the allocator that slots and the slot array are allocated
+ * with. It is rebound to whatever type it needs to allocate, so any
+ * value type will do. See slab_allocator for one that keeps the many
+ * small, short-lived slot allocations away from the system allocator.
+ *
+ * Keys are arbitrary byte strings of up to 65534 bytes. They are
+ * compared by length and bytes, so embedded NULL characters are allowed;
+ * every stored key is still followed by a NULL terminator so text keys
+ * can be read back as C-strings.
+ */
+template <class T, class H = shift_add_xor_hash,
+          class A = std::allocator<char> >
+class array_hash
 {
   private:
     typedef uint16_t length_type;
     typedef uint32_t size_type;
+    typedef typename rebind_alloc<A, char *>::type pointer_allocator;
+    typedef typename rebind_alloc<A, size_type>::type fill_allocator;
 
   public:
+    typedef typename record_traits<T>::mapped_type mapped_type;
+    typedef typename rebind_alloc<A, char>::type allocator_type;
+
     class iterator;
     typedef std::reverse_iterator<iterator> reverse_iterator;
     typedef iterator const_iterator;
     typedef reverse_iterator const_reverse_iterator;
+    class ordered_iterator;
 
     /**
      * Default constructor.
@@ -101,11 +474,13 @@ class array_hash<std::string>
      * O(1)
      *
      * @param traits  array hash customization traits
+     * @param alloc   allocator to get memory from
      */
-    array_hash(const array_hash_traits &traits = array_hash_traits()) :
-            _traits(traits)
+    array_hash(const array_hash_traits &traits = array_hash_traits(),
+            const allocator_type &alloc = allocator_type()) :
+            _traits(traits), _alloc(alloc), _reclaimer(NULL)
     {
-        _init();
+        _init(_traits.slot_count);
     }
 
     /**
@@ -115,10 +490,11 @@ class array_hash<std::string>
      */
     template <class Iterator>
     array_hash(Iterator first, const Iterator& last,
-            const array_hash_traits& traits = array_hash_traits()) :
-            _traits(traits)
+            const array_hash_traits& traits = array_hash_traits(),
+            const allocator_type &alloc = allocator_type()) :
+            _traits(traits), _alloc(alloc), _reclaimer(NULL)
     {
-        _init();
+        _init(_traits.slot_count);
 
         // Insert the data in the iterator range
         while (first != last) {
@@ -136,67 +512,185 @@ class array_hash<std::string>
     }
 
     /**
-     * Copy constructor.
+     * Copy constructor. The copy shares @a rhs's allocator.
      *
-     * O(n) where n = traits.slot_count
+     * O(n) where n is the number of slots
      */
-    array_hash(const array_hash<std::string> &rhs)
+    array_hash(const array_hash &rhs) : _alloc(rhs._alloc)
     {
         _data = NULL;
+        _order = NULL;
+        _order_size = 0;
+        _fill = NULL;
+        _reclaimer = NULL;
         operator=(rhs);
     }
 
     /**
-     * Assignment operator.
+     * Copy constructor that gets memory from @a alloc instead of
+     * @a rhs's allocator.
      *
-     * O(n) where n = traits.slot_count
+     * O(n) where n is the number of slots
      */
-    array_hash<std::string>& operator=(const array_hash<std::string> &rhs)
+    array_hash(const array_hash &rhs, const allocator_type &alloc) :
+            _alloc(alloc)
     {
-        if (this != &rhs) {
-            _traits = rhs._traits;
-            _size = rhs._size;
+        _data = NULL;
+        _order = NULL;
+        _order_size = 0;
+        _fill = NULL;
+        _reclaimer = NULL;
+        operator=(rhs);
+    }
 
+    /**
+     * Assignment operator. The table keeps its own allocator.
+     *
+     * O(n) where n is the number of slots
+     */
+    array_hash& operator=(const array_hash &rhs)
+    {
+        if (this != &rhs) {
             // Empty the current data array
             if (_data) {
                 _destroy();
             }
+            _order = NULL;
+            _order_size = 0;
+
+            _traits = rhs._traits;
+            _size = rhs._size;
+            _slot_count = rhs._slot_count;
 
             // Copy the data from the other array hash
-            _data = new char *[_traits.slot_count];
-            for (int i = 0; i < _traits.slot_count; ++i) {
-                if (rhs._data[i]) {
-                    size_t space = *rhs._data[i];
-                    _data[i] = new char[space];
-                    memcpy(_data[i], rhs._data[i], space);
-                } else {
-                    _data[i] = NULL;
-                }
+            _data = pointer_allocator(_alloc).allocate(
+                    _table_size(_slot_count));
+            memcpy(_data, rhs._data, _table_size(_slot_count) * sizeof(char*));
+            for (int i = _next_slot(_data, _slot_count, 0); i < _slot_count;
+                    i = _next_slot(_data, _slot_count, i + 1)) {
+                size_t space = *((size_type *) rhs._data[i]);
+                _data[i] = _alloc.allocate(space);
+                memcpy(_data[i], rhs._data[i], space);
             }
         }
         return *this;
     }
 
+#if __cplusplus >= 201103L
+    /**
+     * Move constructor. Takes over @a rhs's slots and allocator.
+     *
+     * @a rhs is left empty, with one slot in a shared table that nothing
+     * is ever added to. Its first insertion gives it slots of its own.
+     *
+     * O(1)
+     */
+    array_hash(array_hash &&rhs) noexcept :
+            _traits(rhs._traits), _size(rhs._size), _data(rhs._data),
+            _slot_count(rhs._slot_count), _alloc(rhs._alloc),
+            _order(rhs._order), _order_size(rhs._order_size),
+            _fill(rhs._fill), _reclaimer(rhs._reclaimer)
+    {
+        rhs._size = 0;
+        rhs._data = _empty_table();
+        rhs._slot_count = 1;
+        rhs._order = NULL;
+        rhs._order_size = 0;
+        rhs._fill = NULL;
+    }
+
+    /**
+     * Move assignment operator. Swaps the two tables, so the old
+     * contents of this one are freed along with @a rhs.
+     *
+     * O(1)
+     */
+    array_hash &operator=(array_hash &&rhs) noexcept
+    {
+        swap(rhs);
+        return *this;
+    }
+#endif
+
     /**
      * Determines whether @a str is in the table.
      *
+     * Keys are compared by their bytes, so @a str may contain NULL
+     * characters and any other byte value.
+     *
      * O(m) where m is the length of @a str
      *
-     * @param str  string to search for
+     * @param str     string to search for
+     * @param length  number of bytes in @a str
      * @return  true iff @a str is in the table
      */
-    bool exists(const char *str) const
+    bool exists(const char *str, size_t length) const
+    {
+        return exists(str, length, _hash(str, length));
+    }
+
+    /**
+     * Determines whether @a str is in the table, given the hash that
+     * prefetch() returned for it.
+     *
+     * O(m) where m is the length of @a str
+     */
+    bool exists(const char *str, size_t length, size_t h) const
     {
         // Determine which slot in the table should contain str.
-        length_type length;
-        char *p = _data[_hash(str, length)];
+        char *p = load_acquire(_data[_slot(h)]);
 
         // Return true if p is in that slot.
         if (p == NULL) {
             return false;
         }
         size_type s;
-        return _search(str, p, length, s) != NULL;
+        return _search(str, length, h, p, s) != NULL;
+    }
+
+    /**
+     * Hashes @a str and prefetches the pointer to the slot it belongs in.
+     *
+     * This function is an extension to the standard STL interface. It
+     * is the first step of a lookup that is split up so that the lookups
+     * of several keys can wait on memory at the same time: call this,
+     * then prefetch_slot() with the hash it returns, then exists() or
+     * find() with the hash, and work on other keys in between. See
+     * hat_trie::exists_batch().
+     *
+     * O(m) where m is the length of @a str
+     *
+     * @return  hash of @a str
+     */
+    size_t prefetch(const char *str, size_t length) const
+    {
+        size_t h = _hash(str, length);
+        prefetch_read(_data + _slot(h));
+        return h;
+    }
+
+    /**
+     * Prefetches the start of the slot a string with hash @a h belongs
+     * in. See prefetch().
+     *
+     * O(1)
+     */
+    void prefetch_slot(size_t h) const
+    {
+        char *p = load_acquire(_data[_slot(h)]);
+        if (p) {
+            prefetch_read(p + _header);
+        }
+    }
+
+    /**
+     * Determines whether @a str is in the table.
+     *
+     * O(m) where m is the length of @a str
+     */
+    bool exists(const char *str) const
+    {
+        return exists(str, strlen(str));
     }
 
     /**
@@ -204,9 +698,32 @@ class array_hash<std::string>
      *
      * O(m) where m is the length of @a str
      */
-    bool exists(const std::string& str) const
+    bool exists(key_view str) const
+    {
+        return exists(str.data(), str.size());
+    }
+
+    /**
+     * Counts the number of times @a str appears in the table: 1 or 0.
+     *
+     * O(m) where m is the length of @a str
+     *
+     * @param str     string to search for
+     * @param length  number of bytes in @a str
+     */
+    size_type count(const char *str, size_t length) const
+    {
+        return exists(str, length) ? 1 : 0;
+    }
+
+    /**
+     * Counts the number of times @a str appears in the table: 1 or 0.
+     *
+     * O(m) where m is the length of @a str
+     */
+    size_type count(key_view str) const
     {
-        return exists(str.c_str());
+        return count(str.data(), str.size());
     }
 
     /**
@@ -242,48 +759,129 @@ class array_hash<std::string>
     /**
      * Inserts @a str into the table.
      *
+     * In a map, @a str is given a default constructed value.
+     *
      * O(m) where m is the length of @a str
      *
-     * @param str  string to insert
+     * @param str     string to insert
+     * @param length  number of bytes in @a str
      * @return  true if @a str is successfully inserted, false if @a str
      *          already appears in the table
      */
+    bool insert(const char *str, size_t length)
+    {
+        bool inserted;
+        find_or_insert(str, length, inserted);
+        return inserted;
+    }
+
+    /**
+     * Inserts @a str into the table.
+     *
+     * O(m) where m is the length of @a str
+     */
     bool insert(const char *str)
     {
-        length_type length;
-        int slot = _hash(str, length);
+        return insert(str, strlen(str));
+    }
+
+    /**
+     * Searches for @a str in the table, inserting it if it isn't there.
+     *
+     * In a map, a newly inserted @a str is given a default constructed
+     * value.
+     *
+     * O(m) where m is the length of @a str
+     *
+     * @param str       string to search for
+     * @param length    number of bytes in @a str
+     * @param inserted  set to true if @a str was inserted, false if @a str
+     *                  already appeared in the table
+     * @return  iterator to @a str in the table
+     */
+    iterator find_or_insert(const char *str, size_t length, bool &inserted)
+    {
+        return find_or_insert(str, length, mapped_type(), inserted);
+    }
+
+    /**
+     * Searches for @a str in the table, inserting it mapped to @a value if
+     * it isn't there.
+     *
+     * @a value is written into the new entry before the entry can be
+     * seen by readers (see set_reclaimer()). Only useful in maps.
+     *
+     * O(m) where m is the length of @a str
+     *
+     * @return  iterator to @a str in the table
+     */
+    iterator find_or_insert(const char *str, size_t length,
+                            const mapped_type &value, bool &inserted)
+    {
+        _unshare();
+        if (grow_pending() && _reclaimer == NULL) {
+            _grow_table();
+        }
+
+        size_t h = _hash(str, length);
+        int slot = _slot(h);
         char *p = _data[slot];
+
+        // An empty slot is just its header and a terminating 0.
+        size_type occupied = _header + sizeof(length_type);
+        size_type current = 0;
         if (p) {
-            size_type occupied;
-            if (_search(str, p, length, occupied) != NULL) {
+            char *found = _search(str, length, h, p, occupied);
+            if (found != NULL) {
                 // str is already in the table. Nothing needs to be done.
-                return false;
-            }
-
-            // Resize the slot if it doesn't have enough space.
-            size_type current = *((size_type *) (p));
-            size_type required = occupied + sizeof(length_type) + length;
-            if (required > current) {
-                _grow_slot(slot, current, required);
+                inserted = false;
+                return iterator(slot, found, _data, _slot_count);
             }
+            current = *((size_type *) (p));
+        }
 
-            // Position for writing to the slot.
-            p = _data[slot] + occupied - sizeof(length_type);
-
-        } else {
-            // Make a new slot for this string.
-            size_type required = sizeof(size_type) + 2 * sizeof(length_type)
-                    + length;
-            _grow_slot(slot, 0, required);
-
-            // Position for writing to the slot.
-            p = _data[slot] + sizeof(size_type);
+        // Copy the slot if it doesn't have enough space, or if readers
+        // may be searching it. A copy replaces the slot once str is in it.
+        size_type required = occupied + _entry_size(length + 1);
+        char *s = p;
+        if (required > current || _reclaimer) {
+            s = _new_slot(p, occupied, current, required);
         }
 
         // Write str into the slot.
-        _append_string(str, p, length);
+        p = s + occupied - sizeof(length_type);
+        _append_string(str, p, length, h, value);
+        if (s != _data[slot]) {
+            _set_slot(slot, s);
+        }
         ++_size;
-        return true;
+        _discard_order();
+        inserted = true;
+        return iterator(slot, p, _data, _slot_count);
+    }
+
+    /**
+     * Searches for @a str in the table, inserting it if it isn't there.
+     *
+     * O(m) where m is the length of @a str
+     */
+    iterator find_or_insert(const char *str, bool &inserted)
+    {
+        return find_or_insert(str, strlen(str), inserted);
+    }
+
+    /**
+     * Gets the value mapped to @a str, inserting @a str with a default
+     * constructed value if it isn't in the table.
+     *
+     * Only available in maps.
+     *
+     * O(m) where m is the length of @a str
+     */
+    mapped_type &operator[](const char *str)
+    {
+        bool inserted;
+        return find_or_insert(str, inserted).value();
     }
 
     /**
@@ -295,9 +893,9 @@ class array_hash<std::string>
      * @return  true iff @a str is successfully inserted, false if @a str
      *          already appears in the table
      */
-    bool insert(const std::string& str)
+    bool insert(key_view str)
     {
-        return insert(str.c_str());
+        return insert(str.data(), str.size());
     }
 
     /**
@@ -305,17 +903,18 @@ class array_hash<std::string>
      *
      * O(m) where m is the length of @a str
      *
-     * @param str  string to erase
+     * @param str     string to erase
+     * @param length  number of bytes in @a str
      * @return  instances of @a str that were erased
      */
-    size_type erase(const char *str)
+    size_type erase(const char *str, size_t length)
     {
-        length_type length;
-        int slot = _hash(str, length);
+        size_t h = _hash(str, length);
+        int slot = _slot(h);
         char *p = _data[slot];
         if (p) {
             size_type occupied;
-            if ((p = _search(str, p, length, occupied)) != NULL) {
+            if ((p = _search(str, length, h, p, occupied)) != NULL) {
                 _erase_word(p, slot);
                 return 1;
             }
@@ -327,13 +926,23 @@ class array_hash<std::string>
      * Erases a string from the table.
      *
      * O(m) where m is the length of @a str
-     *
+     */
+    size_type erase(const char *str)
+    {
+        return erase(str, strlen(str));
+    }
+
+    /**
+     * Erases a string from the table.
+     *
+     * O(m) where m is the length of @a str
+     *
      * @param str  string to erase
      * @return  instances of @a str that were erased
      */
-    size_type erase(const std::string& str)
+    size_type erase(key_view str)
     {
-        return erase(str.c_str());
+        return erase(str.data(), str.size());
     }
 
     /**
@@ -352,33 +961,211 @@ class array_hash<std::string>
         }
     }
 
+    /**
+     * Erases a string from the hash table.
+     *
+     * O(m) where m is the length of the string
+     *
+     * @param pos  iterator to the string to erase
+     */
+    void erase(const ordered_iterator &pos)
+    {
+        if (pos._p) {
+            _erase_word(pos._p, _slot(_hash(*pos, pos.length())));
+        }
+    }
+
     /**
      * Clears all the elements from the hash table.
      *
-     * O(n) where n is traits.slot_count
+     * O(n) where n is the number of slots
      */
     void clear()
     {
         _destroy();
-        _init();
+        _init(_traits.slot_count);
+    }
+
+    /**
+     * Empties the table and prepares it to be filled with @a n strings
+     * that are known to be distinct.
+     *
+     * This function is an extension to the standard STL interface. It
+     * starts a bulk fill that allocates every slot once, at its exact
+     * final size, and never searches for duplicates:
+     *
+     *   1. reserve_distinct(n) sizes the slot table the way n calls to
+     *      insert() would have
+     *   2. measure() is called once for each of the n strings
+     *   3. allocate_measured() gives each slot the space measured for it
+     *   4. append_distinct() is called once for each string again
+     *
+     * The fill ends once the n-th string is appended. Until then the
+     * table must not be used in any other way.
+     *
+     * O(s) where s is the resulting number of slots
+     *
+     * @param n  number of strings that will be appended
+     */
+    void reserve_distinct(size_t n)
+    {
+        int slot_count = _traits.slot_count;
+        if (_traits.max_load_factor > 0) {
+            while (n > 0 &&
+                    n - 1 >= (size_t) slot_count * _traits.max_load_factor) {
+                slot_count *= 2;
+            }
+        }
+
+        if (_size > 0 || slot_count != _slot_count ||
+                _data == _empty_table()) {
+            _destroy();
+            _init(slot_count);
+        }
+        _end_fill();
+        _fill = fill_allocator(_alloc).allocate(_slot_count + 1);
+        memset(_fill, 0, (_slot_count + 1) * sizeof(size_type));
+        _fill[_slot_count] = n;
+    }
+
+    /**
+     * Counts the space a string will need in its slot. See
+     * reserve_distinct().
+     *
+     * O(m) where m is the length of @a str
+     */
+    void measure(const char *str, size_t length)
+    {
+        _fill[_slot(_hash(str, length))] += _entry_size(length + 1);
+    }
+
+    /**
+     * Allocates every slot with exactly the space measured for it. See
+     * reserve_distinct().
+     *
+     * O(s) where s is the number of slots
+     */
+    void allocate_measured()
+    {
+        for (int i = 0; i < _slot_count; ++i) {
+            if (_fill[i] > 0) {
+                _grow_slot(i, 0, _header + _fill[i] + sizeof(length_type),
+                           true);
+                memset(_data[i] + _header, 0, sizeof(length_type));
+
+                // From now on, _fill holds where the next string goes.
+                _fill[i] = _header;
+            }
+        }
+        if (_fill[_slot_count] == 0) {
+            _end_fill();
+        }
+    }
+
+    /**
+     * Appends a string without looking for it in the table first. See
+     * reserve_distinct().
+     *
+     * In a map, the string is given a default constructed value.
+     *
+     * O(m) where m is the length of @a str
+     *
+     * @return  iterator to @a str in the table
+     */
+    iterator append_distinct(const char *str, size_t length)
+    {
+        size_t h = _hash(str, length);
+        int slot = _slot(h);
+        char *p = _data[slot] + _fill[slot];
+        _append_string(str, p, length, h, mapped_type());
+        _fill[slot] += _entry_size(length + 1);
+        ++_size;
+        if (--_fill[_slot_count] == 0) {
+            _end_fill();
+        }
+        return iterator(slot, p, _data, _slot_count);
+    }
+
+    /**
+     * Determines whether the next insert() of a string that isn't in the
+     * table doubles its number of slots.
+     *
+     * O(1)
+     */
+    bool grow_pending() const
+    {
+        return _traits.max_load_factor > 0 &&
+                _size >= (size_t) _slot_count * _traits.max_load_factor;
+    }
+
+    /**
+     * Doubles the number of slots in the table.
+     *
+     * O(n) where n is the number of slots
+     */
+    void grow()
+    {
+        _grow_table();
     }
 
+#if __cplusplus >= 201103L
+    /**
+     * Lets the table be searched by other threads while one thread
+     * changes it. The searching threads must pin @a r's domain.
+     *
+     * This function is an extension to the standard STL interface. From
+     * now on, a slot is never changed in place: it is copied, the copy
+     * replaces it in a single store, and the old slot is retired to
+     * @a r. The slot array itself can't be replaced that way, so the
+     * table no longer grows by itself. Its owner swaps in a grown copy
+     * instead when grow_pending() says it is time.
+     *
+     * Only exists(), find() and dereferencing the iterators find()
+     * returns may run during a change.
+     *
+     * O(1)
+     *
+     * @param r  reclaimer to retire slots to, or NULL to change slots
+     *           in place again
+     */
+    void set_reclaimer(epoch_reclaimer<allocator_type> *r)
+    {
+        _reclaimer = r;
+    }
+#endif
+
     /**
      * Swaps information between two array hashes.
      *
      * O(1)
      */
-    void swap(array_hash<std::string>& rhs)
+    void swap(array_hash& rhs)
     {
         std::swap(_data, rhs._data);
         std::swap(_size, rhs._size);
         std::swap(_traits, rhs._traits);
+        std::swap(_order, rhs._order);
+        std::swap(_order_size, rhs._order_size);
+        std::swap(_slot_count, rhs._slot_count);
+        std::swap(_fill, rhs._fill);
+        std::swap(_reclaimer, rhs._reclaimer);
+        std::swap(_alloc, rhs._alloc);
+    }
+
+    /**
+     * Gets a copy of the allocator the table gets its memory from.
+     *
+     * O(1)
+     */
+    allocator_type get_allocator() const
+    {
+        return _alloc;
     }
 
     /**
      * Gets an iterator to the first element in the table.
      *
-     * O(n) where n = traits.slot_count
+     * O(n / 64) where n is the number of slots
      */
     iterator begin() const
     {
@@ -387,12 +1174,10 @@ class array_hash<std::string>
             result = end();
         } else {
             result._data = _data;
-            while (result._data[result._slot] == NULL) {
-                ++result._slot;
-            }
-            result._p = result._data[result._slot] + sizeof(size_type);
+            result._slot = _next_slot(_data, _slot_count, 0);
+            result._p = result._data[result._slot] + _header;
         }
-        result._slot_count = _traits.slot_count;
+        result._slot_count = _slot_count;
         return result;
     }
 
@@ -403,7 +1188,45 @@ class array_hash<std::string>
      */
     iterator end() const
     {
-        return iterator(_traits.slot_count, NULL, _data, _traits.slot_count);
+        return iterator(_slot_count, NULL, _data, _slot_count);
+    }
+
+    /**
+     * Calls a function on every string in the table, in the order the
+     * slots keep them.
+     *
+     * Faster than iterating, as no iterator state is kept between
+     * strings, and the table isn't sorted.
+     *
+     * O(n)  n = @a size()
+     *
+     * @param f  function or function object called as
+     *           <code>f(const char *str, size_t length,
+     *           mapped_type &value)</code>. The table must not be
+     *           modified while it is walked
+     * @return  @a f, after it has been called on every string
+     */
+    template <class F>
+    F for_each(F f) const
+    {
+        // Slots are allocated separately, so the next one is fetched while
+        // this one is walked.
+        int next = _next_slot(_data, _slot_count, 0);
+        while (next < _slot_count) {
+            int i = next;
+            next = _next_slot(_data, _slot_count, i + 1);
+            if (next < _slot_count) {
+                prefetch_read(_data[next]);
+            }
+            char *p = _data[i] + _header;
+            length_type length;
+            while ((length = *((length_type *) p)) != 0) {
+                f((const char *) p + _key_offset, (size_t) length - 1,
+                  *((mapped_type *) _value_of(p)));
+                p += _entry_size(length);
+            }
+        }
+        return f;
     }
 
     /**
@@ -419,36 +1242,141 @@ class array_hash<std::string>
     /**
      * Gets a reverse iterator to the last element in reverse order.
      *
-     * O(n) where n = traits.slot_count
+     * O(n / 64) where n is the number of slots
      */
     reverse_iterator rend() const
     {
         return reverse_iterator(begin());
     }
 
+    /**
+     * Gets an iterator to the lexicographically least string in the table.
+     *
+     * Ordered iteration visits strings in byte order. The order is
+     * computed the first time it is needed and cached until the table is
+     * next modified.
+     *
+     * O(n log n) where n = @a size() if the order isn't cached, O(1)
+     * otherwise
+     */
+    ordered_iterator ordered_begin() const
+    {
+        if (size() == 0) {
+            return ordered_end();
+        }
+        char **order = _ordered();
+        return ordered_iterator(this, order, *order);
+    }
+
+    /**
+     * Gets an ordered iterator to one past the greatest string in the
+     * table.
+     *
+     * O(1)
+     */
+    ordered_iterator ordered_end() const
+    {
+        return ordered_iterator(this, NULL, NULL);
+    }
+
+    /**
+     * Finds the least string in the table that is not less than @a str.
+     *
+     * O(log n) where n = @a size() if the order is cached, O(n log n)
+     * otherwise
+     *
+     * @param str     string to search for
+     * @param length  number of bytes in @a str
+     * @return  ordered iterator to the first string >= @a str, or
+     *          ordered_end() if there is no such string
+     */
+    ordered_iterator lower_bound(const char *str, size_t length) const
+    {
+        _key key = { str, length };
+        char **order = _ordered();
+        return _at(std::lower_bound(order, order + _size, key, _key_less()));
+    }
+
+    /**
+     * Finds the strings in the table that start with @a prefix.
+     *
+     * The strings are not copied; the range is found by a binary search
+     * over the table's order.
+     *
+     * O(m log n) where n = @a size() if the order is cached, O(n log n)
+     * otherwise
+     *
+     * @param prefix  prefix to search for
+     * @param length  number of bytes in @a prefix
+     * @return  range of ordered iterators over the strings that start
+     *          with @a prefix
+     */
+    std::pair<ordered_iterator, ordered_iterator>
+    prefix_range(const char *prefix, size_t length) const
+    {
+        _key key = { prefix, length };
+        char **order = _ordered();
+        std::pair<char **, char **> range = std::equal_range(order,
+                order + _size, key, _prefix_less());
+        return std::make_pair(_at(range.first), _at(range.second));
+    }
+
+    /**
+     * Converts an iterator into an ordered iterator pointing to the same
+     * string.
+     *
+     * O(1). The string's position in the order is only computed if the
+     * returned iterator is moved.
+     */
+    ordered_iterator ordered(const iterator &it) const
+    {
+        return ordered_iterator(this, NULL, it._p);
+    }
+
     /**
      * Searches for @a str in the table.
      *
      * O(m) where m is the length of @a str
      *
-     * @param str  string to search for
+     * @param str     string to search for
+     * @param length  number of bytes in @a str
      * @return  iterator to @a str in the table, or @a end() if @a str
      *          is not in the table
      */
-    iterator find(const char *str) const
+    iterator find(const char *str, size_t length) const
+    {
+        return find(str, length, _hash(str, length));
+    }
+
+    /**
+     * Searches for @a str in the table, given the hash that prefetch()
+     * returned for it.
+     *
+     * O(m) where m is the length of @a str
+     */
+    iterator find(const char *str, size_t length, size_t h) const
     {
         // Determine which slot in the table should contain str.
-        length_type length;
-        int slot = _hash(str, length);
-        char *p = _data[slot];
+        int slot = _slot(h);
+        char *p = load_acquire(_data[slot]);
 
         // Search for str in that slot.
         if (p == NULL) {
             return end();
         }
         size_type s;
-        p = _search(str, p, length, s);
-        return iterator(slot, p, _data, _traits.slot_count);
+        p = _search(str, length, h, p, s);
+        return iterator(slot, p, _data, _slot_count);
+    }
+
+    /**
+     * Searches for @a str in the table.
+     *
+     * O(m) where m is the length of @a str
+     */
+    iterator find(const char *str) const
+    {
+        return find(str, strlen(str));
     }
 
     /**
@@ -460,9 +1388,9 @@ class array_hash<std::string>
      * @return  iterator to @a str in the table, or @a end() if @a str
      *          is not in the table
      */
-    iterator find(const std::string& str) const
+    iterator find(key_view str) const
     {
-        return find(str.c_str());
+        return find(str.data(), str.size());
     }
 
     /**
@@ -470,16 +1398,17 @@ class array_hash<std::string>
      *
      * O(n) where n = @a size()
      */
-    bool operator==(const array_hash<std::string>& rhs)
+    bool operator==(const array_hash& rhs)
     {
         if (size() == rhs.size()) {
             // don't want to do a memory comparison because traits
             // may differ
-            iterator me = begin();
-            iterator them = rhs.begin();
-            iterator stop = end();
+            ordered_iterator me = ordered_begin();
+            ordered_iterator them = rhs.ordered_begin();
+            ordered_iterator stop = ordered_end();
             while (me != stop) {
-                if (strcmp(*me, *them) != 0) {
+                if (me.length() != them.length() ||
+                        memcmp(*me, *them, me.length()) != 0) {
                     return false;
                 }
                 ++me;
@@ -495,7 +1424,7 @@ class array_hash<std::string>
      *
      * O(n) where n = @a size
      */
-    bool operator!=(const array_hash<std::string>& rhs)
+    bool operator!=(const array_hash& rhs)
     {
         return !operator==(rhs);
     }
@@ -517,7 +1446,7 @@ class array_hash<std::string>
         /**
          * Move this iterator forward to the next element in the table.
          *
-         * worst case O(n) where n = traits.slot_count
+         * worst case O(n / 64) where n is the number of slots
          *
          * Calling this function on an end() iterator does nothing.
          *
@@ -527,20 +1456,17 @@ class array_hash<std::string>
         {
             // Move p to the next string in this slot.
             if (_p) {
-                _p += *((length_type *) _p) + sizeof(length_type);
+                _p += _entry_size(*((length_type *) _p));
                 if (*((length_type *) _p) == 0) {
-                    // Move down to the next slot.
-                    ++_slot;
-                    while (_slot < _slot_count && _data[_slot] == NULL) {
-                        ++_slot;
-                    }
+                    // Move down to the next occupied slot.
+                    _slot = _next_slot(_data, _slot_count, _slot + 1);
 
                     if (_slot == _slot_count) {
                         // We are at the end. Make this an end iterator
                         _p = NULL;
                     } else {
                         // Move to the first element in this slot.
-                        _p = _data[_slot] + sizeof(size_type);
+                        _p = _data[_slot] + _header;
                     }
                 }
             }
@@ -550,7 +1476,7 @@ class array_hash<std::string>
         /**
          * Move this iterator backward to the previous element in the table.
          *
-         * worst case O(n) where n = traits.slot_count
+         * worst case O(n / 64) where n is the number of slots
          *
          * Calling this function on a begin iterator does nothing.
          *
@@ -560,11 +1486,11 @@ class array_hash<std::string>
         {
             if (_p) {
                 // Find the iterator's current location in the slot
-                char *next = _data[_slot] + sizeof(size_type);
+                char *next = _data[_slot] + _header;
                 char *prev = next;
                 while (next != _p) {
                     prev = next;
-                    next += *((length_type *) next) + sizeof(length_type);
+                    next += _entry_size(*((length_type *) next));
                 }
 
                 if (prev != next) {
@@ -574,10 +1500,7 @@ class array_hash<std::string>
                 } else {
                     // Move back to the previous occupied slot
                     int tmp = _slot;
-                    --_slot;
-                    while (_slot >= 0 && _data[_slot] == NULL) {
-                        --_slot;
-                    }
+                    _slot = _prev_slot(_data, _slot_count, _slot - 1);
 
                     if (_slot < 0) {
                         // We are at the beginning. Make this a begin
@@ -589,18 +1512,14 @@ class array_hash<std::string>
             } else {
                 // Subtracting from end(). Find the very last slot
                 // in the table.
-                _slot = _slot_count - 1;
-                while (_data[_slot] == NULL) {
-                    --_slot;
-                }
+                _slot = _prev_slot(_data, _slot_count, _slot_count - 1);
             }
 
             // Move to the last element in this slot
-            char *next = _data[_slot] + sizeof(size_type);
+            char *next = _data[_slot] + _header;
             while (*((length_type *)next) != 0) {
                 _p = next;
-                length_type l = *((length_type *)next);
-                next += sizeof(length_type) + l;
+                next += _entry_size(*((length_type *)next));
             }
             return *this;
         }
@@ -608,7 +1527,7 @@ class array_hash<std::string>
         /**
          * Postfix increment operator.
          *
-         * worst case O(n) where n = traits.slot_count
+         * worst case O(n / 64) where n is the number of slots
          */
         iterator operator++(int)
         {
@@ -620,7 +1539,7 @@ class array_hash<std::string>
         /**
          * Postfix decrement operator.
          *
-         * worst case O(n) where n = traits.slot_count
+         * worst case O(n / 64) where n is the number of slots
          */
         iterator operator--(int)
         {
@@ -639,11 +1558,36 @@ class array_hash<std::string>
         const char *operator*() const
         {
             if (_p) {
-                return _p + sizeof(length_type);
+                return _p + _key_offset;
             }
             return NULL;
         }
 
+        /**
+         * Gets the number of bytes in the string this iterator points
+         * to, not counting its NULL terminator. Strings may contain NULL
+         * characters of their own.
+         *
+         * O(1)
+         */
+        size_t length() const
+        {
+            return *((length_type *) _p) - 1;
+        }
+
+        /**
+         * Gets the value mapped to the string this iterator points to.
+         *
+         * Only available in maps. Must not be called on an end()
+         * iterator.
+         *
+         * O(1)
+         */
+        mapped_type &value() const
+        {
+            return *((mapped_type *) _value_of(_p));
+        }
+
         /**
          * Standard equality operator.
          *
@@ -676,19 +1620,261 @@ class array_hash<std::string>
         }
     };
 
+    /**
+     * @brief Iterates over the strings in a table in byte order
+     *
+     * Ordered iterators are invalidated by any modification to the table.
+     */
+    class ordered_iterator : public std::iterator<
+            std::bidirectional_iterator_tag, const char *>
+    {
+        friend class array_hash;
+
+    public:
+        typedef const char * reference;
+
+        ordered_iterator() : _table(NULL), _pos(NULL), _p(NULL)
+        {
+        }
+
+        /**
+         * Move this iterator forward to the next string in byte order.
+         *
+         * O(1), plus the cost of computing the table's order if it
+         * isn't cached.
+         *
+         * Calling this function on an end iterator does nothing.
+         *
+         * @return  self-reference
+         */
+        ordered_iterator& operator++()
+        {
+            if (_p) {
+                if (_pos == NULL) {
+                    _pos = _table->_position(_p);
+                }
+                ++_pos;
+                if (_pos == _table->_order + _table->size()) {
+                    // We are at the end. Make this an end iterator
+                    _pos = NULL;
+                    _p = NULL;
+                } else {
+                    _p = *_pos;
+                }
+            }
+            return *this;
+        }
+
+        /**
+         * Move this iterator backward to the previous string in byte order.
+         *
+         * O(1), plus the cost of computing the table's order if it
+         * isn't cached.
+         *
+         * Calling this function on a begin iterator does nothing.
+         *
+         * @return  self-reference
+         */
+        ordered_iterator& operator--()
+        {
+            if (_p == NULL) {
+                // Subtracting from end(). Move to the greatest string.
+                if (_table->size() > 0) {
+                    _pos = _table->_ordered() + _table->size() - 1;
+                    _p = *_pos;
+                }
+            } else {
+                if (_pos == NULL) {
+                    _pos = _table->_position(_p);
+                }
+                if (_pos != _table->_order) {
+                    _p = *--_pos;
+                }
+            }
+            return *this;
+        }
+
+        /**
+         * Postfix increment operator.
+         */
+        ordered_iterator operator++(int)
+        {
+            ordered_iterator result = *this;
+            operator++();
+            return result;
+        }
+
+        /**
+         * Postfix decrement operator.
+         */
+        ordered_iterator operator--(int)
+        {
+            ordered_iterator result = *this;
+            operator--();
+            return result;
+        }
+
+        /**
+         * Iterator dereference operator.
+         *
+         * O(1)
+         *
+         * @return  character pointer to the string this iterator points to
+         */
+        const char *operator*() const
+        {
+            if (_p) {
+                return _p + _key_offset;
+            }
+            return NULL;
+        }
+
+        /**
+         * Gets the number of bytes in the string this iterator points
+         * to, not counting its NULL terminator.
+         *
+         * O(1)
+         */
+        size_t length() const
+        {
+            return *((length_type *) _p) - 1;
+        }
+
+        /**
+         * Gets the value mapped to the string this iterator points to.
+         *
+         * Only available in maps. Must not be called on an end iterator.
+         *
+         * O(1)
+         */
+        mapped_type &value() const
+        {
+            return *((mapped_type *) _value_of(_p));
+        }
+
+        /**
+         * Standard equality operator.
+         *
+         * O(1)
+         */
+        bool operator==(const ordered_iterator& rhs) const
+        {
+            return _p == rhs._p;
+        }
+
+        /**
+         * Standard inequality operator.
+         *
+         * O(1)
+         */
+        bool operator!=(const ordered_iterator& rhs) const
+        {
+            return !operator==(rhs);
+        }
+
+    private:
+        const array_hash *_table;
+        char **_pos;  // position in the table's order, NULL until needed
+        char *_p;
+
+        ordered_iterator(const array_hash *table, char **pos, char *p) :
+                _table(table), _pos(pos), _p(p)
+        {
+        }
+    };
+
 private:
+    // Bytes stored after each string, and their alignment
+    static const size_type _value_size = record_traits<T>::value_size;
+    static const size_type _alignment = record_traits<T>::alignment;
+
+    // Bytes before the first character of each string: its length and,
+    // if the hash policy asks for it, its fingerprint
+    static const size_type _fingerprint_size = fingerprint_traits<H>::size;
+    static const size_type _key_offset = sizeof(length_type) +
+            _fingerprint_size;
+
+    // Bytes at the beginning of each slot before its first string. The
+    // slot's allocated size is stored here, padded so that every map value
+    // in the slot is aligned.
+    static const size_type _header = (sizeof(size_type) + _alignment - 1) /
+            _alignment * _alignment;
+
     array_hash_traits _traits;
     size_t _size;
+    // _slot_count slot pointers, followed by a bitmap with a bit set for
+    // every slot that isn't NULL
     char **_data;
+    int _slot_count;  // current number of slots in _data
+    allocator_type _alloc;
+
+    // Every string in the table sorted in byte order, or NULL if the
+    // order needs to be recomputed
+    mutable char **_order;
+    mutable size_t _order_size;  // number of strings in _order
+
+    // During a bulk fill (see reserve_distinct()), the space measured for
+    // each slot and then the offset of the next string in it, followed by
+    // the number of strings left to append. NULL otherwise
+    size_type *_fill;
+
+    // Where replaced slots go while other threads may be searching the
+    // table (see set_reclaimer()). NULL otherwise
+    epoch_reclaimer<allocator_type> *_reclaimer;
+
+    /**
+     * Gets the number of bytes a string of @a length characters (including
+     * its NULL terminator) occupies in a slot, along with its length and
+     * any mapped value.
+     */
+    static size_type _entry_size(length_type length)
+    {
+        return (_key_offset + length + _alignment - 1) / _alignment
+                * _alignment + _value_size;
+    }
 
     /**
-     * Initializes the internal data pointers.
+     * Gets a pointer to the value mapped to the string at @a p.
      */
-    void _init()
+    static char *_value_of(char *p)
     {
-        _data = new char *[_traits.slot_count];
-        memset(_data, NULL, _traits.slot_count * sizeof(char*));
+        return p + _entry_size(*((length_type *) p)) - _value_size;
+    }
+
+    /**
+     * Initializes the internal data pointers for an empty table of
+     * @a slot_count slots.
+     */
+    void _init(int slot_count)
+    {
+        _slot_count = slot_count;
+        _data = pointer_allocator(_alloc).allocate(_table_size(_slot_count));
+        memset(_data, 0, _table_size(_slot_count) * sizeof(char*));
         _size = 0;
+        _order = NULL;
+        _order_size = 0;
+        _fill = NULL;
+    }
+
+    /**
+     * Gets the one-slot table a moved-from table is left with. Nothing is
+     * ever written to it.
+     */
+    static char **_empty_table()
+    {
+        static char *table[1 + (sizeof(uint64_t) + sizeof(char *) - 1) /
+                           sizeof(char *)];
+        return table;
+    }
+
+    /**
+     * Gives a moved-from table slots of its own before it changes.
+     */
+    void _unshare()
+    {
+        if (_data == _empty_table()) {
+            _init(_traits.slot_count);
+        }
     }
 
     /**
@@ -696,44 +1882,261 @@ private:
      */
     void _destroy()
     {
-        for (int i = 0; i < _traits.slot_count; ++i) {
-            delete[] _data[i];
+        if (_data == NULL || _data == _empty_table()) {
+            // not made yet, or moved from
+            return;
         }
-        delete[] _data;
+        for (int i = _next_slot(_data, _slot_count, 0); i < _slot_count;
+                i = _next_slot(_data, _slot_count, i + 1)) {
+            _free_slot(_data[i]);
+        }
+        pointer_allocator(_alloc).deallocate(_data, _table_size(_slot_count));
         _data = NULL;
+        _discard_order();
+        _end_fill();
+    }
+
+    /**
+     * Frees the bookkeeping of a bulk fill, if there is one.
+     */
+    void _end_fill()
+    {
+        if (_fill) {
+            fill_allocator(_alloc).deallocate(_fill, _slot_count + 1);
+            _fill = NULL;
+        }
+    }
+
+    /**
+     * Throws away the cached order of the strings in the table. Called
+     * whenever the table is modified.
+     */
+    void _discard_order()
+    {
+        if (_order) {
+            pointer_allocator(_alloc).deallocate(_order, _order_size);
+            _order = NULL;
+            _order_size = 0;
+        }
+    }
+
+    /**
+     * Returns a slot's memory to the allocator. @a p may be NULL.
+     */
+    void _free_slot(char *p)
+    {
+        if (p) {
+            _alloc.deallocate(p, *((size_type *) p));
+        }
+    }
+
+    /**
+     * Compares two strings in a slot by their bytes.
+     */
+    static bool _less(const char *a, const char *b)
+    {
+        length_type la = *((length_type *) a);
+        length_type lb = *((length_type *) b);
+        int cmp = memcmp(a + _key_offset, b + _key_offset,
+                std::min(la, lb));
+        return cmp < 0 || (cmp == 0 && la < lb);
+    }
+
+    // A string to search for in the table's order
+    struct _key
+    {
+        const char *str;
+        size_t length;
+    };
+
+    /**
+     * Compares the string in a slot at @a a with @a length bytes at
+     * @a str, like memcmp does for strings of different lengths.
+     *
+     * @return  negative, zero or positive as the string at @a a is
+     *          less than, equal to or greater than @a str
+     */
+    static int _compare(const char *a, const char *str, size_t length)
+    {
+        size_t la = *((length_type *) a) - 1;
+        int cmp = memcmp(a + _key_offset, str, std::min(la, length));
+        if (cmp != 0) {
+            return cmp;
+        }
+        return la < length ? -1 : (la > length ? 1 : 0);
+    }
+
+    // Orders strings in a slot relative to a key
+    struct _key_less
+    {
+        bool operator()(const char *a, const _key &key) const
+        {
+            return _compare(a, key.str, key.length) < 0;
+        }
+
+        bool operator()(const _key &key, const char *a) const
+        {
+            return _compare(a, key.str, key.length) > 0;
+        }
+    };
+
+    // Orders strings in a slot relative to all the strings that start
+    // with a prefix
+    struct _prefix_less
+    {
+        bool operator()(const char *a, const _key &prefix) const
+        {
+            size_t la = *((length_type *) a) - 1;
+            int cmp = memcmp(a + _key_offset, prefix.str,
+                    std::min(la, prefix.length));
+            return cmp < 0 || (cmp == 0 && la < prefix.length);
+        }
+
+        bool operator()(const _key &prefix, const char *a) const
+        {
+            size_t la = *((length_type *) a) - 1;
+            return memcmp(prefix.str, a + _key_offset,
+                    std::min(la, prefix.length)) < 0;
+        }
+    };
+
+    /**
+     * Makes an ordered iterator from a position in the table's order.
+     */
+    ordered_iterator _at(char **pos) const
+    {
+        if (pos == _order + _size) {
+            return ordered_end();
+        }
+        return ordered_iterator(this, pos, *pos);
     }
 
     /**
-     * Hashes @a str to an integer, its slot in the hash table.
+     * Gets every string in the table sorted in byte order, computing the
+     * order if it isn't cached.
+     */
+    char **_ordered() const
+    {
+        if (_order == NULL && _size > 0) {
+            _order_size = _size;
+            _order = pointer_allocator(_alloc).allocate(_order_size);
+            char **out = _order;
+            for (int i = _next_slot(_data, _slot_count, 0); i < _slot_count;
+                    i = _next_slot(_data, _slot_count, i + 1)) {
+                char *p = _data[i] + _header;
+                while (*((length_type *) p) != 0) {
+                    *out++ = p;
+                    p += _entry_size(*((length_type *) p));
+                }
+            }
+            std::sort(_order, out, _less);
+        }
+        return _order;
+    }
+
+    /**
+     * Finds the position of the string at @a p in the table's order.
+     */
+    char **_position(char *p) const
+    {
+        char **order = _ordered();
+        return std::lower_bound(order, order + _size, p, _less);
+    }
+
+    /**
+     * Hashes @a str with the table's hash policy.
      *
      * @param str     string to hash
-     * @param length  length of @a str. Calculated as this function runs
-     * @param seed    seed for the hash function
+     * @param length  number of bytes in @a str
      *
-     * @return  hashed value of @a str, its slot in the table
+     * @return  hashed value of @a str
      */
-    int _hash(const char *str, length_type &length, int seed = 23) const
+    size_t _hash(const char *str, size_t length) const
     {
-        int h = seed;
-        length = 0;
-        while (str[length]) {
-            // Hash this character.
-            h = h ^ ((h << 5) + (h >> 2) + str[length]);
-            ++length;
+        return H()(str, length);
+    }
+
+    /**
+     * Gets the slot in the hash table for a hash value.
+     */
+    int _slot(size_t h) const
+    {
+        return h & (_slot_count - 1); // same as h % _slot_count if
+                                      // _slot_count is a power of 2
+    }
+
+    /**
+     * Gets the number of pointers in the array behind a table of @a n
+     * slots: the slots themselves, then the occupancy bitmap.
+     */
+    static size_t _table_size(int n)
+    {
+        return n + ((n + 63) / 64 * sizeof(uint64_t) + sizeof(char *) - 1) /
+                sizeof(char *);
+    }
+
+    /**
+     * Gets the occupancy bitmap of a table of @a n slots.
+     */
+    static uint64_t *_bitmap(char **data, int n)
+    {
+        return (uint64_t *) (data + n);
+    }
+
+    /**
+     * Finds the first slot at or after @a slot that isn't NULL.
+     *
+     * @return  the slot, or @a n if there is none
+     */
+    static int _next_slot(char **data, int n, int slot)
+    {
+        const uint64_t *bits = _bitmap(data, n);
+        for (int i = slot >> 6; slot < n; ++i, slot = i << 6) {
+            uint64_t w = bits[i] & (~0ULL << (slot & 63));
+            if (w) {
+                return (i << 6) + ctz64(w);
+            }
         }
+        return n;
+    }
 
-        ++length; // include space for the NULL terminator
-        return h & (_traits.slot_count - 1); // same as h %
-                                             // _traits.slot_count if
-                                             // _traits.slot_count is a
-                                             // power of 2
+    /**
+     * Finds the last slot at or before @a slot that isn't NULL.
+     *
+     * @return  the slot, or -1 if there is none
+     */
+    static int _prev_slot(char **data, int n, int slot)
+    {
+        if (slot < 0) {
+            return -1;
+        }
+        const uint64_t *bits = _bitmap(data, n);
+        int i = slot >> 6;
+        uint64_t w = bits[i] & (~0ULL >> (63 - (slot & 63)));
+        while (w == 0) {
+            if (--i < 0) {
+                return -1;
+            }
+            w = bits[i];
+        }
+        return (i << 6) + 63 - clz64(w);
+    }
+
+    /**
+     * Gets the fingerprint stored with a string that hashes to @a h.
+     * Taken from bits the slot index doesn't use.
+     */
+    static uint8_t _fingerprint(size_t h)
+    {
+        return (uint8_t) (h >> 24);
     }
 
     /**
      * Searches for @a str in the table.
      *
      * @param str       string to search for
-     * @param length    length of @a str
+     * @param length    number of bytes in @a str
+     * @param h         hash of @a str
      * @param p         slot in @a data that @a str goes into
      * @param occupied  number of bytes in the slot that are currently in use.
      *                  This value is only meaningful when this function
@@ -742,27 +2145,51 @@ private:
      * @return  If @a str is found in the table, returns a pointer to
      *          the string and its corresponding length. If not, returns NULL.
      */
-    char *_search(const char *str, char *p, length_type length,
+    char *_search(const char *str, size_t length, size_t h, char *p,
             size_type &occupied) const
     {
         occupied = -1;
         char *start = p;
 
-        // Search for str in the slot p points to.
-        p += sizeof(size_type); // skip past size at beginning of slot
+        // Search for str in the slot p points to. Stored lengths count
+        // the NULL terminator.
+        p += _header; // skip past size at beginning of slot
         length_type w = *((length_type *) p);
-        while (w != 0) {
-            p += sizeof(length_type);
-            if (w == length) {
-                // The string being scanned is the same length as str.
-                // Make sure they aren't the same string.
-                if (strncmp(str, p, length) == 0) {
+        if (_fingerprint_size > 0) {
+            // Every entry starts with its length, fingerprint and first
+            // byte (the NULL terminator of an empty string). Compare all
+            // of them at once.
+            char expected[4];
+            length_type stored = length + 1;
+            memcpy(expected, &stored, sizeof(length_type));
+            expected[2] = _fingerprint(h);
+            expected[3] = length > 0 ? str[0] : '\0';
+            uint32_t head = 0;
+            memcpy(&head, expected, sizeof(head));
+            while (w != 0) {
+                uint32_t entry;
+                memcpy(&entry, p, sizeof(entry));
+                if (entry == head &&
+                        memcmp(str, p + _key_offset, length) == 0) {
                     // Found str.
-                    return p - sizeof(length_type);
+                    return p;
                 }
+                p += _entry_size(w);
+                w = *((length_type *) p);
+            }
+        } else {
+            while (w != 0) {
+                if (w == length + 1) {
+                    // The string being scanned is the same length as
+                    // str. Make sure they aren't the same string.
+                    if (memcmp(str, p + _key_offset, length) == 0) {
+                        // Found str.
+                        return p;
+                    }
+                }
+                p += _entry_size(w);
+                w = *((length_type *) p);
             }
-            p += w;
-            w = *((length_type *) p);
         }
         occupied = p - start + sizeof(length_type);
         return NULL;
@@ -774,12 +2201,34 @@ private:
      * @param slot      slot to change
      * @param current   current size of the slot
      * @param required  required size of the slot
+     * @param exact     true to allocate exactly @a required bytes,
+     *                  regardless of the allocation chunk size
      */
-    void _grow_slot(int slot, size_type current, size_type required)
+    void _grow_slot(int slot, size_type current, size_type required,
+                    bool exact = false)
+    {
+        _set_slot(slot, _new_slot(_data[slot], current, current, required,
+                                  exact));
+    }
+
+    /**
+     * Makes a slot with a capacity >= required, and copies the start of
+     * another slot into it. The new slot isn't put in the table.
+     *
+     * @param old       slot to copy from, or NULL
+     * @param used      number of bytes to copy from @a old
+     * @param current   current size of @a old
+     * @param required  required size of the new slot
+     * @param exact     true to allocate exactly @a required bytes,
+     *                  regardless of the allocation chunk size
+     * @return  the new slot
+     */
+    char *_new_slot(const char *old, size_type used, size_type current,
+                    size_type required, bool exact = false)
     {
         // Determine how much space the new slot needs.
         size_type new_size = current;
-        if (_traits.allocation_chunk_size == 0) {
+        if (exact || _traits.allocation_chunk_size == 0) {
             new_size = required;
         } else {
             while (new_size < required) {
@@ -787,37 +2236,139 @@ private:
             }
         }
 
-        // Make a new slot and copy all the data over.
-        char *p = _data[slot];
-        _data[slot] = new char[new_size];
-        if (p != NULL) {
-            memcpy(_data[slot], p, current);
-            delete[] p;
+        char *p = _alloc.allocate(new_size);
+        if (old != NULL) {
+            memcpy(p, old, used);
+        }
+        *((size_type *) p) = new_size;
+        return p;
+    }
+
+    /**
+     * Replaces a slot in the table in a single store, so that a thread
+     * searching it sees either the old slot or all of the new one. The
+     * old slot is retired if other threads may be searching it, and
+     * freed otherwise.
+     *
+     * @param slot  slot to change
+     * @param p     new slot, or NULL to empty the slot
+     */
+    void _set_slot(int slot, char *p)
+    {
+        char *old = _data[slot];
+        store_release(_data[slot], p);
+
+        uint64_t bit = 1ULL << (slot & 63);
+        if (p) {
+            _bitmap(_data, _slot_count)[slot >> 6] |= bit;
+        } else {
+            _bitmap(_data, _slot_count)[slot >> 6] &= ~bit;
+        }
+
+#if __cplusplus >= 201103L
+        if (old && _reclaimer) {
+            _reclaimer->retire(old, *((size_type *) old));
+            return;
         }
-        *((size_type *) (_data[slot])) = new_size;
+#endif
+        _free_slot(old);
+    }
+
+    /**
+     * Doubles the number of slots in the table.
+     *
+     * Each string in slot i moves to slot i or slot i + n of the new
+     * table, where n is the old number of slots. Both halves of a slot
+     * are measured first, so each new slot is allocated once and the
+     * strings are copied in a single pass.
+     */
+    void _grow_table()
+    {
+        _unshare();
+        int n = _slot_count;
+        char **old = _data;
+        _slot_count = n * 2;
+        _data = pointer_allocator(_alloc).allocate(_table_size(_slot_count));
+        memset(_data, 0, _table_size(_slot_count) * sizeof(char*));
+
+        for (int i = _next_slot(old, n, 0); i < n;
+                i = _next_slot(old, n, i + 1)) {
+            // Measure the strings that stay and the strings that move.
+            size_type used[2] = { _header, _header };
+            length_type w;
+            char *p;
+            for (p = old[i] + _header; (w = *((length_type *) p)) != 0;
+                    p += _entry_size(w)) {
+                used[_moves(p, n)] += _entry_size(w);
+            }
+
+            char *out[2] = { NULL, NULL };
+            for (int j = 0; j < 2; ++j) {
+                if (used[j] > _header) {
+                    _grow_slot(i + j * n, 0, used[j] + sizeof(length_type));
+                    out[j] = _data[i + j * n] + _header;
+                }
+            }
+
+            // Copy the strings and terminate the new slots.
+            for (p = old[i] + _header; (w = *((length_type *) p)) != 0;
+                    p += _entry_size(w)) {
+                int j = _moves(p, n);
+                memcpy(out[j], p, _entry_size(w));
+                out[j] += _entry_size(w);
+            }
+            for (int j = 0; j < 2; ++j) {
+                if (out[j]) {
+                    memset(out[j], 0, sizeof(length_type));
+                }
+            }
+            _free_slot(old[i]);
+        }
+        pointer_allocator(_alloc).deallocate(old, _table_size(n));
+        _discard_order();
+    }
+
+    /**
+     * Determines whether the string at @a p moves to the upper half of
+     * the table when a table of @a n slots doubles.
+     */
+    int _moves(char *p, int n) const
+    {
+        return (_hash(p + _key_offset, *((length_type *) p) - 1) & n) != 0;
     }
 
     /**
      * Appends a string to a list of strings in a slot.
      *
-     * Assumes the slot is big enough to hold the string.
+     * Assumes the slot is big enough to hold the string. In a map, the
+     * string is given a copy of @a value.
      *
      * @param str     string to append
      * @param p       pointer to the location in the slot this string
      *                should occupy
-     * @param length  length of @a str
+     * @param length  number of bytes in @a str
+     * @param h       hash of @a str
+     * @param value   value to map @a str to (ignored in sets)
      */
-    void _append_string(const char *str, char *p, length_type length)
+    void _append_string(const char *str, char *p, size_t length, size_t h,
+                        const mapped_type &value)
     {
-        // Write the length of the string, the string itself, the NULL
-        // terminator, and a 0 after all of that (for the length of the
-        // next string).
-        memcpy(p, &length, sizeof(length_type));
-        p += sizeof(length_type);
-        memcpy(p, str, length);
-        p += length;
-        length = 0;
-        memcpy(p, &length, sizeof(length_type));
+        // Write the length of the string, its fingerprint, the string
+        // itself, the NULL terminator, its value, and a 0 after all of
+        // that (for the length of the next string).
+        length_type stored = length + 1;
+        memcpy(p, &stored, sizeof(length_type));
+        if (_fingerprint_size > 0) {
+            p[sizeof(length_type)] = _fingerprint(h);
+        }
+        memcpy(p + _key_offset, str, length);
+        p[_key_offset + length] = '\0';
+        if (_value_size > 0) {
+            new (_value_of(p)) mapped_type(value);
+        }
+        p += _entry_size(stored);
+        stored = 0;
+        memcpy(p, &stored, sizeof(length_type));
     }
 
     /**
@@ -828,19 +2379,26 @@ private:
      */
     void _erase_word(char *p, int slot)
     {
-        int length = *(length_type *) (p);
-        size_type size = *((size_type *) _data[slot]);
-
-        // Erase the word by overwriting it.
-        int n = size - (p - _data[slot]);
-        memcpy(p, p + sizeof(length_type) + length, n);
-
-        // If that made the slot empty, erase the slot.
-        if (*((length_type *) (_data[slot] + sizeof(size_type))) == 0) {
-            delete[] _data[slot];
-            _data[slot] = NULL;
+        char *s = _data[slot];
+        size_type length = _entry_size(*(length_type *) (p));
+        size_type size = *((size_type *) s);
+        size_type offset = p - s;
+        size_type n = size - offset - length;
+
+        if (offset == _header && *((length_type *) (p + length)) == 0) {
+            // The word is the only one in the slot. Erase the slot.
+            _set_slot(slot, NULL);
+        } else if (_reclaimer) {
+            // Copy the slot without the word.
+            char *copy = _new_slot(s, offset, size, size - length, true);
+            memcpy(copy + offset, p + length, n);
+            _set_slot(slot, copy);
+        } else {
+            // Erase the word by overwriting it.
+            memmove(p, p + length, n);
         }
         --_size;
+        _discard_order();
     }
 };
 
@@ -0,0 +1,423 @@
+/*
+ * Copyright 2010-2011 Chris Vaszauskas and Tyler Richard
+ *
+ * This file is part of a HAT-trie implementation following the paper
+ * entitled "HAT-trie: A Cache-concious Trie-based Data Structure for
+ * Strings" by Nikolas Askitis and Ranjan Sinha.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONCURRENT_HAT_SET_H
+#define CONCURRENT_HAT_SET_H
+
+#include "hat_set.h"
+
+#if __cplusplus >= 201103L
+
+#include <atomic>
+#include <mutex>
+
+namespace stx {
+
+template <class T, class H = shift_add_xor_hash,
+          class A = std::allocator<char> > class concurrent_hat_set;
+
+/**
+ * @brief HAT-trie based set that many threads can insert into at once
+ *
+ * The words are split into shards by their first byte, or by their first
+ * two bytes, and each shard is a hat_set of the rest of its words behind
+ * a lock of its own. It holds the same words a hat_set would keep under
+ * that child of its root (or grandchild), though its containers burst
+ * on their own schedule. Threads inserting words with different leading
+ * bytes never wait for each other, and bursts in one shard hold up
+ * nobody else.
+ *
+ * Words shorter than the shard prefix (the empty word, and single bytes
+ * when sharding by two) are kept in flags beside the shards.
+ *
+ * Lookups lock their shard too, unless the traits turn on
+ * hat_trie_traits::concurrent_readers. Then they take no locks at all,
+ * and only writers to the same shard wait for each other.
+ *
+ * Each shard default constructs an allocator of its own, so shards
+ * never share allocator state. A slab_allocator gives every shard its
+ * own arena, guarded by the shard's lock.
+ *
+ * Skewed data puts most words behind a few locks: a prefix length of two
+ * spreads English words over far more shards than one. Shards are
+ * created the first time a word is inserted into them.
+ *
+ * Note: the only available key type is std::string. Using any other
+ * key type will result in a compile-time error. Needs C++11.
+ */
+template <class H, class A>
+class concurrent_hat_set<std::string, H, A> {
+
+  public:
+    typedef hat_set<std::string, H, A>         shard_type;
+    typedef typename shard_type::size_type     size_type;
+    typedef typename shard_type::key_type      key_type;
+    typedef typename shard_type::value_type    value_type;
+    typedef typename shard_type::allocator_type allocator_type;
+
+    /**
+     * Default constructor.
+     *
+     * O(1)
+     *
+     * @param prefix_length  number of leading bytes that pick a word's
+     *                       shard, 1 (256 shards) or 2 (65536 shards)
+     * @param traits         hat trie customization traits for every shard
+     * @param ah_traits      array hash customization traits
+     */
+    explicit concurrent_hat_set(int prefix_length = 1,
+            const hat_trie_traits &traits = hat_trie_traits(),
+            const array_hash_traits &ah_traits = array_hash_traits()) :
+            _prefix_length(prefix_length == 2 ? 2 : 1),
+            _shard_count(prefix_length == 2 ? 65536 : 256),
+            _shards(new std::atomic<_shard *>[_shard_count]),
+            _traits(traits), _ah_traits(ah_traits) {
+        for (size_t i = 0; i < _shard_count; ++i) {
+            _shards[i].store(NULL, std::memory_order_relaxed);
+        }
+        for (int i = 0; i < SHORT_WORDS; ++i) {
+            _short[i].store(false, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Destructor. No other thread may still use the set.
+     */
+    ~concurrent_hat_set() {
+        for (size_t i = 0; i < _shard_count; ++i) {
+            delete _shards[i].load(std::memory_order_relaxed);
+        }
+        delete[] _shards;
+    }
+
+    /**
+     * Inserts a word into the set. Safe to call from any number of
+     * threads at once.
+     *
+     * O(m)  m = length of the word, plus the wait for the word's shard
+     *
+     * @param word  word to insert
+     * @return  true if @a word was inserted, false if it was already
+     *          in the set
+     */
+    bool insert(key_view word) {
+        return insert(word.data(), word.size());
+    }
+
+    /**
+     * Inserts a NULL terminated word into the set.
+     */
+    bool insert(const char *word) {
+        return insert(word, strlen(word));
+    }
+
+    /**
+     * Inserts a word of @a length bytes into the set.
+     */
+    bool insert(const char *word, size_t length) {
+        if (length < (size_t) _prefix_length) {
+            bool expected = false;
+            return _short[_short_index(word, length)].compare_exchange_strong(
+                    expected, true);
+        }
+        _shard *s = _get_shard(_shard_index(word), true);
+        std::lock_guard<std::mutex> lock(s->mutex);
+        return s->set.insert(word + _prefix_length, length - _prefix_length);
+    }
+
+    /**
+     * Inserts every word in [first, last). Safe to call from any number
+     * of threads at once.
+     *
+     * @param first, last  iterators specifying a range of words
+     */
+    template <class input_iterator>
+    void insert(input_iterator first, const input_iterator &last) {
+        for (; first != last; ++first) {
+            insert(key_view(*first));
+        }
+    }
+
+    /**
+     * Erases a word from the set. Safe to call from any number of
+     * threads at once.
+     *
+     * @param word  word to erase
+     * @return  number of words erased (0 or 1)
+     */
+    size_type erase(key_view word) {
+        return erase(word.data(), word.size());
+    }
+
+    /**
+     * Erases a word of @a length bytes from the set.
+     */
+    size_type erase(const char *word, size_t length) {
+        if (length < (size_t) _prefix_length) {
+            bool expected = true;
+            return _short[_short_index(word, length)].compare_exchange_strong(
+                    expected, false);
+        }
+        _shard *s = _get_shard(_shard_index(word), false);
+        if (s == NULL) {
+            return 0;
+        }
+        std::lock_guard<std::mutex> lock(s->mutex);
+        return s->set.erase(word + _prefix_length, length - _prefix_length);
+    }
+
+    /**
+     * Searches for a word in the set. Safe to call from any number of
+     * threads at once, alongside inserts and erases.
+     *
+     * O(m)  m = length of the word
+     *
+     * @param word  word to search for
+     * @return  true iff @a word is in the set
+     */
+    bool exists(key_view word) const {
+        return exists(word.data(), word.size());
+    }
+
+    /**
+     * Searches for a word of @a length bytes in the set.
+     */
+    bool exists(const char *word, size_t length) const {
+        if (length < (size_t) _prefix_length) {
+            return _short[_short_index(word, length)].load();
+        }
+        _shard *s = _get_shard(_shard_index(word), false);
+        if (s == NULL) {
+            return false;
+        }
+        if (_traits.concurrent_readers) {
+            return s->set.exists(word + _prefix_length,
+                                 length - _prefix_length);
+        }
+        std::lock_guard<std::mutex> lock(s->mutex);
+        return s->set.exists(word + _prefix_length, length - _prefix_length);
+    }
+
+    /**
+     * Counts the number of times a word appears in the set.
+     *
+     * @param word  word to search for
+     * @return  1 if @a word is in the set, 0 otherwise
+     */
+    size_type count(key_view word) const {
+        return exists(word) ? 1 : 0;
+    }
+
+    /**
+     * Counts the number of times a word of @a length bytes appears in
+     * the set.
+     */
+    size_type count(const char *word, size_t length) const {
+        return exists(word, length) ? 1 : 0;
+    }
+
+    /**
+     * Gets the number of words in the set. While other threads change
+     * the set, the result counts each shard at a different moment.
+     *
+     * O(s)  s = number of shards
+     */
+    size_type size() const {
+        size_type result = 0;
+        for (int i = 0; i < SHORT_WORDS; ++i) {
+            result += _short[i].load();
+        }
+        for (size_t i = 0; i < _shard_count; ++i) {
+            _shard *s = _get_shard(i, false);
+            if (s) {
+                std::lock_guard<std::mutex> lock(s->mutex);
+                result += s->set.size();
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Determines whether the set is empty. See size().
+     */
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /**
+     * Gets the number of leading bytes that pick a word's shard.
+     */
+    int prefix_length() const {
+        return _prefix_length;
+    }
+
+    /**
+     * Gets the hat trie traits every shard was made with.
+     */
+    const hat_trie_traits &traits() const {
+        return _traits;
+    }
+
+    /**
+     * Erases every word in the set. The shards themselves are kept.
+     *
+     * Must not be called while other threads look words up in a set
+     * with hat_trie_traits::concurrent_readers.
+     */
+    void clear() {
+        for (int i = 0; i < SHORT_WORDS; ++i) {
+            _short[i].store(false);
+        }
+        for (size_t i = 0; i < _shard_count; ++i) {
+            _shard *s = _get_shard(i, false);
+            if (s) {
+                std::lock_guard<std::mutex> lock(s->mutex);
+                s->set.clear();
+            }
+        }
+    }
+
+    /**
+     * Calls a function on every word in the set, in byte order. See
+     * hat_set::for_each().
+     *
+     * Each shard is locked while its words are visited, so @a f sees
+     * every shard as it was at some moment, and must not change the
+     * set itself.
+     *
+     * @param f  function or function object called as
+     *           <code>f(key_view word)</code>
+     * @return  @a f, after it has been called on every word
+     */
+    template <class F>
+    F for_each(F f) const {
+        std::string buffer;
+        if (_short[0].load()) {
+            f(key_view(buffer));
+        }
+        for (size_t i = 0; i < _shard_count; ++i) {
+            // The first byte of every word in the shard
+            buffer.assign(1, (char) (i >> (8 * (_prefix_length - 1))));
+            if (_prefix_length == 2 && (i & 255) == 0 &&
+                    _short[1 + (i >> 8)].load()) {
+                f(key_view(buffer));
+            }
+
+            _shard *s = _get_shard(i, false);
+            if (s) {
+                if (_prefix_length == 2) {
+                    buffer.push_back((char) i);
+                }
+                std::lock_guard<std::mutex> lock(s->mutex);
+                f = s->set.for_each(_prefixed<F>(f, &buffer)).f;
+            }
+        }
+        return f;
+    }
+
+  private:
+    // empty word, then every single byte word
+    static const int SHORT_WORDS = 257;
+
+    struct _shard {
+        mutable std::mutex mutex;  // held by writers, and readers if the
+                                   // trie can't be read while it changes
+        shard_type set;            // words in the shard, less the prefix
+
+        _shard(const hat_trie_traits &traits,
+               const array_hash_traits &ah_traits) :
+                set(traits, ah_traits, allocator_type()) { }
+    };
+
+    // Puts the shard prefix back on the words a shard visits
+    template <class F>
+    struct _prefixed {
+        F f;
+        std::string *buffer;  // holds the prefix
+        size_t prefix_length;
+
+        _prefixed(const F &f, std::string *buffer) :
+                f(f), buffer(buffer), prefix_length(buffer->size()) { }
+
+        void operator()(key_view word) {
+            buffer->resize(prefix_length);
+            buffer->append(word.data(), word.size());
+            f(key_view(*buffer));
+        }
+    };
+
+    int _prefix_length;
+    size_t _shard_count;
+    std::atomic<_shard *> *_shards;
+    std::atomic<bool> _short[SHORT_WORDS];
+    hat_trie_traits _traits;
+    array_hash_traits _ah_traits;
+
+    /**
+     * Gets the shard a word of at least prefix_length() bytes belongs in.
+     */
+    size_t _shard_index(const char *word) const {
+        size_t result = (unsigned char) word[0];
+        if (_prefix_length == 2) {
+            result = (result << 8) | (unsigned char) word[1];
+        }
+        return result;
+    }
+
+    /**
+     * Gets the flag for a word shorter than prefix_length().
+     */
+    static int _short_index(const char *word, size_t length) {
+        return length == 0 ? 0 : 1 + (unsigned char) word[0];
+    }
+
+    /**
+     * Gets the shard at @a index, creating it if @a create is true.
+     * Threads that race to create the same shard agree on one of them.
+     *
+     * @return  the shard, or NULL if it doesn't exist and @a create is
+     *          false
+     */
+    _shard *_get_shard(size_t index, bool create) const {
+        _shard *result = _shards[index].load(std::memory_order_acquire);
+        if (result == NULL && create) {
+            _shard *s = new _shard(_traits, _ah_traits);
+            if (_shards[index].compare_exchange_strong(result, s,
+                    std::memory_order_acq_rel)) {
+                result = s;
+            } else {
+                // Another thread made it first.
+                delete s;
+            }
+        }
+        return result;
+    }
+
+    // shards hold locks, and aren't copied
+    concurrent_hat_set(const concurrent_hat_set &);
+    concurrent_hat_set &operator=(const concurrent_hat_set &);
+};
+
+} // namespace stx
+
+#endif  // C++11
+
+#endif  // CONCURRENT_HAT_SET_H
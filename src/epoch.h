@@ -0,0 +1,415 @@
+/*
+ * Copyright 2010-2011 Chris Vaszauskas and Tyler Richard
+ *
+ * This file is part of a HAT-trie implementation following the paper
+ * entitled "HAT-trie: A Cache-concious Trie-based Data Structure for
+ * Strings" by Nikolas Askitis and Ranjan Sinha.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+
+namespace stx {
+
+/**
+ * Loads @a x so that everything a writer did before publishing it with
+ * store_release() is visible after the load.
+ */
+template <class T>
+inline T load_acquire(const T &x) {
+#if defined(__GNUC__)
+    return __atomic_load_n(&x, __ATOMIC_ACQUIRE);
+#else
+    return *(const volatile T *) &x;
+#endif
+}
+
+/**
+ * Stores @a value in @a x after everything written before it, so readers
+ * that see it with load_acquire() see the rest too.
+ */
+template <class T>
+inline void store_release(T &x, T value) {
+#if defined(__GNUC__)
+    __atomic_store_n(&x, value, __ATOMIC_RELEASE);
+#else
+    *(volatile T *) &x = value;
+#endif
+}
+
+/// Loads @a x in one piece, with no ordering
+template <class T>
+inline T load_relaxed(const T &x) {
+#if defined(__GNUC__)
+    return __atomic_load_n(&x, __ATOMIC_RELAXED);
+#else
+    return *(const volatile T *) &x;
+#endif
+}
+
+/// Stores @a value in @a x in one piece, with no ordering
+template <class T>
+inline void store_relaxed(T &x, T value) {
+#if defined(__GNUC__)
+    __atomic_store_n(&x, value, __ATOMIC_RELAXED);
+#else
+    *(volatile T *) &x = value;
+#endif
+}
+
+/// Keeps loads before this point from being moved after it
+inline void fence_acquire() {
+#if defined(__GNUC__)
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+#endif
+}
+
+/// Keeps stores after this point from being moved before it
+inline void fence_release() {
+#if defined(__GNUC__)
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+}
+
+// Defined below for C++11 and later
+template <class A> class epoch_reclaimer;
+
+} // namespace stx
+
+#if __cplusplus >= 201103L
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace stx {
+
+/**
+ * @brief Tracks which readers may still be looking at memory a writer
+ * has replaced
+ *
+ * Readers pin the domain with a guard for as long as they use anything
+ * they reached through the data structure. The writer never frees what
+ * it unlinks right away. It stamps it with the current epoch (see
+ * epoch()) and, once advance() says every reader has moved past that
+ * epoch, nobody can reach it anymore. See epoch_reclaimer, which does
+ * this bookkeeping.
+ *
+ * Pinning takes no locks. Each reader claims a record of its own, and
+ * keeps the same one from guard to guard, so pinning is a compare and
+ * swap on a cache line no other thread writes, and a fence. Guards
+ * nest: a thread that already holds one doesn't pin again.
+ */
+class epoch_domain {
+
+  private:
+    // One per reader thread. Records are only freed with the domain.
+    struct _record {
+        std::atomic<uint64_t> epoch;        // pinned epoch, or 0
+        std::atomic<const void *> owner;    // thread holding it, or NULL
+        _record *next;
+        char padding[64];  // keep other records off this cache line
+
+        _record() : epoch(0), owner(NULL), next(NULL) { }
+    };
+
+  public:
+    /**
+     * @brief Pins an epoch_domain for as long as it is alive
+     *
+     * A guard on a NULL domain does nothing. Guards are not copyable,
+     * and must be destroyed on the thread that made them.
+     */
+    class guard {
+      public:
+        explicit guard(const epoch_domain *domain) :
+                _domain(domain), _pinned(NULL) {
+            if (domain) {
+                _pinned = domain->_pin();
+            }
+        }
+
+        ~guard() {
+            if (_pinned) {
+                _domain->_unpin(_pinned);
+            }
+        }
+
+      private:
+        const epoch_domain *_domain;
+        _record *_pinned;  // NULL if nested or there is no domain
+
+        guard(const guard &);
+        guard &operator=(const guard &);
+    };
+
+    epoch_domain() : _epoch(1), _records(NULL) {
+        static std::atomic<uint64_t> next_id(1);
+        _id = next_id.fetch_add(1);
+    }
+
+    /**
+     * Destructor. No guard on the domain may still be alive.
+     */
+    ~epoch_domain() {
+        _record *r = _records.load();
+        while (r) {
+            _record *next = r->next;
+            delete r;
+            r = next;
+        }
+    }
+
+    /**
+     * Gets the current epoch. Memory the writer unlinks now is stamped
+     * with it.
+     */
+    uint64_t epoch() const {
+        return _epoch.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Starts a new epoch, and gets the oldest epoch a reader is still
+     * pinned in. Memory stamped with an earlier epoch can't be reached
+     * by any reader, and can be freed.
+     *
+     * Only called by the writer.
+     *
+     * O(r)  r = number of reader threads the domain has seen
+     */
+    uint64_t advance() {
+        uint64_t result = _epoch.fetch_add(1) + 1;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (_record *r = _records.load(std::memory_order_acquire); r;
+                r = r->next) {
+            uint64_t e = r->epoch.load(std::memory_order_acquire);
+            if (e != 0 && e < result) {
+                result = e;
+            }
+        }
+        return result;
+    }
+
+  private:
+    std::atomic<uint64_t> _epoch;
+    // pushed to the front, never removed. Guards add them through a
+    // const domain
+    mutable std::atomic<_record *> _records;
+    uint64_t _id;  // distinguishes this domain from earlier ones at its
+                   // address in the threads' cached records
+
+    // The record a thread used last, and the domain it belongs to
+    struct _hint {
+        uint64_t id;
+        _record *record;
+    };
+
+    static _hint &_thread_hint() {
+        static thread_local _hint hint = { 0, NULL };
+        return hint;
+    }
+
+    // Gets an address that identifies the calling thread
+    static const void *_self() {
+        static thread_local char self;
+        return &self;
+    }
+
+    // Claims a record and pins the current epoch in it
+    // Returns NULL if the thread already has one pinned
+    _record *_pin() const {
+        const void *self = _self();
+        _hint &hint = _thread_hint();
+        _record *r = NULL;
+        if (hint.id == _id) {
+            const void *owner = hint.record->owner.load(
+                    std::memory_order_relaxed);
+            if (owner == self) {
+                return NULL;
+            }
+            if (owner == NULL && hint.record->owner.compare_exchange_strong(
+                    owner, self, std::memory_order_acquire)) {
+                r = hint.record;
+            }
+        }
+        if (r == NULL) {
+            r = _claim(self);
+            hint.id = _id;
+            hint.record = r;
+        }
+
+        // A reader whose load of the epoch sees a later advance() also
+        // sees what was unlinked before it. The fence orders the store
+        // against every load the reader makes while pinned.
+        r->epoch.store(_epoch.load(std::memory_order_acquire),
+                       std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return r;
+    }
+
+    // Finds a free record, or adds one
+    _record *_claim(const void *self) const {
+        _record *head = _records.load(std::memory_order_acquire);
+        for (_record *r = head; r; r = r->next) {
+            const void *owner = NULL;
+            if (r->owner.load(std::memory_order_relaxed) == NULL &&
+                    r->owner.compare_exchange_strong(
+                        owner, self, std::memory_order_acquire)) {
+                return r;
+            }
+        }
+        _record *r = new _record();
+        r->owner.store(self, std::memory_order_relaxed);
+        r->next = head;
+        while (!_records.compare_exchange_weak(r->next, r,
+                std::memory_order_release)) { }
+        return r;
+    }
+
+    void _unpin(_record *r) const {
+        r->epoch.store(0, std::memory_order_release);
+        r->owner.store(NULL, std::memory_order_release);
+    }
+
+    // domains are shared by pointer, not copied
+    epoch_domain(const epoch_domain &);
+    epoch_domain &operator=(const epoch_domain &);
+};
+
+/**
+ * @brief Frees memory a writer has replaced once no reader can see it
+ *
+ * The writer calls retire() instead of freeing memory it has unlinked
+ * from a data structure. Retired memory is freed in batches, after
+ * advancing the domain shows that every reader pinned when it was
+ * unlinked is gone, or all at once when the reclaimer is destroyed.
+ *
+ * Only the writer uses a reclaimer. @a A is the allocator retired memory
+ * was allocated with, as bytes.
+ */
+template <class A>
+class epoch_reclaimer {
+
+  public:
+    /// Destroys the object at @a p before its memory is freed
+    typedef void (*destroy_function)(void *p, A &alloc);
+
+    /**
+     * Constructor.
+     *
+     * @param alloc  allocator retired memory is freed with
+     * @param batch  number of retired blocks that sets off an attempt to
+     *               free them
+     */
+    explicit epoch_reclaimer(const A &alloc = A(), size_t batch = 64) :
+            _alloc(alloc), _batch(batch), _kept(0), _retired(alloc) { }
+
+    /**
+     * Destructor. Frees everything still retired, so no reader may still
+     * hold a guard on the domain.
+     */
+    ~epoch_reclaimer() {
+        _free(_retired.size());
+    }
+
+    /**
+     * Gets the domain readers pin.
+     */
+    const epoch_domain &domain() const {
+        return _domain;
+    }
+
+    /**
+     * Frees @a bytes bytes at @a p once no reader can still see them,
+     * calling @a destroy on them first if it isn't NULL.
+     *
+     * O(1) amortized
+     */
+    void retire(void *p, size_t bytes, destroy_function destroy = NULL) {
+        _block b = { p, bytes, destroy, _domain.epoch() };
+        _retired.push_back(b);
+        if (_retired.size() >= _batch + _kept) {
+            collect();
+        }
+    }
+
+    /**
+     * Frees everything retired before every reader that is pinned now.
+     *
+     * O(r + n)  r = number of reader threads, n = blocks retired
+     */
+    void collect() {
+        uint64_t oldest = _domain.advance();
+
+        // Blocks are retired in epoch order.
+        size_t n = 0;
+        while (n < _retired.size() && _retired[n].epoch < oldest) {
+            ++n;
+        }
+        _free(n);
+        _kept = _retired.size();
+    }
+
+    /**
+     * Gets the number of blocks waiting to be freed.
+     */
+    size_t pending() const {
+        return _retired.size();
+    }
+
+  private:
+    struct _block {
+        void *p;
+        size_t bytes;
+        destroy_function destroy;
+        uint64_t epoch;  // epoch it was unlinked in
+    };
+
+    typedef typename std::allocator_traits<A>::template
+            rebind_alloc<_block> block_allocator;
+
+    epoch_domain _domain;
+    A _alloc;
+    size_t _batch;
+    size_t _kept;  // blocks the last collect() couldn't free
+    std::vector<_block, block_allocator> _retired;
+
+    // Frees the first n retired blocks
+    void _free(size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            _block &b = _retired[i];
+            if (b.destroy) {
+                b.destroy(b.p, _alloc);
+            }
+            _alloc.deallocate((typename std::allocator_traits<A>::pointer)
+                              b.p, b.bytes);
+        }
+        _retired.erase(_retired.begin(), _retired.begin() + n);
+    }
+
+    // the writer owns its reclaimer
+    epoch_reclaimer(const epoch_reclaimer &);
+    epoch_reclaimer &operator=(const epoch_reclaimer &);
+};
+
+} // namespace stx
+
+#endif  // C++11
+
+#endif  // EPOCH_H
@@ -0,0 +1,765 @@
+/*
+ * Copyright 2010-2011 Chris Vaszauskas and Tyler Richard
+ *
+ * This file is part of a HAT-trie implementation following the paper
+ * entitled "HAT-trie: A Cache-concious Trie-based Data Structure for
+ * Strings" by Nikolas Askitis and Ranjan Sinha.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HAT_MAP_H
+#define HAT_MAP_H
+
+#include "hat_trie.h"
+
+namespace stx {
+
+template <class K, class T, class H = shift_add_xor_hash,
+          class A = std::allocator<char> > class hat_map;
+
+/**
+ * @brief HAT-trie based map that implements most of the STL map interface
+ *
+ * Values are stored inline next to their keys, so a lookup touches the
+ * same memory as a hat_set lookup would. @a T must be safe to copy with
+ * memcpy (integers, pointers, PODs) because values move around as array
+ * hash slots grow and shrink. Store a pointer or an index for anything
+ * heavier.
+ *
+ * Keys are byte strings and may contain NULL characters and bytes
+ * >= 0x80. See hat_set.
+ *
+ * @a H is the hash policy used inside the trie's containers, and @a A
+ * the allocator they are allocated with. See hat_set.
+ *
+ * Note: the only available key type is std::string. Using any other key
+ * type will result in a compile-time error.
+ */
+template <class T, class H, class A>
+class hat_map<std::string, T, H, A> {
+
+  private:
+    typedef hat_trie<std::pair<std::string, T>, H, A> hat_trie_type;
+    typedef hat_map<std::string, T, H, A>             _self;
+
+  public:
+    // STL types
+    typedef typename hat_trie_type::size_type       size_type;
+    typedef typename hat_trie_type::key_type        key_type;
+    typedef typename hat_trie_type::mapped_type     mapped_type;
+    typedef typename hat_trie_type::value_type      value_type;
+    typedef typename hat_trie_type::allocator_type  allocator_type;
+
+    typedef typename hat_trie_type::iterator        iterator;
+    typedef typename hat_trie_type::const_iterator  const_iterator;
+    typedef typename hat_trie_type::reverse_iterator
+            reverse_iterator;
+    typedef typename hat_trie_type::const_reverse_iterator
+            const_reverse_iterator;
+
+#if __cplusplus >= 201103L
+    /**
+     * @brief Lets a thread use what it finds in the map while another
+     * thread changes it. See hat_trie_traits::concurrent_readers and
+     * hat_trie::read_guard
+     */
+    class read_guard {
+      public:
+        explicit read_guard(const hat_map &map) : _guard(map.trie) { }
+
+      private:
+        typename hat_trie_type::read_guard _guard;
+    };
+#endif
+
+    /**
+     * Default constructor.
+     *
+     * O(1)
+     *
+     * @param traits     hat trie customization traits
+     * @param ah_traits  array hash customization traits
+     * @param alloc      allocator to get memory from
+     */
+    hat_map(const hat_trie_traits &traits = hat_trie_traits(),
+            const array_hash_traits &ah_traits = array_hash_traits(),
+            const allocator_type &alloc = allocator_type()) :
+            trie(traits, ah_traits, alloc) { }
+
+    /**
+     * Array hash traits constructor.
+     *
+     * @param ah_traits  array hash customization traits
+     * @param alloc      allocator to get memory from
+     */
+    hat_map(const array_hash_traits &ah_traits,
+            const allocator_type &alloc = allocator_type()) :
+            trie(ah_traits, alloc) { }
+
+    /**
+     * Builds a HAT map from the key/value pairs in [first, last).
+     *
+     * @param first, last  iterators specifying a range of elements to
+     *                     initialize the map with
+     */
+    template <class input_iterator>
+    hat_map(const input_iterator &first, const input_iterator &last,
+            const hat_trie_traits &traits = hat_trie_traits(),
+            const array_hash_traits &ah_traits = array_hash_traits(),
+            const allocator_type &alloc = allocator_type()) :
+        trie(first, last, traits, ah_traits, alloc)
+    { }
+
+    /**
+     * Builds a HAT map from key/value pairs in [first, last) that are
+     * sorted by key and have distinct keys. See bulk_load().
+     *
+     * @param first, last  iterators specifying a range of pairs, sorted
+     *                     by key, with no duplicate keys
+     */
+    template <class input_iterator>
+    hat_map(sorted_unique_t,
+            const input_iterator &first, const input_iterator &last,
+            const hat_trie_traits &traits = hat_trie_traits(),
+            const array_hash_traits &ah_traits = array_hash_traits(),
+            const allocator_type &alloc = allocator_type()) :
+        trie(sorted_unique, first, last, traits, ah_traits, alloc)
+    { }
+
+    /**
+     * Searches for a key in the map.
+     *
+     * O(m)  m = length of the string
+     *
+     * @param key  key to search for
+     * @return  true iff @a key is in the map
+     */
+    bool exists(key_view key) const {
+        return trie.exists(key);
+    }
+
+    /**
+     * Searches for a key of @a length bytes in the map.
+     *
+     * O(m)  m = length of the string
+     */
+    bool exists(const char *key, size_t length) const {
+        return trie.exists(key, length);
+    }
+
+    /**
+     * Searches for several keys at once.
+     *
+     * This function is an extension to the standard STL interface. The
+     * searches are interleaved so that their cache misses overlap, which
+     * makes this faster than calling exists() in a loop on a large map.
+     * See hat_trie::exists_batch().
+     *
+     * O(n m)  n = number of keys, m = length of the longest key
+     *
+     * @param first, last  forward iterators over the keys to search for
+     * @param out          output iterator that gets a bool for each key,
+     *                     in order: true iff it is in the map
+     * @return  @a out after the last result
+     */
+    template <class forward_iterator, class output_iterator>
+    output_iterator exists_batch(const forward_iterator &first,
+                                 const forward_iterator &last,
+                                 output_iterator out) const {
+        return trie.exists_batch(first, last, out);
+    }
+
+    /**
+     * Searches for several keys at once, and gets iterators to them.
+     * See exists_batch().
+     *
+     * @param first, last  forward iterators over the keys to search for
+     * @param out          output iterator that gets an iterator for each
+     *                     key, in order: to the key in the map,
+     *                     or end() if it isn't there
+     * @return  @a out after the last result
+     */
+    template <class forward_iterator, class output_iterator>
+    output_iterator find_batch(const forward_iterator &first,
+                               const forward_iterator &last,
+                               output_iterator out) const {
+        return trie.find_batch(first, last, out);
+    }
+
+    /**
+     * Counts the number of times a key appears in the map.
+     *
+     * In map containers, this number will either be 1 or 0.
+     *
+     * O(m)  m = length of the string
+     *
+     * @param key  key to search for
+     * @return  number of times @a key appears in the map
+     */
+    size_type count(key_view key) const {
+        return trie.count(key);
+    }
+
+    /**
+     * Counts the number of times a key of @a length bytes appears in
+     * the map.
+     *
+     * O(m)  m = length of the string
+     */
+    size_type count(const char *key, size_t length) const {
+        return trie.count(key, length);
+    }
+
+    /**
+     * Determines whether this map is empty.
+     *
+     * O(1)
+     *
+     * @return  true iff the container has no data
+     */
+    bool empty() const {
+        return trie.empty();
+    }
+
+    /**
+     * Gets the number of elements in the map.
+     *
+     * O(1)
+     *
+     * @return  number of elements in the map
+     */
+    size_type size() const {
+        return trie.size();
+    }
+
+    /**
+     * Gets a const reference to the traits associated with this map.
+     *
+     * O(1)
+     *
+     * @return  traits associated with this map
+     */
+    const hat_trie_traits &traits() const {
+        return trie.traits();
+    }
+
+    /**
+     * Gets the array hash traits associated with the hash tables in
+     * this map.
+     *
+     * O(1)
+     *
+     * @return  array hash traits associated with this map
+     */
+    const array_hash_traits &hash_traits() const {
+        return trie.hash_traits();
+    }
+
+    /**
+     * Gets a copy of the allocator the map gets its memory from.
+     *
+     * O(1)
+     */
+    allocator_type get_allocator() const {
+        return trie.get_allocator();
+    }
+
+    /**
+     * Removes all the elements in the map.
+     */
+    void clear() {
+        trie.clear();
+    }
+
+    /**
+     * Inserts a key/value pair into the map.
+     *
+     * If the key is already in the map, its value is left untouched.
+     * See hat_set::insert() for why this function returns a bool.
+     *
+     * O(m)  m = length of the string
+     *
+     * @param record  key/value pair to insert
+     * @return  true if the pair is inserted into the map, false if its
+     *          key was already in the map
+     */
+    bool insert(const value_type &record) {
+        return trie.insert(record);
+    }
+
+    /**
+     * Inserts @a key, mapped to @a value, into the map without making a
+     * key/value pair.
+     *
+     * If the key is already in the map, its value is left untouched.
+     *
+     * O(m)  m = length of the string
+     *
+     * @return  true if @a key is inserted into the map, false if it was
+     *          already in the map
+     */
+    bool insert(key_view key, const mapped_type &value) {
+        return insert(key.data(), key.size(), value);
+    }
+
+    /**
+     * Inserts the key of @a length bytes at @a key, mapped to @a value,
+     * into the map.
+     *
+     * O(m)  m = length of the string
+     *
+     * @return  true if the key is inserted into the map, false if it was
+     *          already in the map
+     */
+    bool insert(const char *key, size_t length, const mapped_type &value) {
+        bool inserted;
+        trie.find_or_insert(key, length, value, inserted);
+        return inserted;
+    }
+
+    /**
+     * Inserts several key/value pairs into the map.
+     *
+     * O(n)  n = elements in [first, last)
+     *
+     * @param first, last  iterators specifying a range of pairs to add
+     *                     to the map
+     */
+    template <class input_iterator>
+    void insert(const input_iterator &first, const input_iterator &last) {
+        trie.insert(first, last);
+    }
+
+    /**
+     * Replaces the contents of the map with the key/value pairs in
+     * [first, last), which must be sorted by key and have no duplicate
+     * keys.
+     *
+     * This function is an extension to the standard STL interface. See
+     * hat_set::bulk_load().
+     *
+     * O(n m)  n = elements in [first, last), m = length of the longest
+     * key
+     *
+     * @param first, last  iterators specifying a range of pairs
+     */
+    template <class input_iterator>
+    void bulk_load(input_iterator first, const input_iterator &last) {
+        trie.bulk_load(first, last);
+    }
+
+#if __cplusplus >= 201103L
+    /**
+     * Replaces the contents of the map with the key/value pairs in
+     * [first, last), inserting them on several threads. A key that
+     * appears more than once keeps its first value, as with insert().
+     *
+     * This function is an extension to the standard STL interface. See
+     * hat_trie::parallel_load().
+     *
+     * @param first, last  iterators specifying a range of pairs, in any
+     *                     order
+     * @param threads      number of threads to insert on. 0 means one
+     *                     for every core
+     */
+    template <class forward_iterator>
+    void parallel_load(const forward_iterator &first,
+                       const forward_iterator &last, unsigned threads = 0) {
+        trie.parallel_load(first, last, threads);
+    }
+#endif
+
+    /**
+     * Inserts a key/value pair into the map.
+     *
+     * @a pos is unused. See hat_set::insert(iterator, value_type).
+     *
+     * O(m)  m = length of the string
+     *
+     * @param record  key/value pair to insert
+     * @return  iterator to the record's key in the map
+     */
+    iterator insert(const iterator &pos, const value_type &record) {
+        return trie.insert(pos, record);
+    }
+
+    /**
+     * Maps @a key to @a value, whether or not @a key is already in
+     * the map.
+     *
+     * Makes a single pass through the trie.
+     *
+     * O(m)  m = length of the string
+     *
+     * @param key    key to insert or update
+     * @param value  value to map @a key to
+     * @return  true if @a key was inserted, false if an existing value
+     *          was overwritten
+     */
+    bool insert_or_assign(key_view key, const mapped_type &value) {
+        return insert_or_assign(key.data(), key.size(), value);
+    }
+
+    /**
+     * Maps the key of @a length bytes at @a key to @a value.
+     *
+     * O(m)  m = length of the string
+     *
+     * @return  true if the key was inserted, false if an existing value
+     *          was overwritten
+     */
+    bool insert_or_assign(const char *key, size_t length,
+                          const mapped_type &value) {
+        bool inserted;
+        mapped_type &result = trie.find_or_insert(key, length, value,
+                                                  inserted);
+        if (!inserted) {
+            result = value;
+        }
+        return inserted;
+    }
+
+    /**
+     * Gets the value mapped to @a key, inserting @a key with a default
+     * constructed value if it isn't in the map.
+     *
+     * Makes a single pass through the trie.
+     *
+     * O(m)  m = length of the string
+     *
+     * @param key  key to search for
+     * @return  reference to the value mapped to @a key. The reference is
+     *          invalidated by the next insertion or erasure
+     */
+    mapped_type &operator[](key_view key) {
+        bool inserted;
+        return trie.find_or_insert(key.data(), key.size(), inserted);
+    }
+
+    /**
+     * Erases a key from the map.
+     *
+     * @param key  key to erase
+     * @return  number of records erased
+     */
+    size_type erase(key_view key) {
+        return trie.erase(key);
+    }
+
+    /**
+     * Erases a key of @a length bytes from the map.
+     *
+     * @return  number of records erased
+     */
+    size_type erase(const char *key, size_t length) {
+        return trie.erase(key, length);
+    }
+
+    /**
+     * Erases a record from the map.
+     *
+     * @param pos  iterator to the record to erase
+     */
+    void erase(const iterator &pos) {
+        trie.erase(pos);
+    }
+
+    /**
+     * Erases the records in [first, last).
+     *
+     * @param first  iterator to the first record to erase
+     * @param last   iterator one past the last record to erase
+     */
+    void erase(const iterator &first, const iterator &last) {
+        trie.erase(first, last);
+    }
+
+    /**
+     * Gets an iterator to the first element in the map.
+     *
+     * Use iterator::key() and iterator::value() to get at the record
+     * without copying it.
+     *
+     * @return  iterator to the first element in the map
+     */
+    iterator begin() const {
+        return trie.begin();
+    }
+
+    /**
+     * Gets an iterator to one past the last element in the map.
+     *
+     * O(1)
+     *
+     * @return iterator to one past the last element in the map
+     */
+    iterator end() const {
+        return trie.end();
+    }
+
+    /**
+     * Gets a reverse iterator to the last element in the trie.
+     *
+     * Reverse iterators visit the elements in descending byte order.
+     *
+     * @return  reverse iterator to the last element in the trie, or
+     *          rend() if the trie is empty
+     */
+    reverse_iterator rbegin() const {
+        return trie.rbegin();
+    }
+
+    /**
+     * Gets a reverse iterator to one before the first element in the
+     * trie.
+     *
+     * O(1)
+     *
+     * @return  reverse iterator to one before the first element
+     */
+    reverse_iterator rend() const {
+        return trie.rend();
+    }
+
+    /**
+     * Searches for @a key in the map.
+     *
+     * O(m)  m = length of the string
+     *
+     * @param key  key to search for
+     * @return  iterator to @a key in the map, or @a end() if @a key
+     *          is not found
+     */
+    iterator find(key_view key) const {
+        return trie.find(key);
+    }
+
+    /**
+     * Searches for a key of @a length bytes in the map.
+     *
+     * O(m)  m = length of the string
+     */
+    iterator find(const char *key, size_t length) const {
+        return trie.find(key, length);
+    }
+
+    /**
+     * Finds the first key in the map that is not less than @a key.
+     *
+     * O(m + c log c)  m = length of the string, c = size of the
+     * container @a key would be stored in (O(m + log c) if that
+     * container's order is cached)
+     *
+     * @param key  key to search for
+     * @return  iterator to the first key >= @a key, or @a end() if
+     *          there is no such key
+     */
+    iterator lower_bound(key_view key) const {
+        return trie.lower_bound(key);
+    }
+
+    /**
+     * Finds the first key in the map that is not less than the
+     * @a length bytes at @a key.
+     */
+    iterator lower_bound(const char *key, size_t length) const {
+        return trie.lower_bound(key, length);
+    }
+
+    /**
+     * Finds the first key in the map that is greater than @a key.
+     *
+     * @param key  key to search for
+     * @return  iterator to the first key > @a key, or @a end() if
+     *          there is no such key
+     */
+    iterator upper_bound(key_view key) const {
+        return trie.upper_bound(key);
+    }
+
+    /**
+     * Finds the first key in the map that is greater than the
+     * @a length bytes at @a key.
+     */
+    iterator upper_bound(const char *key, size_t length) const {
+        return trie.upper_bound(key, length);
+    }
+
+    /**
+     * Finds the range of keys equal to @a key.
+     *
+     * @param key  key to search for
+     * @return  pair of lower_bound(key) and upper_bound(key)
+     */
+    std::pair<iterator, iterator> equal_range(key_view key) const {
+        return trie.equal_range(key);
+    }
+
+    /**
+     * Finds the range of keys equal to the @a length bytes at @a key.
+     */
+    std::pair<iterator, iterator> equal_range(const char *key,
+                                              size_t length) const {
+        return trie.equal_range(key, length);
+    }
+
+    /**
+     * Finds all the keys that start with @a prefix.
+     *
+     * This function is an extension to the standard STL interface. No
+     * keys are copied: the range is found with a single descent
+     * through the trie.
+     *
+     * O(m + c log c)  m = length of the prefix, c = size of the
+     * container the prefix ends in, if any
+     *
+     * @param prefix  prefix to search for
+     * @return  range of iterators over the keys that start with
+     *          @a prefix, in byte order
+     */
+    std::pair<iterator, iterator> prefix_match(key_view prefix) const {
+        return trie.prefix_match(prefix);
+    }
+
+    /**
+     * Finds all the keys that start with the @a length bytes at
+     * @a prefix.
+     */
+    std::pair<iterator, iterator> prefix_match(const char *prefix,
+                                               size_t length) const {
+        return trie.prefix_match(prefix, length);
+    }
+
+    /**
+     * Calls a function on every key/value pair in the map, in key order.
+     *
+     * This function is an extension to the standard STL interface. See
+     * hat_set::for_each().
+     *
+     * O(n)  n = number of keys in the map
+     *
+     * @param f  function or function object called as
+     *           <code>f(key_view key, mapped_type &value)</code>. @a key
+     *           is only valid during the call. @a value may be modified,
+     *           but the map must not be until this function returns
+     * @return  @a f, after it has been called on every pair
+     */
+    template <class F>
+    F for_each(F f) const {
+        return trie.for_each(f);
+    }
+
+    /**
+     * Calls a function on every key/value pair in the map whose key
+     * starts with @a prefix, in key order. See for_each().
+     */
+    template <class F>
+    F for_each_prefix(key_view prefix, F f) const {
+        return trie.for_each_prefix(prefix, f);
+    }
+
+    /**
+     * Calls a function on every key/value pair in the map whose key
+     * starts with the @a length bytes at @a prefix.
+     */
+    template <class F>
+    F for_each_prefix(const char *prefix, size_t length, F f) const {
+        return trie.for_each_prefix(prefix, length, f);
+    }
+
+#if __cplusplus >= 201103L
+    /**
+     * Calls a function on every key/value pair in the map, on several
+     * threads, in no particular order.
+     *
+     * This function is an extension to the standard STL interface. See
+     * hat_trie::parallel_for_each().
+     *
+     * @param f        function or function object called as
+     *                 <code>f(key_view key, mapped_type &value)</code>
+     * @param combine  called as <code>combine(F &into, const F &from)
+     *                 </code> to fold the threads' copies of @a f
+     * @param threads  number of threads. 0 means one for every core
+     * @return  the copies of @a f, folded together
+     */
+    template <class F, class C>
+    F parallel_for_each(F f, C combine, unsigned threads = 0) const {
+        return trie.parallel_for_each(f, combine, threads);
+    }
+#endif
+
+    /**
+     * Swaps the data in two hat_map objects.
+     *
+     * O(1)
+     *
+     * @param rhs  hat_map object to swap data with
+     */
+    void swap(_self &rhs) {
+        trie.swap(rhs.trie);
+    }
+
+    /**
+     * Prints the hierarchical structure of the map's keys.
+     *
+     * See hat_set::print().
+     */
+    void print(std::ostream &out = std::cout) const {
+        trie.print(out);
+    }
+
+    bool operator<(const _self &rhs) {
+        return trie < rhs.trie;
+    }
+
+    bool operator<=(const _self &rhs) {
+        return trie <= rhs.trie;
+    }
+
+    bool operator>(const _self &rhs) {
+        return trie > rhs.trie;
+    }
+
+    bool operator>=(const _self &rhs) {
+        return trie >= rhs.trie;
+    }
+
+    bool operator==(const _self &rhs) {
+        return trie == rhs.trie;
+    }
+
+    bool operator!=(const _self &rhs) {
+        return trie != rhs.trie;
+    }
+
+  private:
+    hat_trie_type trie;
+
+};
+
+/**
+ * Overload of swap for hat_maps, found through argument-dependent lookup.
+ *
+ * @param lhs, rhs  hat_map objects to swap
+ */
+template <class T, class H, class A>
+void swap(hat_map<std::string, T, H, A> &lhs,
+          hat_map<std::string, T, H, A> &rhs) {
+    lhs.swap(rhs);
+}
+
+}  // namespace stx
+
+#endif
@@ -26,29 +26,89 @@
 
 namespace stx {
 
-template <class T> class hat_set;
+template <class T, class H = shift_add_xor_hash,
+          class A = std::allocator<char> > class hat_set;
+
+/// Adapts a function on words to the function on words and values that
+/// hat_trie::for_each() calls
+template <class F>
+struct word_visitor {
+    F f;
+
+    word_visitor(const F &f) : f(f) { }
+
+    void operator()(key_view word, no_value &) {
+        f(word);
+    }
+};
+
+/// Adapts a function that folds one copy of a function on words into
+/// another to the word_visitors hat_trie::parallel_for_each() copies
+template <class F, class C>
+struct visitor_combiner {
+    C combine;
+
+    visitor_combiner(const C &combine) : combine(combine) { }
+
+    void operator()(word_visitor<F> &into, const word_visitor<F> &from) {
+        combine(into.f, from.f);
+    }
+};
 
 /**
  * @brief HAT-trie based set that implements most of the STL set interface
  *
- * Note: the only available template parameter is std::string. Using
- * any other template parameter will result in a compile-time error.
+ * Words are byte strings: they may contain NULL characters and bytes
+ * >= 0x80 (UTF-8, binary IDs). Lookups take a key_view, which points at
+ * a key's bytes without copying them (std::string_view under C++17), or
+ * an explicit (const char *, size_t) pair, so keys never have to be
+ * copied into a std::string.
+ *
+ * @a H is the hash policy used inside the trie's containers. The
+ * default, shift_add_xor_hash, is the paper's hash function; word_hash
+ * is faster for long keys.
+ *
+ * @a A is the allocator the trie's nodes and containers are allocated
+ * with. See slab_allocator.
+ *
+ * Note: the only available key type is std::string. Using any other
+ * key type will result in a compile-time error.
  */
-template <>
-class hat_set<std::string> {
+template <class H, class A>
+class hat_set<std::string, H, A> {
 
   private:
-    typedef hat_trie<std::string> hat_trie_type;
-    typedef hat_set<std::string>  _self;
+    typedef hat_trie<std::string, H, A> hat_trie_type;
+    typedef hat_set<std::string, H, A>  _self;
 
   public:
     // STL types
-    typedef hat_trie_type::size_type         size_type;
-    typedef hat_trie_type::key_type          key_type;
-    typedef hat_trie_type::value_type        value_type;
+    typedef typename hat_trie_type::size_type       size_type;
+    typedef typename hat_trie_type::key_type        key_type;
+    typedef typename hat_trie_type::value_type      value_type;
+    typedef typename hat_trie_type::allocator_type  allocator_type;
+
+    typedef typename hat_trie_type::iterator        iterator;
+    typedef typename hat_trie_type::const_iterator  const_iterator;
+    typedef typename hat_trie_type::reverse_iterator
+            reverse_iterator;
+    typedef typename hat_trie_type::const_reverse_iterator
+            const_reverse_iterator;
+
+#if __cplusplus >= 201103L
+    /**
+     * @brief Lets a thread use what it finds in the set while another
+     * thread changes it. See hat_trie_traits::concurrent_readers and
+     * hat_trie::read_guard
+     */
+    class read_guard {
+      public:
+        explicit read_guard(const hat_set &set) : _guard(set.trie) { }
 
-    typedef hat_trie_type::iterator          iterator;
-    typedef hat_trie_type::const_iterator    const_iterator;
+      private:
+        typename hat_trie_type::read_guard _guard;
+    };
+#endif
 
     /**
      * Default constructor.
@@ -57,18 +117,22 @@ class hat_set<std::string> {
      *
      * @param traits     hat trie customization traits
      * @param ah_traits  array hash customization traits
+     * @param alloc      allocator to get memory from
      */
     hat_set(const hat_trie_traits &traits = hat_trie_traits(),
-            const array_hash_traits &ah_traits = array_hash_traits()) :
-            trie(traits, ah_traits) { }
+            const array_hash_traits &ah_traits = array_hash_traits(),
+            const allocator_type &alloc = allocator_type()) :
+            trie(traits, ah_traits, alloc) { }
 
     /**
      * Array hash traits constructor.
      *
      * @param ah_traits  array hash customization traits
+     * @param alloc      allocator to get memory from
      */
-    hat_set(const array_hash_traits &ah_traits) :
-            trie(ah_traits) { }
+    hat_set(const array_hash_traits &ah_traits,
+            const allocator_type &alloc = allocator_type()) :
+            trie(ah_traits, alloc) { }
 
     /**
      * Builds a HAT set from the data in [first, last).
@@ -81,8 +145,28 @@ class hat_set<std::string> {
     template <class input_iterator>
     hat_set(const input_iterator &first, const input_iterator &last,
             const hat_trie_traits &traits = hat_trie_traits(),
-            const array_hash_traits &ah_traits = array_hash_traits()) :
-        trie(first, last, traits, ah_traits)
+            const array_hash_traits &ah_traits = array_hash_traits(),
+            const allocator_type &alloc = allocator_type()) :
+        trie(first, last, traits, ah_traits, alloc)
+    { }
+
+    /**
+     * Builds a HAT set from the sorted, distinct words in [first, last)
+     * without searching it. See bulk_load().
+     *
+     * O(n m)  n = elements in [first, last), m = length of the longest
+     * word
+     *
+     * @param first, last  iterators specifying a range of words, sorted
+     *                     in byte order, with no duplicates
+     */
+    template <class input_iterator>
+    hat_set(sorted_unique_t,
+            const input_iterator &first, const input_iterator &last,
+            const hat_trie_traits &traits = hat_trie_traits(),
+            const array_hash_traits &ah_traits = array_hash_traits(),
+            const allocator_type &alloc = allocator_type()) :
+        trie(sorted_unique, first, last, traits, ah_traits, alloc)
     { }
 
     /**
@@ -93,10 +177,58 @@ class hat_set<std::string> {
      * @param word  word to search for
      * @return  true iff @a word is in the trie
      */
-    bool exists(const key_type &word) const {
+    bool exists(key_view word) const {
         return trie.exists(word);
     }
 
+    /**
+     * Searches for a word of @a length bytes in the trie.
+     *
+     * O(m)  m = length of the string
+     */
+    bool exists(const char *word, size_t length) const {
+        return trie.exists(word, length);
+    }
+
+    /**
+     * Searches for several words at once.
+     *
+     * This function is an extension to the standard STL interface. The
+     * searches are interleaved so that their cache misses overlap, which
+     * makes this faster than calling exists() in a loop on a large set.
+     * See hat_trie::exists_batch().
+     *
+     * O(n m)  n = number of words, m = length of the longest word
+     *
+     * @param first, last  forward iterators over the words to search for
+     * @param out          output iterator that gets a bool for each word,
+     *                     in order: true iff it is in the set
+     * @return  @a out after the last result
+     */
+    template <class forward_iterator, class output_iterator>
+    output_iterator exists_batch(const forward_iterator &first,
+                                 const forward_iterator &last,
+                                 output_iterator out) const {
+        return trie.exists_batch(first, last, out);
+    }
+
+    /**
+     * Searches for several words at once, and gets iterators to them.
+     * See exists_batch().
+     *
+     * @param first, last  forward iterators over the words to search for
+     * @param out          output iterator that gets an iterator for each
+     *                     word, in order: to the word in the set,
+     *                     or end() if it isn't there
+     * @return  @a out after the last result
+     */
+    template <class forward_iterator, class output_iterator>
+    output_iterator find_batch(const forward_iterator &first,
+                               const forward_iterator &last,
+                               output_iterator out) const {
+        return trie.find_batch(first, last, out);
+    }
+
     /**
      * Counts the number of times a word appears in the trie.
      *
@@ -107,10 +239,20 @@ class hat_set<std::string> {
      * @param word  word to search for
      * @return  number of times @a word appears in the trie
      */
-    size_type count(const key_type &word) const {
+    size_type count(key_view word) const {
         return trie.count(word);
     }
 
+    /**
+     * Counts the number of times a word of @a length bytes appears in
+     * the trie.
+     *
+     * O(m)  m = length of the string
+     */
+    size_type count(const char *word, size_t length) const {
+        return trie.count(word, length);
+    }
+
     /**
      * Determines whether this set is empty.
      *
@@ -156,6 +298,15 @@ class hat_set<std::string> {
         return trie.hash_traits();
     }
 
+    /**
+     * Gets a copy of the allocator the set gets its memory from.
+     *
+     * O(1)
+     */
+    allocator_type get_allocator() const {
+        return trie.get_allocator();
+    }
+
     /**
      * Removes all the elements in the trie.
      */
@@ -215,6 +366,29 @@ class hat_set<std::string> {
         return trie.insert(word);
     }
 
+    /**
+     * Inserts a word of @a length bytes into the trie.
+     *
+     * O(m)  m = length of the string
+     *
+     * @param word    word to insert. May contain any bytes
+     * @param length  number of bytes in @a word
+     * @return  true if @a word is inserted into the trie, false if @a word
+     *          was already in the trie
+     */
+    bool insert(const char *word, size_t length) {
+        return trie.insert(word, length);
+    }
+
+    /**
+     * Inserts the word viewed by @a word into the trie.
+     *
+     * O(m)  m = length of the string
+     */
+    bool insert(key_view word) {
+        return trie.insert(word.data(), word.size());
+    }
+
     /**
      * Inserts several words into the trie.
      *
@@ -229,6 +403,48 @@ class hat_set<std::string> {
         trie.insert(first, last);
     }
 
+    /**
+     * Replaces the contents of the set with the words in [first, last),
+     * which must be sorted in byte order and have no duplicates.
+     *
+     * This function is an extension to the standard STL interface. It
+     * builds the trie in one pass, with every container allocated at its
+     * exact final size, and is much faster than inserting the words one
+     * by one. If the range is not sorted or has duplicates, the set is
+     * malformed.
+     *
+     * O(n m)  n = elements in [first, last), m = length of the longest
+     * word
+     *
+     * @param first, last  iterators specifying a range of words
+     */
+    template <class input_iterator>
+    void bulk_load(input_iterator first, const input_iterator &last) {
+        trie.bulk_load(first, last);
+    }
+
+#if __cplusplus >= 201103L
+    /**
+     * Replaces the contents of the set with the words in [first, last),
+     * inserting them on several threads.
+     *
+     * This function is an extension to the standard STL interface. The
+     * words are split up by their first byte and each group is inserted
+     * on one of the threads, so the set ends up exactly as inserting
+     * the words in order would leave it. See hat_trie::parallel_load().
+     *
+     * @param first, last  iterators specifying a range of words, in any
+     *                     order
+     * @param threads      number of threads to insert on. 0 means one
+     *                     for every core
+     */
+    template <class forward_iterator>
+    void parallel_load(const forward_iterator &first,
+                       const forward_iterator &last, unsigned threads = 0) {
+        trie.parallel_load(first, last, threads);
+    }
+#endif
+
     /**
      * Inserts several words into the trie.
      *
@@ -253,10 +469,20 @@ class hat_set<std::string> {
      *
      * @param word  word to erase
      */
-    size_type erase(const key_type &word) {
+    size_type erase(key_view word) {
         return trie.erase(word);
     }
 
+    /**
+     * Erases a word of @a length bytes from the trie.
+     *
+     * @param word    word to erase
+     * @param length  number of bytes in @a word
+     */
+    size_type erase(const char *word, size_t length) {
+        return trie.erase(word, length);
+    }
+
     /**
      * Erases a word from the trie.
      *
@@ -266,6 +492,16 @@ class hat_set<std::string> {
         trie.erase(pos);
     }
 
+    /**
+     * Erases the words in [first, last).
+     *
+     * @param first  iterator to the first word to erase
+     * @param last   iterator one past the last word to erase
+     */
+    void erase(const iterator &first, const iterator &last) {
+        trie.erase(first, last);
+    }
+
     /**
      * Gets an iterator to the first element in the trie.
      *
@@ -291,6 +527,30 @@ class hat_set<std::string> {
         return trie.end();
     }
 
+    /**
+     * Gets a reverse iterator to the last element in the trie.
+     *
+     * Reverse iterators visit the elements in descending byte order.
+     *
+     * @return  reverse iterator to the last element in the trie, or
+     *          rend() if the trie is empty
+     */
+    reverse_iterator rbegin() const {
+        return trie.rbegin();
+    }
+
+    /**
+     * Gets a reverse iterator to one before the first element in the
+     * trie.
+     *
+     * O(1)
+     *
+     * @return  reverse iterator to one before the first element
+     */
+    reverse_iterator rend() const {
+        return trie.rend();
+    }
+
     /**
      * Searches for @a word in the trie.
      *
@@ -300,10 +560,177 @@ class hat_set<std::string> {
      * @return  iterator to @a word in the trie, or @a end() if @a word
      *          is not found
      */
-    iterator find(const key_type &word) const {
+    iterator find(key_view word) const {
         return trie.find(word);
     }
 
+    /**
+     * Searches for a word of @a length bytes in the trie.
+     *
+     * O(m)  m = length of the string
+     */
+    iterator find(const char *word, size_t length) const {
+        return trie.find(word, length);
+    }
+
+    /**
+     * Finds the first word in the trie that is not less than @a word.
+     *
+     * O(m + c log c)  m = length of the string, c = size of the
+     * container @a word would be stored in (O(m + log c) if that
+     * container's order is cached)
+     *
+     * @param word  word to search for
+     * @return  iterator to the first word >= @a word, or @a end() if
+     *          there is no such word
+     */
+    iterator lower_bound(key_view word) const {
+        return trie.lower_bound(word);
+    }
+
+    /**
+     * Finds the first word in the trie that is not less than the
+     * @a length bytes at @a word.
+     */
+    iterator lower_bound(const char *word, size_t length) const {
+        return trie.lower_bound(word, length);
+    }
+
+    /**
+     * Finds the first word in the trie that is greater than @a word.
+     *
+     * @param word  word to search for
+     * @return  iterator to the first word > @a word, or @a end() if
+     *          there is no such word
+     */
+    iterator upper_bound(key_view word) const {
+        return trie.upper_bound(word);
+    }
+
+    /**
+     * Finds the first word in the trie that is greater than the
+     * @a length bytes at @a word.
+     */
+    iterator upper_bound(const char *word, size_t length) const {
+        return trie.upper_bound(word, length);
+    }
+
+    /**
+     * Finds the range of words equal to @a word.
+     *
+     * @param word  word to search for
+     * @return  pair of lower_bound(word) and upper_bound(word)
+     */
+    std::pair<iterator, iterator> equal_range(key_view word) const {
+        return trie.equal_range(word);
+    }
+
+    /**
+     * Finds the range of words equal to the @a length bytes at @a word.
+     */
+    std::pair<iterator, iterator> equal_range(const char *word,
+                                              size_t length) const {
+        return trie.equal_range(word, length);
+    }
+
+    /**
+     * Finds all the words that start with @a prefix.
+     *
+     * This function is an extension to the standard STL interface. No
+     * words are copied: the range is found with a single descent
+     * through the trie.
+     *
+     * O(m + c log c)  m = length of the prefix, c = size of the
+     * container the prefix ends in, if any
+     *
+     * @param prefix  prefix to search for
+     * @return  range of iterators over the words that start with
+     *          @a prefix, in byte order
+     */
+    std::pair<iterator, iterator> prefix_match(key_view prefix) const {
+        return trie.prefix_match(prefix);
+    }
+
+    /**
+     * Finds all the words that start with the @a length bytes at
+     * @a prefix.
+     */
+    std::pair<iterator, iterator> prefix_match(const char *prefix,
+                                               size_t length) const {
+        return trie.prefix_match(prefix, length);
+    }
+
+    /**
+     * Calls a function on every word in the set, in byte order.
+     *
+     * This function is an extension to the standard STL interface. It is
+     * faster than iterating because words are built in one reusable
+     * buffer instead of being copied out of the trie.
+     *
+     * O(n)  n = number of words in the set
+     *
+     * @param f  function or function object called as
+     *           <code>f(key_view word)</code>. @a word is only valid
+     *           during the call, and the set must not be modified until
+     *           this function returns
+     * @return  @a f, after it has been called on every word
+     */
+    template <class F>
+    F for_each(F f) const {
+        return trie.for_each(word_visitor<F>(f)).f;
+    }
+
+    /**
+     * Calls a function on every word in the set that starts with
+     * @a prefix, in byte order. See for_each().
+     *
+     * @param prefix  prefix to search for
+     * @param f       function to call
+     * @return  @a f, after it has been called on every matching word
+     */
+    template <class F>
+    F for_each_prefix(key_view prefix, F f) const {
+        return trie.for_each_prefix(prefix, word_visitor<F>(f)).f;
+    }
+
+    /**
+     * Calls a function on every word in the set that starts with the
+     * @a length bytes at @a prefix.
+     */
+    template <class F>
+    F for_each_prefix(const char *prefix, size_t length, F f) const {
+        return trie.for_each_prefix(prefix, length, word_visitor<F>(f)).f;
+    }
+
+#if __cplusplus >= 201103L
+    /**
+     * Calls a function on every word in the set, on several threads, in
+     * no particular order.
+     *
+     * This function is an extension to the standard STL interface.
+     * Subtrees are handed out as tasks, and idle threads steal them from
+     * busy ones. Every thread calls its own copy of @a f, and the copies
+     * are folded together with @a combine at the end. See
+     * hat_trie::parallel_for_each().
+     *
+     * O(n / t)  n = number of words in the set, t = number of threads
+     *
+     * @param f        function or function object called as
+     *                 <code>f(key_view word)</code>. The set must not be
+     *                 modified until this function returns
+     * @param combine  called as <code>combine(F &into, const F &from)
+     *                 </code>
+     * @param threads  number of threads. 0 means one for every core
+     * @return  the copies of @a f, folded together
+     */
+    template <class F, class C>
+    F parallel_for_each(F f, C combine, unsigned threads = 0) const {
+        return trie.parallel_for_each(word_visitor<F>(f),
+                                      visitor_combiner<F, C>(combine),
+                                      threads).f;
+    }
+#endif
+
     /**
      * Swaps the data in two hat_set objects.
      *
@@ -347,31 +774,31 @@ class hat_set<std::string> {
      *
      * @param out  output stream to print to. cout by default
      */
-    void print() {
-        trie.print();
+    void print(std::ostream &out = std::cout) const {
+        trie.print(out);
     }
 
-    bool operator<(const hat_set<std::string>& rhs) {
+    bool operator<(const _self &rhs) {
         return trie < rhs.trie;
     }
 
-    bool operator<=(const hat_set<std::string>& rhs) {
+    bool operator<=(const _self &rhs) {
         return trie <= rhs.trie;
     }
 
-    bool operator>(const hat_set<std::string>& rhs) {
+    bool operator>(const _self &rhs) {
         return trie > rhs.trie;
     }
 
-    bool operator>=(const hat_set<std::string>& rhs) {
+    bool operator>=(const _self &rhs) {
         return trie >= rhs.trie;
     }
 
-    bool operator==(const hat_set<std::string>& rhs) {
+    bool operator==(const _self &rhs) {
         return trie == rhs.trie;
     }
 
-    bool operator!=(const hat_set<std::string>& rhs) {
+    bool operator!=(const _self &rhs) {
         return trie != rhs.trie;
     }
 
@@ -380,21 +807,17 @@ class hat_set<std::string> {
 
 };
 
-}  // namespace stx
-
-namespace std {
-
 /**
- * Template overload of std::swap for hat_sets.
+ * Overload of swap for hat_sets, found through argument-dependent lookup.
  *
  * @param lhs, rhs  hat_set objects to swap
  */
-template <>
-void swap(stx::hat_set<string> &lhs, stx::hat_set<string> &rhs) {
+template <class H, class A>
+void swap(hat_set<std::string, H, A> &lhs, hat_set<std::string, H, A> &rhs) {
     lhs.swap(rhs);
 }
 
-}
+}  // namespace stx
 
 #endif
 
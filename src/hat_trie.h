@@ -25,7 +25,6 @@
 // insert into this container) is acceptable. No container will have more
 // values in it than BURST_THRESHOLD + 1.
 //   NO! it accumulates!
-// TODO documentation that limits string length to 65k characters
 // TODO visual studio compatibility
 // TODO document which allocation scheme is better for array_hash
 
@@ -36,45 +35,56 @@
 //    * size_type count(const key_type &) const
 //    * bool empty() const
 //    * iterator end()
-//      pair<iterator, iterator> equal_range(const key_type &) const
+//    * pair<iterator, iterator> equal_range(const key_type &) const
 //    * void erase(iterator)
 //    * void erase(const key_type &)
 //    * void erase(iterator, iterator)
 //    * iterator find(const key_type &) const
-//      allocator_type get_allocator() csont
+//    * allocator_type get_allocator() const
 //    ? pair<iterator, bool> insert(const value_type &)
 //    * iterator insert(iterator, const value_type &)
 //    * void insert(input_iterator first, input_iterator last)
 //    * key_compare key_comp() const
-//      iterator lower_bound(const key_type &) const
+//    * iterator lower_bound(const key_type &) const
 //      size_type max_size() const
-//      self_reference operator=(self)
-//      reverse_iterator rbegin()
-//      reverse_iterator rend()
+//    * self_reference operator=(self)
+//    * reverse_iterator rbegin()
+//    * reverse_iterator rend()
 //    * size_type size() const
 //    * void swap(self &)
-//      iterator upper_bound(const key_type &) const
+//    * iterator upper_bound(const key_type &) const
 //    * value_compare value_comp() const
 //
 //   additions:
 //    * bool exists() const
-//      hat_trie prefix_match(const key_type &) const
+//    * pair<iterator, iterator> prefix_match(const key_type &) const
+//    * F for_each(F) const
+//    * F for_each_prefix(const key_type &, F) const
 
 #ifndef HAT_TRIE_H
 #define HAT_TRIE_H
 
 #include <iostream>  // for std::ostream
 #include <string>
+#include <vector>
 #include <bitset>
 
 #include "array_hash.h"
+#include "epoch.h"
 
-namespace stx {
+#if __cplusplus >= 201103L
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#endif
 
-/// number of distinct characters a hat trie can store
-const int HT_ALPHABET_SIZE = 128;
+namespace stx {
 
-typedef array_hash<std::string> bucket;
+/// number of distinct characters a hat trie can store: every byte value
+const int HT_ALPHABET_SIZE = 256;
 
 /**
  * @brief Provides a way to tune the performance characteristics of a HAT-trie.
@@ -91,8 +101,12 @@ typedef array_hash<std::string> bucket;
 class hat_trie_traits {
 
   public:
-    hat_trie_traits(size_t burst_threshold = 16384) {
+    hat_trie_traits(size_t burst_threshold = 16384,
+                    bool hybrid_containers = false,
+                    bool concurrent_readers = false) {
         this->burst_threshold = burst_threshold;
+        this->hybrid_containers = hybrid_containers;
+        this->concurrent_readers = concurrent_readers;
     }
 
     /**
@@ -105,12 +119,53 @@ class hat_trie_traits {
      * Default 16384. Must be >= 0 and <= 32,768.
      */
     size_t burst_threshold;
+
+    /**
+     * If false, a full container is burst into a node with one pure
+     * container for every character its words start with.
+     *
+     * If true, containers may be hybrid, as in the HAT-trie paper: a
+     * hybrid container sits under a range of a node's characters and
+     * keeps the first character of each of its words. A full hybrid
+     * container is split in two by character range instead of being
+     * burst, and a full pure container is burst into a node with at
+     * most two containers under it. Skewed data makes far fewer small
+     * containers this way, at the cost of slightly longer keys in
+     * hybrid containers.
+     *
+     * Default false.
+     */
+    bool hybrid_containers;
+
+    /**
+     * If true, any number of threads may call exists(), count() and
+     * find() while one thread at a time inserts and erases words. No
+     * lookup takes a lock or waits for the writer to finish.
+     *
+     * The writer never changes anything a reader can see in place. It
+     * builds new container slots, containers and whole burst results
+     * off to the side and publishes each with a single store, and a
+     * container that needs more slots is replaced by a grown copy.
+     * Nodes get a full children array up front, so it never moves, and
+     * readers retry a node's child if the writer changed that node while
+     * they read it. Replaced memory is freed once every reader that
+     * could have seen it is done (see epoch_domain).
+     *
+     * A new word's value is stored before the word is published, but
+     * assigning to an existing word's value is a plain write that
+     * readers may see half done. Everything else (iterating, bounds,
+     * clear(), assignment, bulk_load(), parallel_load()) must not run
+     * while the trie changes. Needs C++11, and is ignored otherwise.
+     *
+     * Default false.
+     */
+    bool concurrent_readers;
 };
 
 /// Gets a reference to the string in the parameter
 template <class T> const std::string &ref(const T &t);
 
-const std::string &ref(const std::string &s) {
+inline const std::string &ref(const std::string &s) {
     return s;
 }
 
@@ -119,68 +174,323 @@ const std::string &ref(const std::pair<std::string, T> &p) {
     return p.first;
 }
 
+/// Tag type of sorted_unique
+struct sorted_unique_t { };
+
+/// Passed to a constructor to say its range is sorted by key and has
+/// no duplicate keys. See hat_trie::bulk_load()
+const sorted_unique_t sorted_unique = sorted_unique_t();
+
 // forward declarations
-struct htnode;
-struct ahnode;
+template <class T, class H, class A> struct htnode;
+template <class T, class H, class A> struct ahnode;
+template <class T, class H, class A> struct htnode_ptr;
 
 // Consolidates storage between bucket pointers and node pointers
+template <class T, class H, class A>
 union child_ptr {
-    ahnode *bucket;
-    htnode *node;
+    ahnode<T, H, A> *bucket;
+    htnode<T, H, A> *node;
 };
 
-// Stores information required by each hat trie node
+// valid values for an htnode_ptr
+enum { NODE_POINTER = 0, BUCKET_POINTER = 1 };
+
+/**
+ * Stores information required by each hat trie node
+ *
+ * Most nodes have only a handful of children, so children are stored
+ * in a dense array ordered by character. A child's position in the array
+ * is the number of occupied characters below it, counted with a popcount
+ * of the occupancy bitmap. Once a node has more than
+ * HT_ALPHABET_SIZE / 4 children, the array is promoted to a full
+ * HT_ALPHABET_SIZE array that is indexed by character directly.
+ */
+template <class T, class H, class A>
 struct htnode {
-    htnode(char ch = '\0') : ch(ch), parent(NULL) {
-        memset(children, NULL, sizeof(child_ptr) * HT_ALPHABET_SIZE);
+    typedef typename record_traits<T>::mapped_type mapped_type;
+
+    /// bitmap words needed for one bit per character
+    static const int BITMAP_SIZE = (HT_ALPHABET_SIZE + 63) / 64;
+
+    /// largest dense child array before promotion to a full array
+    static const int DENSE_LIMIT = HT_ALPHABET_SIZE / 4;
+
+    typedef typename rebind_alloc<A, child_ptr<T, H, A> >::type
+            child_allocator;
+
+    htnode(unsigned char ch = 0) : ch(ch), is_word(false), size(0), capacity(0),
+            version(0), parent(NULL), children(NULL) {
+        memset(occupied, 0, sizeof(occupied));
+        memset(types, 0, sizeof(types));
+    }
+
+    /// Frees the children array. Must be called before the node is
+    /// destroyed, with the allocator passed to set_child()
+    void free_children(const A &alloc) {
+        if (children) {
+            child_allocator(alloc).deallocate(children, capacity);
+            children = NULL;
+        }
     }
 
     /// Getter for the word field
-    bool word() const { return types[HT_ALPHABET_SIZE]; }
+    bool word() const { return load_acquire(is_word); }
 
     /// Setter for the word field
-    void set_word(bool b) { types[HT_ALPHABET_SIZE] = b; }
+    void set_word(bool b) { store_release(is_word, b); }
+
+    /// Determines whether this node has any children
+    bool has_children() const { return size > 0; }
+
+    /// Determines whether there is a child at @a index
+    bool has_child(int index) const {
+        return (occupied[index >> 6] >> (index & 63)) & 1;
+    }
+
+    /// Gets the child at @a index. Its pointer is NULL if there is none
+    child_ptr<T, H, A> child(int index) const {
+        child_ptr<T, H, A> result;
+        if (capacity == HT_ALPHABET_SIZE) {
+            result = children[index];
+        } else if (has_child(index)) {
+            result = children[_rank(index)];
+        } else {
+            result.node = NULL;
+        }
+        return result;
+    }
+
+    /// Gets the type of the child at @a index
+    uint8_t type(int index) const {
+        return (types[index >> 6] >> (index & 63)) & 1;
+    }
+
+    /// Gets the child at @a index and its type while another thread may
+    /// be changing the children. They are read again until no change
+    /// overlapped the read (see begin_write()). Only for nodes made full
+    /// by make_full(), whose children array never moves
+    htnode_ptr<T, H, A> read_child(int index) const {
+        for (;;) {
+            uint32_t v = load_acquire(version);
+            child_ptr<T, H, A> c;
+            c.node = load_relaxed(children[index].node);
+            uint64_t t = load_relaxed(types[index >> 6]);
+            fence_acquire();
+            if ((v & 1) == 0 && load_relaxed(version) == v) {
+                return htnode_ptr<T, H, A>(c, (t >> (index & 63)) & 1);
+            }
+        }
+    }
+
+    /// Marks the start of a change to the children, so that read_child()
+    /// ignores what it reads until the matching end_write()
+    void begin_write() {
+        store_relaxed(version, version + 1);
+        fence_release();
+    }
+
+    /// Marks the end of a change to the children
+    void end_write() {
+        store_release(version, version + 1);
+    }
+
+    /// Switches to a full children array indexed by character, which
+    /// never moves again. Allocated with @a alloc
+    void make_full(const A &alloc) {
+        if (capacity != HT_ALPHABET_SIZE) {
+            _reallocate(HT_ALPHABET_SIZE, alloc);
+        }
+    }
+
+    /// Adds a child at @a index, or replaces the child already there.
+    /// The children array is allocated with @a alloc
+    void set_child(int index, const htnode_ptr<T, H, A> &n, const A &alloc) {
+        // Full arrays may be read by read_child() as they change, so their
+        // words are stored whole.
+        uint64_t bit = 1ULL << (index & 63);
+        uint64_t t = types[index >> 6];
+        store_relaxed(types[index >> 6],
+                      n.type == BUCKET_POINTER ? t | bit : t & ~bit);
+
+        if (!has_child(index)) {
+            if (size == capacity) {
+                _grow(alloc);
+            }
+            if (capacity != HT_ALPHABET_SIZE) {
+                // Make room in the dense array.
+                int pos = _rank(index);
+                memmove(children + pos + 1, children + pos,
+                        (size - pos) * sizeof(child_ptr<T, H, A>));
+            }
+            occupied[index >> 6] |= bit;
+            ++size;
+        }
+
+        if (capacity == HT_ALPHABET_SIZE) {
+            store_relaxed(children[index].node, n.ptr.node);
+        } else {
+            children[_rank(index)] = n.ptr;
+        }
+    }
+
+    /// Removes the child at @a index
+    void remove_child(int index) {
+        if (!has_child(index)) {
+            return;
+        }
+        if (capacity == HT_ALPHABET_SIZE) {
+            store_relaxed(children[index].node, (htnode *) NULL);
+        } else {
+            int pos = _rank(index);
+            memmove(children + pos, children + pos + 1,
+                    (size - pos - 1) * sizeof(child_ptr<T, H, A>));
+        }
+        occupied[index >> 6] &= ~(1ULL << (index & 63));
+        --size;
+    }
+
+    /// Prefetches the pointer to the child at @a index, if there is one
+    void prefetch_child(int index) const {
+        if (has_child(index)) {
+            prefetch_read(children + (capacity == HT_ALPHABET_SIZE ?
+                                      index : _rank(index)));
+        }
+    }
+
+    /// Finds the first child at or after @a index
+    /// @return  index of the child, or HT_ALPHABET_SIZE if there is none
+    int next(int index) const {
+        for (int i = index >> 6; i < BITMAP_SIZE && index < HT_ALPHABET_SIZE;
+                ++i, index = i << 6) {
+            uint64_t bits = occupied[i] & (~0ULL << (index & 63));
+            if (bits) {
+                return (i << 6) + ctz64(bits);
+            }
+        }
+        return HT_ALPHABET_SIZE;
+    }
+
+    /// Finds the last child at or before @a index
+    /// @return  index of the child, or -1 if there is none
+    int prev(int index) const {
+        if (index < 0) {
+            return -1;
+        }
+        uint64_t mask = ~0ULL >> (63 - (index & 63));
+        for (int i = index >> 6; i >= 0; --i, mask = ~0ULL) {
+            uint64_t bits = occupied[i] & mask;
+            if (bits) {
+                return i * 64 + 63 - clz64(bits);
+            }
+        }
+        return -1;
+    }
 
-    char ch;
+    unsigned char ch;
+    bool is_word;
+    uint16_t size;      // number of children
+    uint16_t capacity;  // size of the children array
+    uint32_t version;   // odd while the children are changing
+    mapped_type value;  // value of the word ending at this node (maps only)
     htnode *parent;
-    std::bitset<HT_ALPHABET_SIZE + 1> types;  // +1 is an end of word flag
-    child_ptr children[HT_ALPHABET_SIZE];  // pointers to children
+    uint64_t occupied[BITMAP_SIZE];  // one bit for each child
+    uint64_t types[BITMAP_SIZE];     // type of each child
+    child_ptr<T, H, A> *children;          // pointers to children
+
+  private:
+    // Gets the position of the child at index in the dense array
+    int _rank(int index) const {
+        int result = 0;
+        for (int i = 0; i < index >> 6; ++i) {
+            result += popcount64(occupied[i]);
+        }
+        if (index & 63) {
+            result += popcount64(occupied[index >> 6] <<
+                                 (64 - (index & 63)));
+        }
+        return result;
+    }
+
+    // Makes room for another child
+    void _grow(const A &alloc) {
+        int new_capacity = capacity == 0 ? 2 : capacity * 2;
+        if (new_capacity > DENSE_LIMIT) {
+            new_capacity = HT_ALPHABET_SIZE;
+        }
+        _reallocate(new_capacity, alloc);
+    }
+
+    // Moves the children to an array of new_capacity
+    void _reallocate(int new_capacity, const A &alloc) {
+        child_allocator a(alloc);
+        child_ptr<T, H, A> *p = a.allocate(new_capacity);
+        if (new_capacity == HT_ALPHABET_SIZE) {
+            // Spread the children out so they're indexed by character.
+            memset(p, 0, sizeof(child_ptr<T, H, A>) * HT_ALPHABET_SIZE);
+            for (int i = next(0), j = 0; i < HT_ALPHABET_SIZE;
+                    i = next(i + 1), ++j) {
+                p[i] = children[j];
+            }
+        } else if (size > 0) {
+            memcpy(p, children, size * sizeof(child_ptr<T, H, A>));
+        }
+        if (children) {
+            a.deallocate(children, capacity);
+        }
+        children = p;
+        capacity = new_capacity;
+    }
+
+    // nodes own their children arrays
+    htnode(const htnode &);
+    htnode &operator=(const htnode &);
 };
 
 // Stores information required by each array hash node
+template <class T, class H, class A>
 struct ahnode {
-    bucket *table;
-    char ch;
+    typedef typename record_traits<T>::mapped_type mapped_type;
+
+    array_hash<T, H, A> *table;
+    unsigned char ch;
+    unsigned char end;  // last character a hybrid container is under
     bool word;
-    htnode *parent;
+    mapped_type value;  // value of the word ending at this node (maps only)
+    htnode<T, H, A> *parent;
 
-    ahnode() : table(NULL), ch('\0'), word(false), parent(NULL) { }
-};
+    ahnode() : table(NULL), ch(0), end(0), word(false), parent(NULL) { }
 
-// valid values for an htnode_ptr
-enum { NODE_POINTER = 0, BUCKET_POINTER = 1 };
+    /// Determines whether this container is under a range of characters
+    /// and keeps the first character of its words
+    bool hybrid() const { return end != ch; }
+};
 
+template <class T, class H, class A>
 struct htnode_ptr {
-    child_ptr ptr;  // pointer to a node in the trie
+    typedef typename record_traits<T>::mapped_type mapped_type;
+
+    child_ptr<T, H, A> ptr;  // pointer to a node in the trie
     uint8_t type;   // type of the pointer
 
-    htnode_ptr() { ptr.node = NULL; }
+    htnode_ptr() : type(NODE_POINTER) { ptr.node = NULL; }
 
-    htnode_ptr(child_ptr ptr, uint8_t type) : ptr(ptr), type(type) { }
+    htnode_ptr(child_ptr<T, H, A> ptr, uint8_t type) : ptr(ptr), type(type) { }
 
-    htnode_ptr(htnode *node) {
+    htnode_ptr(htnode<T, H, A> *node) {
         ptr.node = node;
         type = NODE_POINTER;
     }
 
-    htnode_ptr(ahnode *bucket) {
+    htnode_ptr(ahnode<T, H, A> *bucket) {
         ptr.bucket = bucket;
         type = BUCKET_POINTER;
     }
 
     // Gets the status of the word flag
     bool word() {
-        return type == NODE_POINTER ? ptr.node->word() : ptr.bucket->word;
+        return type == NODE_POINTER ? ptr.node->word() :
+                load_acquire(ptr.bucket->word);
     }
 
     // Sets the word flag
@@ -188,53 +498,95 @@ struct htnode_ptr {
         if (type == NODE_POINTER) {
             ptr.node->set_word(value);
         } else if (type == BUCKET_POINTER) {
-            ptr.bucket->word = value;
+            store_release(ptr.bucket->word, value);
         }
     }
 
+    // Gets the value of the word ending at this node
+    mapped_type &value() const {
+        return type == NODE_POINTER ? ptr.node->value : ptr.bucket->value;
+    }
+
     // Gets the character
-    char ch() {
+    unsigned char ch() {
         return type == NODE_POINTER ? ptr.node->ch : ptr.bucket->ch;
     }
 
+    // Gets the last character this is under in its parent. Only
+    // differs from ch() for hybrid containers
+    unsigned char last() {
+        return type == NODE_POINTER ? ptr.node->ch : ptr.bucket->end;
+    }
+
+    // Determines whether this is a hybrid container
+    bool hybrid() {
+        return type == BUCKET_POINTER && ptr.bucket->hybrid();
+    }
+
     // Gets the parent node
-    htnode *parent() {
+    htnode<T, H, A> *parent() {
         return type == NODE_POINTER ? ptr.node->parent : ptr.bucket->parent;
     }
 };
 
-template <class T>
+template <class T, class H = shift_add_xor_hash,
+          class A = std::allocator<char> >
 class hat_trie;
 
 /// Trie-based data structure for managing sorted strings. Don't use this
 /// class directly. Use hat_set or hat_map
-template <>
-class hat_trie<std::string> {
+///
+/// Iteration visits keys in byte order. Children of a node are visited in
+/// character order, and the contents of each container are sorted the
+/// first time they are iterated over (the order is cached until the
+/// container is next modified).
+///
+/// @a H is the hash policy of the trie's containers (see array_hash).
+///
+/// @a A is the allocator every node, container and slot is allocated
+/// with (see array_hash and slab_allocator).
+template <class T, class H, class A>
+class hat_trie {
+
+  private:
+    typedef stx::htnode<T, H, A>      htnode;
+    typedef stx::ahnode<T, H, A>      ahnode;
+    typedef stx::child_ptr<T, H, A>   child_ptr;
+    typedef stx::htnode_ptr<T, H, A>  htnode_ptr;
+    typedef array_hash<T, H, A>       bucket;
+    typedef epoch_reclaimer<typename bucket::allocator_type> reclaimer;
 
   public:
     // STL types
-    typedef size_t           size_type;
-    typedef std::string      key_type;
-    typedef std::string      value_type;
-    typedef std::less<char>  key_compare;
+    typedef size_t                                  size_type;
+    typedef std::string                             key_type;
+    typedef T                                       value_type;
+    typedef typename record_traits<T>::mapped_type  mapped_type;
+    typedef std::less<char>                         key_compare;
+    typedef A                                       allocator_type;
 
     class iterator;
+    class reverse_iterator;
     typedef iterator const_iterator;
+    typedef reverse_iterator const_reverse_iterator;
 
     /**
      * Default constructor.
      */
     hat_trie(const hat_trie_traits &traits = hat_trie_traits(),
-             const array_hash_traits &ah_traits = array_hash_traits()) :
-            _traits(traits), _ah_traits(ah_traits) {
+             const array_hash_traits &ah_traits = array_hash_traits(),
+             const allocator_type &alloc = allocator_type()) :
+            _traits(traits), _ah_traits(ah_traits), _alloc(alloc),
+            _reclaimer(NULL) {
         _init();
     }
 
     /**
      * Array hash traits constructor.
      */
-    hat_trie(const array_hash_traits &ah_traits) :
-            _ah_traits(ah_traits) {
+    hat_trie(const array_hash_traits &ah_traits,
+             const allocator_type &alloc = allocator_type()) :
+            _ah_traits(ah_traits), _alloc(alloc), _reclaimer(NULL) {
         _init();
     }
 
@@ -246,17 +598,125 @@ class hat_trie<std::string> {
     template <class input_iterator>
     hat_trie(const input_iterator &first, const input_iterator &last,
              const hat_trie_traits &traits = hat_trie_traits(),
-             const array_hash_traits &ah_traits = array_hash_traits()) :
-             _traits(traits), _ah_traits(ah_traits) {
+             const array_hash_traits &ah_traits = array_hash_traits(),
+             const allocator_type &alloc = allocator_type()) :
+             _traits(traits), _ah_traits(ah_traits), _alloc(alloc),
+             _reclaimer(NULL) {
         _init();
         insert(first, last);
     }
 
+    /**
+     * Builds a HAT-trie from the sorted, distinct data in [first, last).
+     * See bulk_load().
+     *
+     * @param first, last  iterators specifying a range of elements,
+     *                     sorted by key, with no duplicate keys
+     */
+    template <class input_iterator>
+    hat_trie(sorted_unique_t,
+             const input_iterator &first, const input_iterator &last,
+             const hat_trie_traits &traits = hat_trie_traits(),
+             const array_hash_traits &ah_traits = array_hash_traits(),
+             const allocator_type &alloc = allocator_type()) :
+             _traits(traits), _ah_traits(ah_traits), _alloc(alloc),
+             _reclaimer(NULL) {
+        _init();
+        bulk_load(first, last);
+    }
+
+    /**
+     * Copy constructor. The copy shares @a rhs's allocator.
+     *
+     * The trie's structure is cloned node by node, and every container
+     * is copied slot by slot, so no key is searched for or rehashed.
+     *
+     * O(n)  n = number of nodes, containers and slots in @a rhs
+     */
+    hat_trie(const hat_trie &rhs) :
+            _traits(rhs._traits), _ah_traits(rhs._ah_traits),
+            _alloc(rhs._alloc), _reclaimer(NULL) {
+        _set_concurrent(_traits.concurrent_readers);
+        _root = _clone(rhs._root, NULL);
+        _size = rhs._size;
+    }
+
+    /**
+     * Assignment operator. The trie keeps its own allocator. See the
+     * copy constructor.
+     */
+    hat_trie &operator=(const hat_trie &rhs) {
+        if (this != &rhs) {
+            _set_concurrent(rhs._traits.concurrent_readers);
+            htnode *root = _clone(rhs._root, NULL);
+            _destroy(_root);
+            _root = root;
+            _size = rhs._size;
+            _traits = rhs._traits;
+            _ah_traits = rhs._ah_traits;
+        }
+        return *this;
+    }
+
+#if __cplusplus >= 201103L
+    /**
+     * Move constructor. Takes over @a rhs's nodes and allocator, so
+     * iterators into @a rhs now point into this trie.
+     *
+     * @a rhs is left empty, on a shared root that nothing is ever added
+     * to. Its first insertion gives it a root of its own.
+     *
+     * O(1)
+     */
+    hat_trie(hat_trie &&rhs) noexcept :
+            _traits(rhs._traits), _ah_traits(rhs._ah_traits),
+            _alloc(rhs._alloc), _root(rhs._root), _size(rhs._size),
+            _reclaimer(rhs._reclaimer) {
+        rhs._root = _empty_root();
+        rhs._size = 0;
+        rhs._reclaimer = NULL;
+    }
+
+    /**
+     * Move assignment operator. Swaps the two tries, so the old contents
+     * of this one are freed along with @a rhs.
+     *
+     * O(1)
+     */
+    hat_trie &operator=(hat_trie &&rhs) noexcept {
+        swap(rhs);
+        return *this;
+    }
+#endif
+
     virtual ~hat_trie() {
-        delete _root;
+        _destroy(_root);
         _root = NULL;
+        _set_concurrent(false);
     }
 
+#if __cplusplus >= 201103L
+    /**
+     * @brief Lets a thread use what it finds in a trie while another
+     * thread changes it
+     *
+     * See hat_trie_traits::concurrent_readers. exists(), count() and
+     * find() pin the trie by themselves, but the iterator find() returns
+     * may only be dereferenced while a guard made before the call is
+     * still alive. Guards nest cheaply, so a thread that makes many
+     * lookups in a row should hold one around all of them. A guard on a
+     * trie that isn't concurrent does nothing.
+     */
+    class read_guard {
+      public:
+        explicit read_guard(const hat_trie &trie) :
+                _guard(trie._domain()) { }
+
+      private:
+        epoch_domain::guard _guard;
+    };
+#endif
+
     /**
      * Searches for a word in the trie.
      *
@@ -265,23 +725,108 @@ class hat_trie<std::string> {
      * @param word  word to search for
      * @return  true iff @a s is in the trie
      */
-    bool exists(const key_type &word) const {
+    bool exists(key_view word) const {
+        return exists(word.data(), word.size());
+    }
+
+    /**
+     * Searches for a word in the trie.
+     *
+     * Words are sequences of bytes. They may contain NULL characters
+     * and bytes >= 0x80.
+     *
+     * @param word    word to search for
+     * @param length  number of bytes in @a word
+     * @return  true iff @a word is in the trie
+     */
+    bool exists(const char *word, size_t length) const {
+#if __cplusplus >= 201103L
+        epoch_domain::guard pin(_domain());
+#endif
         // Locate s in the trie's structure.
-        const char *ps = word.c_str();
-        htnode_ptr n = _locate(ps);
+        const char *ps = word;
+        const char *stop = word + length;
+        htnode_ptr n = _locate(ps, stop);
 
-        if (*ps == '\0') {
+        if (ps == stop) {
             // The string was found in the trie's structure
             return n.word();
         }
         if (n.type == BUCKET_POINTER) {
             // Determine whether the remainder of the string is inside
             // a container or not
-            return n.ptr.bucket->table->exists(ps);
+            return _table(n.ptr.bucket)->exists(ps, stop - ps);
         }
         return false;
     }
 
+    /**
+     * Searches for several words at once.
+     *
+     * This function is an extension to the standard STL interface. The
+     * searches are interleaved: groups of words move down the trie
+     * together, each taking one step in turn, and every step prefetches
+     * the memory the word's next step reads. The cache misses of the
+     * words in a group overlap instead of being waited on one after the
+     * other, so this is faster than calling exists() in a loop once the
+     * trie doesn't fit in cache.
+     *
+     * O(n m)  n = number of words, m = length of the longest word
+     *
+     * @param first, last  forward iterators over the words to search
+     *                     for. Each must dereference to a key_view, or to
+     *                     something that stays alive while it converts to
+     *                     one
+     * @param out          output iterator that gets a bool for each word,
+     *                     in order: true iff it is in the trie
+     * @return  @a out after the last result
+     */
+    template <class forward_iterator, class output_iterator>
+    output_iterator exists_batch(forward_iterator first,
+                                 const forward_iterator &last,
+                                 output_iterator out) const {
+#if __cplusplus >= 201103L
+        epoch_domain::guard pin(_domain());
+#endif
+        _probe probes[_batch_size];
+        while (first != last) {
+            int n = _run_batch(first, last, probes);
+            for (int i = 0; i < n; ++i) {
+                *out = _exists(probes[i]);
+                ++out;
+            }
+        }
+        return out;
+    }
+
+    /**
+     * Searches for several words at once, and gets iterators to them.
+     * See exists_batch().
+     *
+     * @param first, last  forward iterators over the words to search for
+     * @param out          output iterator that gets an iterator for each
+     *                     word, in order: to the word in the trie, or
+     *                     end() if it isn't there
+     * @return  @a out after the last result
+     */
+    template <class forward_iterator, class output_iterator>
+    output_iterator find_batch(forward_iterator first,
+                               const forward_iterator &last,
+                               output_iterator out) const {
+#if __cplusplus >= 201103L
+        epoch_domain::guard pin(_domain());
+#endif
+        _probe probes[_batch_size];
+        while (first != last) {
+            int n = _run_batch(first, last, probes);
+            for (int i = 0; i < n; ++i) {
+                *out = _find(probes[i]);
+                ++out;
+            }
+        }
+        return out;
+    }
+
     /**
      * Counts the number of times a word appears in the trie.
      *
@@ -290,10 +835,21 @@ class hat_trie<std::string> {
      * @param word  word to search for
      * @return  number of times @a word appears in the trie
      */
-    size_type count(const key_type &word) const {
+    size_type count(key_view word) const {
         return exists(word) ? 1 : 0;
     }
 
+    /**
+     * Counts the number of times a word appears in the trie.
+     *
+     * @param word    word to search for
+     * @param length  number of bytes in @a word
+     * @return  number of times @a word appears in the trie
+     */
+    size_type count(const char *word, size_t length) const {
+        return exists(word, length) ? 1 : 0;
+    }
+
     /**
      * Determines whether this container is empty.
      *
@@ -327,6 +883,13 @@ class hat_trie<std::string> {
         return _ah_traits;
     }
 
+    /**
+     * Gets a copy of the allocator the trie gets its memory from.
+     */
+    allocator_type get_allocator() const {
+        return _alloc;
+    }
+
     /**
      * Prints the hierarchical structure of the trie.
      *
@@ -367,7 +930,7 @@ class hat_trie<std::string> {
      * Removes all the elements in the trie.
      */
     void clear() {
-        delete _root;
+        _destroy(_root);
         _init();
     }
 
@@ -399,9 +962,12 @@ class hat_trie<std::string> {
      * @return  true if @a word is inserted into the trie, false if @a word
      *          was already in the trie
      */
-    bool insert(const key_type &key) {
-        const std::string &word = ref(key);
-        return insert(word.c_str());
+    bool insert(const value_type &record) {
+        bool inserted;
+        const std::string &word = ref(record);
+        _find_or_insert(word.data(), word.size(),
+                        record_traits<T>::mapped(record), inserted);
+        return inserted;
     }
 
     /**
@@ -409,54 +975,74 @@ class hat_trie<std::string> {
      *
      * Uses C-strings instead of C++ strings. This function is no more
      * efficient than the string version. It is provided for convenience.
+     * In a map, @a word is given a default constructed value.
      *
      * @param word  word to insert
      * @return  true if @a word is inserted into the trie, false if @a word
      *          was already in the trie
      */
     bool insert(const char *word) {
-        const char *pos = word;
-        htnode_ptr n = _locate(pos);
-        if (*pos == '\0') {
-            // word was found in the trie's structure. Mark its location
-            // as the end of a word.
-            if (n.word() == false) {
-                n.set_word(true);
-                ++_size;
-                return true;
-            }
+        return insert(word, strlen(word));
+    }
 
-            // word was already in the trie
-            return false;
+    /**
+     * Inserts a word of @a length bytes into the trie.
+     *
+     * The word may contain any bytes, including NULL characters. In a
+     * map, @a word is given a default constructed value.
+     *
+     * @param word    word to insert
+     * @param length  number of bytes in @a word
+     * @return  true if @a word is inserted into the trie, false if @a word
+     *          was already in the trie
+     */
+    bool insert(const char *word, size_t length) {
+        bool inserted;
+        _find_or_insert(word, length, mapped_type(), inserted);
+        return inserted;
+    }
 
-        } else {
-            // word was not found in the trie's structure. Either make a
-            // new bucket for it or insert it into an already
-            // existing bucket
-            ahnode *at = NULL;
-            if (n.type == NODE_POINTER) {
-                // Make a new bucket for word
-                htnode *p = n.ptr.node;
-                int index = *pos;
-
-                at = new ahnode();
-                at->table = new bucket(_ah_traits);
-                at->ch = index;
-                at->word = false;
-
-                // Insert the new bucket into the trie's structure
-                at->parent = p;
-                p->children[index].bucket = at;
-                p->types[index] = BUCKET_POINTER;
-                ++pos;
-            } else if (n.type == BUCKET_POINTER) {
-                // The container for s already exists.
-                at = n.ptr.bucket;
-            }
+    /**
+     * Inserts the word viewed by @a word into the trie. In a map, the word
+     * is given a default constructed value.
+     *
+     * @return  true if @a word is inserted into the trie, false if
+     *          @a word was already in the trie
+     */
+    bool insert(key_view word) {
+        return insert(word.data(), word.size());
+    }
 
-            // Insert the rest of word into the container.
-            return _insert(at, pos);
-        }
+    /**
+     * Gets the value mapped to a word, inserting the word with a default
+     * constructed value if it isn't in the trie.
+     *
+     * Only one traversal of the trie is made unless the insertion
+     * bursts a container.
+     *
+     * @param word      word to search for
+     * @param length    number of bytes in @a word
+     * @param inserted  set to true if @a word was inserted into the trie,
+     *                  false if it was already in the trie
+     * @return  reference to the value mapped to @a word
+     */
+    mapped_type &find_or_insert(const char *word, size_t length,
+                                bool &inserted) {
+        return _find_or_insert(word, length, mapped_type(), inserted);
+    }
+
+    /**
+     * Gets the value mapped to a word, inserting the word mapped to
+     * @a value if it isn't in the trie.
+     *
+     * A new word's value is stored before readers can see the word (see
+     * hat_trie_traits::concurrent_readers).
+     *
+     * @return  reference to the value mapped to @a word
+     */
+    mapped_type &find_or_insert(const char *word, size_t length,
+                                const mapped_type &value, bool &inserted) {
+        return _find_or_insert(word, length, value, inserted);
     }
 
     /**
@@ -475,56 +1061,214 @@ class hat_trie<std::string> {
     }
 
     /**
-     * Inserts several words into the trie.
+     * Replaces the contents of the trie with the records in
+     * [first, last), which must be sorted by key in byte order and
+     * have no duplicate keys.
      *
-     * In standard STL sets, this function can dramatically increase
-     * performance if the iterator is set correctly. This performance
-     * gain is unachievable in a HAT-trie because the time required to
-     * verify that the iterator points to the right place is just as
-     * expensive as a regular insert operation. This function is
-     * provided to meet the standard, but that's about it.
+     * This function is an extension to the standard STL interface. The
+     * trie is built in one pass over the range, without searching it:
+     * records are held back until the input moves past the character
+     * they go under, and then put into a container that is allocated
+     * at its exact final size. Containers are never burst. Records that
+     * would overflow the burst threshold go under a new node instead.
+     * With hybrid containers, consecutive characters share a container
+     * until it is full.
      *
-     * @param word  word to insert
-     * @return  iterator to @a word in the trie
+     * If the range is not sorted or has duplicates, the trie is
+     * malformed.
+     *
+     * O(n m)  n = elements in [first, last), m = length of the longest
+     * key
+     *
+     * @param first, last  iterators specifying a range of elements
      */
-    iterator insert(const iterator &, const key_type &key) {
-        const std::string &word = ref(key);
-        insert(word);
-        return find(word);
+    template <class input_iterator>
+    void bulk_load(input_iterator first, const input_iterator &last) {
+        clear();
+        _loader l;
+        l.path.push_back(_root);
+        for (; first != last; ++first) {
+            _load(*first, l);
+        }
+        while (!l.path.empty()) {
+            _flush(l, l.batch.size());
+            l.path.pop_back();
+        }
     }
 
+#if __cplusplus >= 201103L
     /**
-     * Erases a word from the trie.
+     * Replaces the contents of the trie with the records in
+     * [first, last), inserting them on several threads.
      *
-     * @param pos  iterator to the word in the trie. Must point to a word
-     *             that exists somewhere in the trie.
+     * This function is an extension to the standard STL interface. The
+     * range doesn't have to be sorted, and may have duplicates. The
+     * records are sorted by the first byte of their keys, keeping their
+     * order, and each thread inserts whole groups into a trie of its own
+     * until none are left, largest groups first. Everything under a
+     * character of the root depends only on the records that start with
+     * it, so moving each group's subtree under the trie's root gives
+     * exactly the trie inserting the range in order would. Skewed data
+     * scales less: one thread inserts all the records that share a
+     * first byte.
+     *
+     * With hybrid containers, the root's characters share containers,
+     * so the records are inserted on the calling thread instead.
+     *
+     * The threads allocate through copies of the trie's allocator, so
+     * unless is_thread_safe_allocator says it is safe to share (it is
+     * for std::allocator, not for slab_allocator), the records are
+     * inserted on the calling thread too.
+     *
+     * O(n m / t)  n = elements in [first, last), m = length of the
+     * longest key, t = number of threads, plus O(n) to sort the records
+     *
+     * @param first, last  iterators specifying a range of elements. The
+     *                     range is read twice before it is inserted
+     * @param threads      number of threads to insert on. 0 means one
+     *                     for every core
      */
-    void erase(const iterator &pos) {
-        htnode *current = NULL;
-        if (pos._position.type == BUCKET_POINTER) {
-            ahnode *b = pos._position.ptr.bucket;
-            if (pos._word) {
-                b->word = false;
+    template <class forward_iterator>
+    void parallel_load(const forward_iterator &first,
+                       const forward_iterator &last, unsigned threads = 0) {
+        clear();
+        if (threads == 0) {
+            threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        if (_traits.hybrid_containers || threads == 1 ||
+                !is_thread_safe_allocator<A>::value) {
+            insert(first, last);
+            return;
+        }
+
+        // Sort the records by first byte. The empty key is the root's.
+        size_t begins[HT_ALPHABET_SIZE + 1] = { 0 };
+        for (forward_iterator it = first; it != last; ++it) {
+            const key_type &key = stx::ref(*it);
+            if (key.empty()) {
+                insert(*it);
             } else {
-                b->table->erase(pos._container_iterator);
+                ++begins[(unsigned char) key[0] + 1];
+            }
+        }
+        for (int i = 0; i < HT_ALPHABET_SIZE; ++i) {
+            begins[i + 1] += begins[i];
+        }
+        std::vector<forward_iterator> records(begins[HT_ALPHABET_SIZE]);
+        size_t ends[HT_ALPHABET_SIZE];
+        std::copy(begins, begins + HT_ALPHABET_SIZE, ends);
+        for (forward_iterator it = first; it != last; ++it) {
+            const key_type &key = stx::ref(*it);
+            if (!key.empty()) {
+                records[ends[(unsigned char) key[0]]++] = it;
             }
+        }
 
-            if (b->table->size() == 0 && b->word == false) {
-                current = b->parent;
-                delete b->table;
-                delete b;
-
-                // Mark the container's slot in its parent's children
-                // array as NULL.
-                for (int i = 0; i < HT_ALPHABET_SIZE; ++i) {
-                    if (current->children[i].bucket == b) {
-                        current->children[i].bucket = NULL;
-                        break;
+        // Groups go to the threads largest first, so a large group
+        // started last doesn't hold up the rest.
+        std::vector<int> groups;
+        for (int i = 0; i < HT_ALPHABET_SIZE; ++i) {
+            if (begins[i + 1] > begins[i]) {
+                groups.push_back(i);
+            }
+        }
+        std::sort(groups.begin(), groups.end(), _larger_group(begins));
+
+        // Containers are made for concurrent readers once they are in
+        // the trie.
+        hat_trie_traits traits = _traits;
+        traits.concurrent_readers = false;
+        std::vector<hat_trie *> subtries(HT_ALPHABET_SIZE);
+        std::atomic<size_t> next(0);
+        std::exception_ptr error;
+        std::atomic<bool> failed(false);
+        auto work = [&]() {
+            try {
+                for (size_t g; !failed && (g = next++) < groups.size(); ) {
+                    int ch = groups[g];
+                    hat_trie *t = new hat_trie(traits, _ah_traits, _alloc);
+                    subtries[ch] = t;
+                    for (size_t i = begins[ch]; i < begins[ch + 1]; ++i) {
+                        t->insert(*records[i]);
                     }
                 }
+            } catch (...) {
+                if (!failed.exchange(true)) {
+                    error = std::current_exception();
+                }
             }
+        };
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads && i < groups.size(); ++i) {
+            workers.push_back(std::thread(work));
+        }
+        work();
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
 
-        } else {
+        // Move each subtree under the root.
+        for (int ch = 0; ch < HT_ALPHABET_SIZE; ++ch) {
+            hat_trie *t = subtries[ch];
+            if (t == NULL) {
+                continue;
+            }
+            if (!failed) {
+                htnode_ptr n = htnode_ptr(t->_root->child(ch),
+                                          t->_root->type(ch));
+                t->_root->remove_child(ch);
+                _adopt(n, _root);
+                _root->set_child(ch, n, _alloc);
+                _size += t->_size;
+            }
+            delete t;
+        }
+        if (failed) {
+            clear();
+            std::rethrow_exception(error);
+        }
+    }
+#endif
+
+    /**
+     * Inserts several words into the trie.
+     *
+     * In standard STL sets, this function can dramatically increase
+     * performance if the iterator is set correctly. This performance
+     * gain is unachievable in a HAT-trie because the time required to
+     * verify that the iterator points to the right place is just as
+     * expensive as a regular insert operation. This function is
+     * provided to meet the standard, but that's about it.
+     *
+     * @param word  word to insert
+     * @return  iterator to @a word in the trie
+     */
+    iterator insert(const iterator &, const value_type &record) {
+        insert(record);
+        return find(ref(record));
+    }
+
+    /**
+     * Erases a word from the trie.
+     *
+     * @param pos  iterator to the word in the trie. Must point to a word
+     *             that exists somewhere in the trie.
+     */
+    void erase(const iterator &pos) {
+        htnode *current = NULL;
+        if (pos._position.type == BUCKET_POINTER) {
+            ahnode *b = pos._position.ptr.bucket;
+            if (pos._word) {
+                store_release(b->word, false);
+            } else {
+                b->table->erase(pos._container_iterator);
+            }
+
+            if (b->table->size() == 0 && b->word == false) {
+                current = _erase_bucket(b);
+            }
+
+        } else {
             current = pos._position.ptr.node;
             current->set_word(false);
         }
@@ -541,9 +1285,21 @@ class hat_trie<std::string> {
      *          container, either 1 if the word was removed from the
      *          trie or 0 if the word doesn't appear in the trie
      */
-    size_type erase(const key_type &key) {
-        const char *ps = ref(key).c_str();
-        htnode_ptr n = _locate(ps);
+    size_type erase(key_view key) {
+        return erase(key.data(), key.size());
+    }
+
+    /**
+     * Erases a word from the trie.
+     *
+     * @param word    word to erase
+     * @param length  number of bytes in @a word
+     * @return  number of words erased from the trie
+     */
+    size_type erase(const char *word, size_t length) {
+        const char *ps = word;
+        const char *stop = word + length;
+        htnode_ptr n = _locate(ps, stop);
         htnode *current = NULL;
         int result = 0;
 
@@ -551,24 +1307,18 @@ class hat_trie<std::string> {
             // The word is either in a container or is represented by the
             // container itself.
             ahnode *b = n.ptr.bucket;
-            result = b->table->erase(ps);
+            if (ps == stop) {
+                result = b->word ? 1 : 0;
+                store_release(b->word, false);
+            } else {
+                result = b->table->erase(ps, stop - ps);
+            }
             if (result > 0 && b->table->size() == 0 && b->word == false) {
                 // Erase the container.
-                current = b->parent;
-                delete b->table;
-                delete b;
-
-                // Mark the container's slot in its parent's children
-                // array as NULL.
-                for (int i = 0; i < HT_ALPHABET_SIZE; ++i) {
-                    if (current->children[i].bucket == b) {
-                        current->children[i].bucket = NULL;
-                        break;
-                    }
-                }
+                current = _erase_bucket(b);
             }
 
-        } else {
+        } else if (ps == stop && n.word()) {
             // The word is represented by a node in the trie. Set the word
             // field on the node to false.
             current = n.ptr.node;
@@ -589,9 +1339,14 @@ class hat_trie<std::string> {
      *                     last) are removed
      */
     void erase(iterator first, const iterator &last) {
-        while (first != last) {
-            erase(first);
-            ++first;
+        // Erasing a word invalidates every iterator, so copy the keys
+        // in the range before erasing any of them.
+        std::vector<key_type> keys;
+        for (; first != last; ++first) {
+            keys.push_back(first.key());
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            erase(keys[i]);
         }
     }
 
@@ -613,7 +1368,7 @@ class hat_trie<std::string> {
         // is pretty ugly. See the doc comment for the iterator class
         // for a description of why.
         iterator result;
-        result = _least(_root, result._cached_word);
+        result = _least(_root);
         return result;
     }
 
@@ -623,7 +1378,33 @@ class hat_trie<std::string> {
      * @return iterator to one past the last element in the trie
      */
     iterator end() const {
-        return iterator();
+        iterator result;
+        result._root = _root;
+        return result;
+    }
+
+    /**
+     * Gets a reverse iterator to the last element in the trie.
+     *
+     * If there are no elements in the trie, rend() is returned.
+     *
+     * O(d)  d = depth of the last element
+     *
+     * @return  reverse iterator to the last element in the trie
+     */
+    reverse_iterator rbegin() const {
+        iterator result = end();
+        return reverse_iterator(--result);
+    }
+
+    /**
+     * Gets a reverse iterator to one before the first element in the
+     * trie.
+     *
+     * @return  reverse iterator to one before the first element
+     */
+    reverse_iterator rend() const {
+        return reverse_iterator(end());
     }
 
     /**
@@ -633,17 +1414,36 @@ class hat_trie<std::string> {
      * @return  iterator to @a s in the trie. If @a s is not in the trie,
      *          returns an iterator to one past the last element
      */
-    iterator find(const key_type &key) const {
-        const std::string &word = ref(key);
-        const char *ps = word.c_str();
-        htnode_ptr n = _locate(ps);
+    iterator find(key_view key) const {
+        return find(key.data(), key.size());
+    }
 
-        iterator result;
-        if (*ps == '\0') {
+    /**
+     * Searches for a word in the trie.
+     *
+     * @param word    word to search for
+     * @param length  number of bytes in @a word
+     * @return  iterator to @a word in the trie, or end() if @a word is
+     *          not in the trie
+     */
+    iterator find(const char *word, size_t length) const {
+#if __cplusplus >= 201103L
+        epoch_domain::guard pin(_domain());
+#endif
+        const char *ps = word;
+        const char *stop = word + length;
+        htnode_ptr n = _locate(ps, stop);
+
+        iterator result = end();
+        if (ps == stop) {
             // The word is in the trie at the node returned by _locate
-            if (n.word()) {
+            if (n.word() && n.type == BUCKET_POINTER) {
+                // Keep the word flag just read. The writer may clear it
+                // before operator= would read it again.
+                result._position = n;
+                result._word = true;
+            } else if (n.word()) {
                 result = n;
-                result._cached_word = std::string(word.c_str());
             } else {
                 // The word is not a word in the trie
                 result = end();
@@ -651,14 +1451,13 @@ class hat_trie<std::string> {
         } else {
             if (n.type == BUCKET_POINTER) {
                 // The word could be in this container
-                ahnode *b = n.ptr.bucket;
-                bucket::iterator it = b->table->find(ps);
-                if (it != b->table->end()) {
+                bucket *table = _table(n.ptr.bucket);
+                typename bucket::iterator it = table->find(ps, stop - ps);
+                if (it != table->end()) {
                     // The word is in the trie
                     result._position = n;
                     result._word = false;
-                    result._cached_word = std::string(word.c_str(), ps);
-                    result._container_iterator = it;
+                    result._container_iterator = table->ordered(it);
                 } else {
                     // The word is not in the trie
                     result = end();
@@ -671,6 +1470,362 @@ class hat_trie<std::string> {
         return result;
     }
 
+    /**
+     * Finds the first word in the trie that is not less than @a key.
+     *
+     * Only the container @a key would be stored in is searched (and
+     * sorted, if its order isn't cached), so finding the bound is
+     * O(m + c log c) at worst, where c is the size of that container.
+     *
+     * @param key  key to search for
+     * @return  iterator to the first word >= @a key, or end() if there is
+     *          no such word
+     */
+    iterator lower_bound(key_view key) const {
+        return lower_bound(key.data(), key.size());
+    }
+
+    /**
+     * Finds the first word in the trie that is not less than @a key.
+     *
+     * @param key     key to search for
+     * @param length  number of bytes in @a key
+     * @return  iterator to the first word >= @a key, or end() if there is
+     *          no such word
+     */
+    iterator lower_bound(const char *key, size_t length) const {
+        iterator result = end();
+        const char *s = key;
+        const char *stop = key + length;
+        htnode *p = _root;
+        while (s != stop) {
+            int index = (unsigned char) *s;
+            child_ptr v = p->child(index);
+            if (v.bucket == NULL) {
+                // Nothing under p starts with s. Move to the next child
+                // of p, or past p if there isn't one.
+                htnode_ptr next = _next_child(p, index + 1);
+                if (next.ptr.node) {
+                    return result = _least(next);
+                }
+                return result = _skip(p);
+            }
+
+            if (p->type(index) == NODE_POINTER) {
+                // Keep moving down the trie structure.
+                ++s;
+                p = v.node;
+                continue;
+            }
+
+            // The rest of s is in the container v, if anywhere. Hybrid
+            // containers keep the character that leads to them.
+            ahnode *b = v.bucket;
+            if (!b->hybrid()) {
+                ++s;
+                if (s == stop && b->word) {
+                    // The container itself represents key.
+                    return result = htnode_ptr(b);
+                }
+            }
+            typename bucket::ordered_iterator it =
+                    b->table->lower_bound(s, stop - s);
+            if (it == b->table->ordered_end()) {
+                // Every word in the container is less than key.
+                return result = _skip(htnode_ptr(b));
+            }
+            result._position = htnode_ptr(b);
+            result._word = false;
+            result._container_iterator = it;
+            return result;
+        }
+
+        // key ends at p, so every word underneath p is >= key.
+        return result = _least(htnode_ptr(p));
+    }
+
+    /**
+     * Finds the first word in the trie that is greater than @a key.
+     *
+     * @param key  key to search for
+     * @return  iterator to the first word > @a key, or end() if there is
+     *          no such word
+     */
+    iterator upper_bound(key_view key) const {
+        return equal_range(key).second;
+    }
+
+    /**
+     * Finds the first word in the trie that is greater than @a key.
+     *
+     * @param key     key to search for
+     * @param length  number of bytes in @a key
+     * @return  iterator to the first word > @a key, or end() if there is
+     *          no such word
+     */
+    iterator upper_bound(const char *key, size_t length) const {
+        return equal_range(key, length).second;
+    }
+
+    /**
+     * Finds the range of words in the trie equal to @a key.
+     *
+     * @param key  key to search for
+     * @return  pair of lower_bound(key) and upper_bound(key). The range is
+     *          empty if @a key is not in the trie
+     */
+    std::pair<iterator, iterator> equal_range(key_view key) const {
+        return equal_range(key.data(), key.size());
+    }
+
+    /**
+     * Finds the range of words in the trie equal to @a key.
+     *
+     * @param key     key to search for
+     * @param length  number of bytes in @a key
+     * @return  pair of lower_bound(key) and upper_bound(key)
+     */
+    std::pair<iterator, iterator> equal_range(const char *key,
+                                              size_t length) const {
+        std::pair<iterator, iterator> result;
+        result.first = lower_bound(key, length);
+        result.second = result.first;
+        if (result.second != end() &&
+                result.second.key().compare(0, key_type::npos,
+                                            key, length) == 0) {
+            ++result.second;
+        }
+        return result;
+    }
+
+    /**
+     * Finds all the words in the trie that start with @a prefix.
+     *
+     * This function is an extension to the standard STL interface.
+     *
+     * The words are not copied anywhere. The trie is descended once to
+     * the node or container @a prefix leads to, and the range covers
+     * either that whole subtree or, inside a container, the run of
+     * sorted suffixes that start with the rest of @a prefix.
+     *
+     * @param prefix  prefix to search for
+     * @return  range of iterators over the words that start with
+     *          @a prefix, in byte order. The range is empty if no word
+     *          starts with @a prefix
+     */
+    std::pair<iterator, iterator> prefix_match(key_view prefix) const {
+        return prefix_match(prefix.data(), prefix.size());
+    }
+
+    /**
+     * Finds all the words in the trie that start with @a prefix.
+     *
+     * @param prefix  prefix to search for
+     * @param length  number of bytes in @a prefix
+     * @return  range of iterators over the words that start with
+     *          @a prefix, in byte order
+     */
+    std::pair<iterator, iterator> prefix_match(const char *prefix,
+                                               size_t length) const {
+        std::pair<iterator, iterator> result(end(), end());
+        const char *s = prefix;
+        const char *stop = prefix + length;
+        htnode_ptr n(_root);
+        while (s != stop) {
+            htnode *p = n.ptr.node;
+            int index = (unsigned char) *s;
+            child_ptr v = p->child(index);
+            if (v.bucket == NULL) {
+                // No word starts with prefix.
+                return result;
+            }
+
+            n = htnode_ptr(v, p->type(index));
+            if (!n.hybrid()) {
+                ++s;
+            }
+            if (n.type == BUCKET_POINTER && s != stop) {
+                // Only the suffixes in this container that start with
+                // the rest of prefix match.
+                ahnode *b = n.ptr.bucket;
+                std::pair<typename bucket::ordered_iterator,
+                          typename bucket::ordered_iterator> range;
+                range = b->table->prefix_range(s, stop - s);
+                if (range.first == range.second) {
+                    return result;
+                }
+                result.first._position = n;
+                result.first._word = false;
+                result.first._container_iterator = range.first;
+                result.second = result.first;
+                if (range.second == b->table->ordered_end()) {
+                    result.second = _skip(n);
+                } else {
+                    result.second._container_iterator = range.second;
+                }
+                return result;
+            }
+        }
+
+        // Every word underneath n starts with prefix.
+        result.first = _least(n);
+        result.second = _skip(n);
+        return result;
+    }
+
+    /**
+     * Calls a function on every word in the trie, in byte order.
+     *
+     * This function is an extension to the standard STL interface.
+     *
+     * Faster than iterating: words are built in a single buffer as the
+     * trie is walked, so no memory is allocated per word.
+     *
+     * @param f  function or function object called as
+     *           <code>f(key_view word, mapped_type &value)</code>. @a word
+     *           refers to the buffer and is only valid during the call.
+     *           The trie must not be modified while it is walked
+     * @return  @a f, after it has been called on every word
+     */
+    template <class F>
+    F for_each(F f) const {
+        key_type word;
+        _visit(htnode_ptr(_root), word, f);
+        return f;
+    }
+
+    /**
+     * Calls a function on every word in the trie that starts with
+     * @a prefix, in byte order.
+     *
+     * This function is an extension to the standard STL interface.
+     *
+     * @param prefix  prefix to search for
+     * @param f       function to call. See for_each()
+     * @return  @a f, after it has been called on every matching word
+     */
+    template <class F>
+    F for_each_prefix(key_view prefix, F f) const {
+        return for_each_prefix(prefix.data(), prefix.size(), f);
+    }
+
+    /**
+     * Calls a function on every word in the trie that starts with the
+     * @a length bytes at @a prefix, in byte order.
+     */
+    template <class F>
+    F for_each_prefix(const char *prefix, size_t length, F f) const {
+        key_type word;
+        const char *s = prefix;
+        const char *stop = prefix + length;
+        htnode_ptr n(_root);
+        while (s != stop) {
+            htnode *p = n.ptr.node;
+            int index = (unsigned char) *s;
+            child_ptr v = p->child(index);
+            if (v.bucket == NULL) {
+                // No word starts with prefix.
+                return f;
+            }
+
+            n = htnode_ptr(v, p->type(index));
+            if (!n.hybrid()) {
+                word += *s++;
+            }
+            if (n.type == BUCKET_POINTER && s != stop) {
+                // Only the suffixes in this container that start with
+                // the rest of prefix match.
+                ahnode *b = n.ptr.bucket;
+                std::pair<typename bucket::ordered_iterator,
+                          typename bucket::ordered_iterator> range;
+                range = b->table->prefix_range(s, stop - s);
+                _visit(range.first, range.second, word, f);
+                return f;
+            }
+        }
+
+        // Every word underneath n starts with prefix.
+        _visit(n, word, f);
+        return f;
+    }
+
+#if __cplusplus >= 201103L
+    /**
+     * Calls a function on every word in the trie, on several threads, in
+     * no particular order.
+     *
+     * This function is an extension to the standard STL interface. The
+     * trie is split into tasks: a node is one, and it makes one for each
+     * of its children. Containers are the leaves, and are walked slot by
+     * slot without being sorted. Every thread works through the tasks it
+     * makes, last first, so it stays in one subtree, and a thread that
+     * runs out takes the oldest task from another thread, which is
+     * usually the largest subtree left.
+     *
+     * Every thread calls its own copy of @a f. When they are done, the
+     * copies are folded into the first one with @a combine, so @a f can
+     * keep counts or other results of its own without locking.
+     *
+     * @code
+     * struct counter {
+     *     size_t n;
+     *     counter() : n(0) { }
+     *     void operator()(key_view, mapped_type &) { ++n; }
+     * };
+     * struct add {
+     *     void operator()(counter &into, const counter &from) {
+     *         into.n += from.n;
+     *     }
+     * };
+     * size_t words = trie.parallel_for_each(counter(), add()).n;
+     * @endcode
+     *
+     * O(n / t)  n = number of words, t = number of threads
+     *
+     * @param f        function or function object called as
+     *                 <code>f(key_view word, mapped_type &value)</code>,
+     *                 as with for_each(). The trie must not be modified
+     *                 while it is walked
+     * @param combine  called as <code>combine(F &into, const F &from)
+     *                 </code> to fold one thread's copy of @a f into
+     *                 another's
+     * @param threads  number of threads to walk the trie on. 0 means one
+     *                 for every core
+     * @return  the copies of @a f, folded together. If @a f or
+     *          @a combine throws, the exception is passed on once every
+     *          thread has stopped
+     */
+    template <class F, class C>
+    F parallel_for_each(F f, C combine, unsigned threads = 0) const {
+        if (threads == 0) {
+            threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        std::vector<_task_queue> queues(threads);
+        std::vector<F> copies(threads, f);
+        queues[0].tasks.push_back(htnode_ptr(_root));
+        _traversal t(queues);
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; ++i) {
+            workers.push_back(std::thread(&hat_trie::_work<F>, this,
+                                          std::ref(t), i,
+                                          std::ref(copies[i])));
+        }
+        _work(t, 0, copies[0]);
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
+        if (t.error) {
+            std::rethrow_exception(t.error);
+        }
+
+        for (unsigned i = 1; i < threads; ++i) {
+            combine(copies[0], copies[i]);
+        }
+        return copies[0];
+    }
+#endif
+
     /**
      * Swaps the data in two hat_trie objects.
      *
@@ -684,25 +1839,58 @@ class hat_trie<std::string> {
         swap(_root, rhs._root);
         swap(_size, rhs._size);
         swap(_traits, rhs._traits);
+        swap(_ah_traits, rhs._ah_traits);
+        swap(_alloc, rhs._alloc);
+        swap(_reclaimer, rhs._reclaimer);
     }
 
     /**
      * @brief Iterates over the elements in a HAT-trie
      *
-     * A HAT-trie iterator has to maintain a lot of state to determine
-     * its current position. The code to construct iterators is pretty
-     * ugly, but they have to be constructed incrementally because of
-     * the large amount of state they maintain.
+     * An iterator is a position in the trie: a node, or a container and
+     * a position among its sorted words. The path to the position isn't
+     * stored. Nodes and containers know their parents and characters, so
+     * moving around the trie never needs it, and key() rebuilds it on
+     * demand in a buffer that is reused until the iterator moves to
+     * another node or container. Copies start with an empty buffer, so
+     * copying an iterator is O(1) and never allocates.
+     *
+     * Moving backward mirrors moving forward: children are visited from
+     * the highest character to the lowest, and a node's own word comes
+     * after everything underneath it. An end() iterator remembers the
+     * root of its trie, so it can be decremented to the last word.
      */
     class iterator : public std::iterator<std::bidirectional_iterator_tag,
-                                          const key_type> {
+                                          const value_type> {
         friend class hat_trie;
+        friend class reverse_iterator;
 
       public:
         /**
          * Default constructor.
          */
-        iterator() { }
+        iterator() : _word(false), _root(NULL), _key_node(NULL),
+                     _key_depth(0) { }
+
+        /**
+         * Copy constructor. Doesn't copy the key buffer.
+         */
+        iterator(const iterator &rhs) : _position(rhs._position),
+                _container_iterator(rhs._container_iterator),
+                _word(rhs._word), _root(rhs._root), _key_node(NULL),
+                _key_depth(0) { }
+
+        /**
+         * Assignment operator. Doesn't copy the key buffer.
+         */
+        iterator &operator=(const iterator &rhs) {
+            _position = rhs._position;
+            _container_iterator = rhs._container_iterator;
+            _word = rhs._word;
+            _root = rhs._root;
+            _key_node = NULL;
+            return *this;
+        }
 
         /**
          * Moves the iterator forward.
@@ -717,19 +1905,22 @@ class hat_trie<std::string> {
                 if (_word) {
                     // Move into the actual container by setting word to false.
                     _word = false;
+                    _container_iterator =
+                            _position.ptr.bucket->table->ordered_begin();
                 } else {
                     // Move the iterator over the container's elements forward.
                     ++_container_iterator;
                 }
 
                 // If we aren't at the end of the container, stop here.
-                if (_container_iterator != _position.ptr.bucket->table->end()) {
+                if (_container_iterator !=
+                        _position.ptr.bucket->table->ordered_end()) {
                     return *this;
                 }
             }
 
             // Move to the next node in the trie.
-            return (*this = hat_trie::_next_word(_position, _cached_word));
+            return (*this = hat_trie::_next_word(_position));
         }
 
         /**
@@ -738,7 +1929,32 @@ class hat_trie<std::string> {
          * @return  self-reference
          */
         iterator &operator--() {
-            return *this;
+            if (_position.ptr.node == NULL) {
+                // Move from end() to the last word in the trie.
+                if (_root) {
+                    _move_to_last(hat_trie::_greatest(htnode_ptr(_root)));
+                }
+                return *this;
+            }
+
+            if (_position.type == BUCKET_POINTER && !_word) {
+                ahnode *b = _position.ptr.bucket;
+                if (_container_iterator != b->table->ordered_begin()) {
+                    // Move the iterator over the container's elements
+                    // backward.
+                    --_container_iterator;
+                    return *this;
+                }
+                if (b->word) {
+                    // The word the container represents comes before the
+                    // words stored in it.
+                    _word = true;
+                    return *this;
+                }
+            }
+
+            // Move to the previous node in the trie.
+            return _move_to_last(hat_trie::_prev_word(_position));
         }
 
         /**
@@ -766,33 +1982,88 @@ class hat_trie<std::string> {
         /**
          * Iterator dereference operator.
          *
-         * @return  string this iterator points to
+         * @return  record this iterator points to. In a set, this is
+         *          key(). In a map, this is a copy of the key and its
+         *          value; use key() and value() to get at them without
+         *          copying
          */
-        key_type operator*() const {
-            if (_word || _position.type == NODE_POINTER) {
-                // Print the word that has been cached over the trie traversal.
-                return _cached_word;
+        typename record_traits<T>::reference operator*() const {
+            return record_traits<T>::make(key(), value());
+        }
+
+        /**
+         * Gets the key this iterator points to.
+         *
+         * The key is built in a buffer owned by the iterator. The path
+         * to the current node or container is only rebuilt when the
+         * iterator has moved to another one, so iterating over a
+         * container costs one copy of each suffix and no allocations once
+         * the buffer is large enough.
+         *
+         * O(d)  d = depth of the current node or container, O(1) if the
+         * path is cached
+         *
+         * @return  string this iterator points to. The reference is
+         *          invalidated when the iterator is moved or destroyed
+         */
+        const key_type &key() const {
+            if (_key_node != _position.ptr.node) {
+                // Walk up to the root to rebuild the path.
+                _key_node = _position.ptr.node;
+                _key_depth = 0;
+                // Hybrid containers keep their characters with their words.
+                for (htnode_ptr n = _position; n.ptr.node && n.parent();
+                        n = htnode_ptr(n.parent())) {
+                    _key_depth += !n.hybrid();
+                }
+                _key.resize(_key_depth);
+                size_t i = _key_depth;
+                for (htnode_ptr n = _position; n.ptr.node && n.parent();
+                        n = htnode_ptr(n.parent())) {
+                    if (!n.hybrid()) {
+                        _key[--i] = n.ch();
+                    }
+                }
+            }
 
-            } else if (_position.type == BUCKET_POINTER) {
-                // Pull a word from the container.
-                return _cached_word + *_container_iterator;
+            _key.resize(_key_depth);
+            if (!_word && _position.type == BUCKET_POINTER) {
+                // Pull the rest of the word from the container.
+                _key.append(*_container_iterator,
+                            _container_iterator.length());
             }
+            return _key;
+        }
 
-            // should never get here
-            return "";
+        /**
+         * Gets the value mapped to the key this iterator points to.
+         *
+         * Only meaningful in maps. Must not be called on an end()
+         * iterator.
+         *
+         * @return  reference to the value stored in the trie
+         */
+        mapped_type &value() const {
+            if (_word || _position.type == NODE_POINTER) {
+                return _position.value();
+            }
+            return _container_iterator.value();
         }
 
         /**
          * Overloaded equivalence operator.
          *
          * @param rhs  iterator to compare against
-         * @return  true iff this iterator points to the same location as
+         * @return  true iff this iterator points to the same word as
          *          @a rhs
          */
-        bool operator==(const iterator &rhs) {
-            // TODO does iterator comparison need to be on more than
-            // just pointer?
-            return _position.ptr.bucket == rhs._position.ptr.bucket;
+        bool operator==(const iterator &rhs) const {
+            // Iterators into the same container have to be compared by
+            // their positions in the container as well.
+            return _position.ptr.node == rhs._position.ptr.node &&
+                   _word == rhs._word &&
+                   (_word ||
+                    _container_iterator == rhs._container_iterator);
         }
 
         /**
@@ -801,7 +2072,7 @@ class hat_trie<std::string> {
          * @param rhs  iterator to compare against
          * @return  true iff this iterator is not equal to @a rhs
          */
-        bool operator!=(const iterator &rhs) {
+        bool operator!=(const iterator &rhs) const {
             return !operator==(rhs);
         }
 
@@ -809,13 +2080,22 @@ class hat_trie<std::string> {
         // Current position in the trie
         htnode_ptr _position;
 
-        // Internal iterator across container types
-        typename bucket::iterator _container_iterator;
+        // Position among the words in the current container. Only used
+        // if _position is a container
+        typename bucket::ordered_iterator _container_iterator;
+
+        // True if the iterator points to the word the container itself
+        // represents rather than one of the words in it
         bool _word;
 
-        // Caches the word as we move up and down the trie and
-        // implicitly caches the path we followed as well
-        std::string _cached_word;
+        // Root of the trie. Lets end() be decremented
+        htnode *_root;
+
+        // Buffer for key(). Its first _key_depth bytes are the path to
+        // _key_node, or nothing if _key_node is NULL
+        mutable key_type _key;
+        mutable const void *_key_node;
+        mutable size_t _key_depth;
 
         /**
          * Special-purpose conversion constructor.
@@ -824,7 +2104,8 @@ class hat_trie<std::string> {
          * this function ensures that the iterator's internal iterator
          * across the elements in the container is properly initialized.
          */
-        iterator(htnode_ptr n) {
+        iterator(htnode_ptr n) : _root(NULL), _key_node(NULL),
+                                 _key_depth(0) {
             operator=(n);
         }
 
@@ -833,24 +2114,207 @@ class hat_trie<std::string> {
          *
          * If an iterator is assigned to a container pointer, this
          * function ensures that the iterator's internal iterator across
-         * the elements in the container is properly initialized.
+         * the elements in the container is properly initialized. The
+         * key buffer is kept: the trie can't have changed as the
+         * iterator moved.
+         *
+         * If the container represents a word, the iterator points at it,
+         * and the container isn't sorted until the iterator moves into
+         * it. find() relies on this, as concurrent readers can't sort.
          */
         iterator &operator=(htnode_ptr n) {
-            this->_position = n;
+            _leave(n);
+            _position = n;
             if (_position.type == BUCKET_POINTER) {
-                _container_iterator = _position.ptr.bucket->table->begin();
                 _word = _position.ptr.bucket->word;
+                _container_iterator = _word ?
+                        typename bucket::ordered_iterator() :
+                        _position.ptr.bucket->table->ordered_begin();
+            } else {
+                _container_iterator = typename bucket::ordered_iterator();
+                _word = false;
+            }
+            return *this;
+        }
+
+        /**
+         * Points the iterator at the last word in @a n: the greatest word
+         * in a container, or the word @a n represents.
+         */
+        iterator &_move_to_last(htnode_ptr n) {
+            _leave(n);
+            _position = n;
+            _word = false;
+            _container_iterator = typename bucket::ordered_iterator();
+            if (_position.type == BUCKET_POINTER) {
+                bucket *table = _position.ptr.bucket->table;
+                _container_iterator = table->ordered_end();
+                if (table->size() > 0) {
+                    --_container_iterator;
+                } else {
+                    _container_iterator = table->ordered_begin();
+                    _word = true;
+                }
             }
             return *this;
         }
 
+        /**
+         * Remembers the root of the trie before the iterator moves past
+         * either end of it to @a n.
+         */
+        void _leave(htnode_ptr n) {
+            if (n.ptr.node == NULL && _position.ptr.node) {
+                htnode *p = _position.type == NODE_POINTER ?
+                        _position.ptr.node : _position.parent();
+                while (p->parent) {
+                    p = p->parent;
+                }
+                _root = p;
+            }
+        }
     };
 
-  private:
-    hat_trie_traits _traits;
-    array_hash_traits _ah_traits;
-    htnode *_root;  // pointer to the root of the trie
-    size_type _size;  // number of distinct elements in the trie
+    /**
+     * @brief Iterates over the elements in a HAT-trie in descending order
+     *
+     * Wraps an iterator that points to the current element itself rather
+     * than one past it, as std::reverse_iterator does. key() returns a
+     * reference into the iterator's own buffer, so dereferencing a
+     * temporary copy the way std::reverse_iterator does would leave it
+     * dangling.
+     */
+    class reverse_iterator : public std::iterator<
+            std::bidirectional_iterator_tag, const value_type> {
+        friend class hat_trie;
+
+      public:
+        /**
+         * Default constructor.
+         */
+        reverse_iterator() { }
+
+        /**
+         * Moves the iterator to the next element in descending order.
+         *
+         * @return  self-reference
+         */
+        reverse_iterator &operator++() {
+            --_current;
+            return *this;
+        }
+
+        /**
+         * Moves the iterator to the previous element in descending order.
+         *
+         * @return  self-reference
+         */
+        reverse_iterator &operator--() {
+            if (_current._position.ptr.node == NULL) {
+                // Move from rend() to the first word in the trie.
+                if (_current._root) {
+                    _current = hat_trie::_least(htnode_ptr(_current._root));
+                }
+            } else {
+                ++_current;
+            }
+            return *this;
+        }
+
+        /**
+         * Moves the iterator forward.
+         *
+         * @return  copy of this iterator before it was moved
+         */
+        reverse_iterator operator++(int) {
+            reverse_iterator result = *this;
+            operator++();
+            return result;
+        }
+
+        /**
+         * Moves the iterator backward.
+         *
+         * @return  copy of this iterator before it was moved
+         */
+        reverse_iterator operator--(int) {
+            reverse_iterator result = *this;
+            operator--();
+            return result;
+        }
+
+        /**
+         * Iterator dereference operator. See iterator::operator*().
+         */
+        typename record_traits<T>::reference operator*() const {
+            return *_current;
+        }
+
+        /**
+         * Gets the key this iterator points to. See iterator::key().
+         */
+        const key_type &key() const {
+            return _current.key();
+        }
+
+        /**
+         * Gets the value mapped to the key this iterator points to.
+         */
+        mapped_type &value() const {
+            return _current.value();
+        }
+
+        /**
+         * Gets the forward iterator one past the element this iterator
+         * points to, as std::reverse_iterator::base() does.
+         *
+         * @return  iterator to the element after this one in ascending
+         *          order
+         */
+        iterator base() const {
+            iterator result = _current;
+            if (result._position.ptr.node == NULL) {
+                // rend() is one before the first element.
+                if (result._root) {
+                    result = hat_trie::_least(htnode_ptr(result._root));
+                }
+                return result;
+            }
+            return ++result;
+        }
+
+        /**
+         * Overloaded equivalence operator.
+         */
+        bool operator==(const reverse_iterator &rhs) const {
+            return _current == rhs._current;
+        }
+
+        /**
+         * Overloaded not-equivalence operator.
+         */
+        bool operator!=(const reverse_iterator &rhs) const {
+            return _current != rhs._current;
+        }
+
+      private:
+        // The element this iterator points to, or end() for rend()
+        iterator _current;
+
+        explicit reverse_iterator(const iterator &current) :
+                _current(current) { }
+    };
+
+  private:
+    hat_trie_traits _traits;
+    array_hash_traits _ah_traits;
+    allocator_type _alloc;
+    htnode *_root;  // pointer to the root of the trie
+    size_type _size;  // number of distinct elements in the trie
+
+    // Holds the memory the writer replaces until no reader can see it,
+    // if the trie has concurrent readers. NULL otherwise
+    reclaimer *_reclaimer;
 
     /**
      * Recursively prints the contents of the trie.
@@ -866,18 +2330,22 @@ class hat_trie<std::string> {
                 const std::string &space = "") const {
         if (n.type == BUCKET_POINTER) {
             ahnode *b = n.ptr.bucket;
-            if (b->ch != '\0') {
-                out << space << b->ch << " *";
-                if (b->word) {
-                    out << "~";
-                }
-                out << std::endl;
+            out << space << b->ch;
+            if (b->hybrid()) {
+                out << "-" << b->end;
+            }
+            out << " *";
+            if (b->word) {
+                out << "~";
             }
+            out << std::endl;
 
-            typename bucket::iterator it;
-            it = b->table->begin();
-            for (it = b->table->begin(); it != b->table->end(); ++it) {
-                out << space + "  " << *it << " ~" << std::endl;
+            typename bucket::ordered_iterator it;
+            for (it = b->table->ordered_begin(); it != b->table->ordered_end();
+                    ++it) {
+                out << space + "  ";
+                out.write(*it, it.length());
+                out << " ~" << std::endl;
             }
 
         } else if (n.type == NODE_POINTER) {
@@ -887,48 +2355,592 @@ class hat_trie<std::string> {
                 out << " ~";
             }
             out << std::endl;
-            for (int i = 0; i < HT_ALPHABET_SIZE; ++i) {
-                if (p->children[i].bucket) {
-                    _print(out, htnode_ptr(p->children[i], p->types[i]),
-                           space + "  ");
+            for (int i = p->next(0); i < HT_ALPHABET_SIZE; i = p->next(i + 1)) {
+                htnode_ptr child(p->child(i), p->type(i));
+                _print(out, child, space + "  ");
+                i = child.last();
+            }
+        }
+    }
+
+    /**
+     * Calls @a f on every word under a node or container.
+     *
+     * @param n     node or container to start from
+     * @param word  path to @a n. Restored before this function returns
+     * @param f     function to call. See for_each()
+     */
+    template <class F>
+    static void _visit(htnode_ptr n, key_type &word, F &f) {
+        if (n.type == BUCKET_POINTER) {
+            ahnode *b = n.ptr.bucket;
+            if (b->word) {
+                f(key_view(word), b->value);
+            }
+            _visit(b->table->ordered_begin(), b->table->ordered_end(), word,
+                   f);
+        } else {
+            htnode *p = n.ptr.node;
+            if (p->word()) {
+                f(key_view(word), p->value);
+            }
+            for (int i = p->next(0); i < HT_ALPHABET_SIZE; i = p->next(i + 1)) {
+                htnode_ptr child(p->child(i), p->type(i));
+                if (child.hybrid()) {
+                    _visit(child, word, f);
+                } else {
+                    word += (char) i;
+                    _visit(child, word, f);
+                    word.resize(word.size() - 1);
+                }
+                i = child.last();
+            }
+        }
+    }
+
+#if __cplusplus >= 201103L
+    /**
+     * Subtrees waiting to be walked by a parallel_for_each() thread.
+     * The thread takes them from the back, others steal from the front.
+     */
+    struct _task_queue {
+        std::mutex lock;
+        std::deque<htnode_ptr> tasks;
+    };
+
+    /**
+     * State the threads of a parallel_for_each() share.
+     */
+    struct _traversal {
+        std::vector<_task_queue> &queues;
+        std::atomic<size_t> pending;  // tasks queued or running
+        std::atomic<bool> failed;
+        std::exception_ptr error;     // set by the first thread to fail
+
+        _traversal(std::vector<_task_queue> &queues) :
+                queues(queues), pending(1), failed(false) { }
+    };
+
+    /**
+     * Runs the tasks of a parallel_for_each() on one thread until there
+     * are none left anywhere.
+     *
+     * @param t     shared state of the traversal
+     * @param self  index of this thread's queue
+     * @param f     this thread's copy of the function
+     */
+    template <class F>
+    void _work(_traversal &t, size_t self, F &f) const {
+        key_type word;
+        try {
+            while (!t.failed) {
+                htnode_ptr n;
+                if (!_take(t, self, n)) {
+                    if (t.pending == 0) {
+                        return;
+                    }
+                    // Another thread's task may still make more.
+                    std::this_thread::yield();
+                    continue;
                 }
+                _run(t, self, n, word, f);
+                --t.pending;
+            }
+        } catch (...) {
+            if (!t.failed.exchange(true)) {
+                t.error = std::current_exception();
+            }
+        }
+    }
+
+    /**
+     * Takes the newest task from a thread's own queue, or failing that,
+     * the oldest task from another thread's.
+     *
+     * @return  true if a task was put in @a n
+     */
+    static bool _take(_traversal &t, size_t self, htnode_ptr &n) {
+        for (size_t i = 0; i < t.queues.size(); ++i) {
+            _task_queue &q = t.queues[(self + i) % t.queues.size()];
+            std::lock_guard<std::mutex> lock(q.lock);
+            if (!q.tasks.empty()) {
+                if (i == 0) {
+                    n = q.tasks.back();
+                    q.tasks.pop_back();
+                } else {
+                    n = q.tasks.front();
+                    q.tasks.pop_front();
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Runs one task of a parallel_for_each(): calls @a f on the words a
+     * container holds, or on the word a node represents and queues its
+     * children.
+     *
+     * @param word  buffer for the words. Its contents are replaced
+     */
+    template <class F>
+    void _run(_traversal &t, size_t self, htnode_ptr n, key_type &word,
+              F &f) const {
+        _path(n, word);
+        if (n.type == BUCKET_POINTER) {
+            ahnode *b = n.ptr.bucket;
+            if (b->word) {
+                f(key_view(word), b->value);
+            }
+            b->table->for_each(_suffix_visitor<F>(word, f));
+            return;
+        }
+
+        htnode *p = n.ptr.node;
+        if (p->word()) {
+            f(key_view(word), p->value);
+        }
+        _task_queue &q = t.queues[self];
+        std::lock_guard<std::mutex> lock(q.lock);
+        for (int i = p->next(0); i < HT_ALPHABET_SIZE; i = p->next(i + 1)) {
+            htnode_ptr child(p->child(i), p->type(i));
+            ++t.pending;
+            q.tasks.push_back(child);
+            i = child.last();
+        }
+    }
+
+    /**
+     * Calls a function of parallel_for_each() on the suffixes a container
+     * visits, put after the container's path.
+     */
+    template <class F>
+    struct _suffix_visitor {
+        key_type &word;
+        size_t length;  // of the path
+        F &f;
+
+        _suffix_visitor(key_type &word, F &f) :
+                word(word), length(word.size()), f(f) { }
+
+        void operator()(const char *suffix, size_t n, mapped_type &value) {
+            word.append(suffix, n);
+            f(key_view(word), value);
+            word.resize(length);
+        }
+    };
+
+    /**
+     * Puts the path from the root to a node or container in @a word.
+     * Hybrid containers keep their characters with their words, so
+     * their path is their parent's.
+     */
+    static void _path(htnode_ptr n, key_type &word) {
+        size_t depth = 0;
+        for (htnode_ptr c = n; c.parent(); c = htnode_ptr(c.parent())) {
+            depth += !c.hybrid();
+        }
+        word.resize(depth);
+        for (htnode_ptr c = n; c.parent(); c = htnode_ptr(c.parent())) {
+            if (!c.hybrid()) {
+                word[--depth] = c.ch();
+            }
+        }
+    }
+#endif
+
+    /**
+     * Calls @a f on the words in a range of a container.
+     *
+     * @param first, last  range of suffixes in the container
+     * @param word         path to the container. Restored before this
+     *                     function returns
+     * @param f            function to call. See for_each()
+     */
+    template <class F>
+    static void _visit(typename bucket::ordered_iterator first,
+                       const typename bucket::ordered_iterator &last,
+                       key_type &word, F &f) {
+        size_t length = word.size();
+        for (; first != last; ++first) {
+            word.append(*first, first.length());
+            f(key_view(word), first.value());
+            word.resize(length);
+        }
+    }
+
+    /**
+     * Initializes all the fields in a hat_trie as if it had just been
+     * created.
+     */
+    void _init() {
+        _set_concurrent(_traits.concurrent_readers);
+        _size = 0;
+        _root = _new_node(0);
+    }
+
+    /**
+     * Gets the root a moved-from trie is left with. It stays empty: the
+     * trie makes a root of its own before it inserts anything.
+     */
+    static htnode *_empty_root() {
+        static htnode root;
+        return &root;
+    }
+
+    /**
+     * Starts or stops publishing changes for concurrent readers. See
+     * hat_trie_traits::concurrent_readers. Must be called before the
+     * nodes and containers it applies to are made.
+     */
+    void _set_concurrent(bool concurrent) {
+#if __cplusplus >= 201103L
+        if (concurrent && _reclaimer == NULL) {
+            _reclaimer = new reclaimer(_alloc);
+        } else if (!concurrent && _reclaimer) {
+            delete _reclaimer;
+            _reclaimer = NULL;
+        }
+#else
+        (void) concurrent;
+#endif
+    }
+
+#if __cplusplus >= 201103L
+    /**
+     * Gets the domain readers pin, or NULL if the trie doesn't have
+     * concurrent readers.
+     */
+    const epoch_domain *_domain() const {
+        return _reclaimer ? &_reclaimer->domain() : NULL;
+    }
+#endif
+
+    /**
+     * Gets the table of a container that a reader has reached. The
+     * writer may be swapping in a grown copy.
+     */
+    static bucket *_table(const ahnode *b) {
+        return load_acquire(b->table);
+    }
+
+    /**
+     * Gets the child of @a p at @a index. With concurrent readers, the
+     * writer may be changing @a p, so the child and its type are read
+     * as one snapshot.
+     */
+    htnode_ptr _child(const htnode *p, int index) const {
+        if (_reclaimer) {
+            return p->read_child(index);
+        }
+        child_ptr v = p->child(index);
+        uint8_t type = v.node ? p->type(index) : (uint8_t) NODE_POINTER;
+        return htnode_ptr(v, type);
+    }
+
+    /**
+     * Frees a node or container and everything underneath it.
+     *
+     * @param n  node to start from
+     */
+    void _destroy(htnode_ptr n) {
+        if (n.ptr.node == _empty_root()) {
+            // moved from
+            return;
+        }
+        if (n.type == BUCKET_POINTER) {
+            _delete_bucket(n.ptr.bucket);
+        } else {
+            htnode *p = n.ptr.node;
+            for (int i = p->next(0); i < HT_ALPHABET_SIZE; i = p->next(i + 1)) {
+                // A hybrid container is under several characters, but is
+                // only freed once.
+                htnode_ptr child(p->child(i), p->type(i));
+                int last = child.last();
+                _destroy(child);
+                i = last;
             }
+            _delete_node(p);
+        }
+    }
+
+    /**
+     * Makes a node with the trie's allocator.
+     *
+     * @param ch  character the node represents
+     */
+    htnode *_new_node(unsigned char ch) {
+        typename rebind_alloc<A, htnode>::type a(_alloc);
+        htnode *result = new (a.allocate(1)) htnode(ch);
+        if (_reclaimer) {
+            result->make_full(_alloc);
+        }
+        return result;
+    }
+
+    /**
+     * Frees a node made by _new_node(). Its children are not freed.
+     */
+    void _delete_node(htnode *p) {
+        p->free_children(_alloc);
+        p->~htnode();
+        typename rebind_alloc<A, htnode>::type(_alloc).deallocate(p, 1);
+    }
+
+    /**
+     * Frees a node that was just taken out of the trie. Its children are
+     * not freed. Concurrent readers may still be looking at it, so then
+     * it is retired instead.
+     */
+    void _release_node(htnode *p) {
+#if __cplusplus >= 201103L
+        if (_reclaimer) {
+            _reclaimer->retire(p, sizeof(htnode), &_destroy_retired_node);
+            return;
+        }
+#endif
+        _delete_node(p);
+    }
+
+    /**
+     * Makes an empty container, and its table, with the trie's allocator.
+     *
+     * @param ch      character the container represents
+     * @param parent  node the container goes under
+     */
+    ahnode *_new_bucket(unsigned char ch, htnode *parent) {
+        typename rebind_alloc<A, ahnode>::type a(_alloc);
+        typename rebind_alloc<A, bucket>::type b(_alloc);
+        ahnode *result = new (a.allocate(1)) ahnode();
+        result->table = new (b.allocate(1)) bucket(_ah_traits, _alloc);
+#if __cplusplus >= 201103L
+        result->table->set_reclaimer(_reclaimer);
+#endif
+        result->ch = ch;
+        result->end = ch;
+        result->parent = parent;
+        return result;
+    }
+
+    /**
+     * Makes an empty container and puts it under a range of a node's
+     * characters. The container is hybrid if the range is wider than one
+     * character.
+     *
+     * @param p            node to put the container under
+     * @param first, last  range of characters, inclusive
+     */
+    ahnode *_add_bucket(htnode *p, int first, int last) {
+        ahnode *result = _new_bucket(first, p);
+        result->end = last;
+        p->begin_write();
+        _attach(p, result);
+        p->end_write();
+        return result;
+    }
+
+    /**
+     * Puts a container under its range of a node's characters.
+     */
+    void _attach(htnode *p, ahnode *b) {
+        for (int i = b->ch; i <= b->end; ++i) {
+            p->set_child(i, htnode_ptr(b), _alloc);
+        }
+    }
+
+    /**
+     * Copies a node and everything underneath it with the trie's
+     * allocator.
+     *
+     * The copy's children array has the same layout as @a p's, so only
+     * the pointers in it change. With concurrent readers, it is made
+     * full afterwards. A hybrid container is copied once, and
+     * the copy is put under every character the original is under.
+     *
+     * @param p       node to copy
+     * @param parent  parent of the copy
+     * @return  the copy
+     */
+    htnode *_clone(const htnode *p, htnode *parent) {
+        typename rebind_alloc<A, htnode>::type a(_alloc);
+        htnode *result = new (a.allocate(1)) htnode(p->ch);
+        result->is_word = p->is_word;
+        result->value = p->value;
+        result->parent = parent;
+        if (p->capacity == 0) {
+            if (_reclaimer) {
+                result->make_full(_alloc);
+            }
+            return result;
+        }
+
+        memcpy(result->occupied, p->occupied, sizeof(p->occupied));
+        memcpy(result->types, p->types, sizeof(p->types));
+        result->size = p->size;
+        result->capacity = p->capacity;
+        result->children = typename htnode::child_allocator(_alloc)
+                .allocate(p->capacity);
+        memcpy(result->children, p->children,
+               p->capacity * sizeof(child_ptr));
+
+        // Replace each child with its copy. Children are in character
+        // order in both the dense and the full layout.
+        ahnode *original = NULL;
+        ahnode *copy = NULL;
+        int pos = 0;
+        for (int i = p->next(0); i < HT_ALPHABET_SIZE;
+                i = p->next(i + 1), ++pos) {
+            child_ptr &c = result->children[
+                    p->capacity == HT_ALPHABET_SIZE ? i : pos];
+            if (p->type(i) == NODE_POINTER) {
+                c.node = _clone(c.node, result);
+            } else if (c.bucket != original) {
+                original = c.bucket;
+                typename rebind_alloc<A, ahnode>::type a(_alloc);
+                typename rebind_alloc<A, bucket>::type b(_alloc);
+                copy = new (a.allocate(1)) ahnode(*original);
+                copy->table = new (b.allocate(1))
+                        bucket(*original->table, _alloc);
+#if __cplusplus >= 201103L
+                copy->table->set_reclaimer(_reclaimer);
+#endif
+                copy->parent = result;
+                c.bucket = copy;
+            } else {
+                c.bucket = copy;
+            }
+        }
+        if (_reclaimer) {
+            result->make_full(_alloc);
+        }
+        return result;
+    }
+
+#if __cplusplus >= 201103L
+    /**
+     * Orders the first bytes of a parallel_load() by how many records
+     * start with them, largest first.
+     */
+    struct _larger_group {
+        const size_t *begins;
+
+        _larger_group(const size_t *begins) : begins(begins) { }
+
+        bool operator()(int a, int b) const {
+            return begins[a + 1] - begins[a] > begins[b + 1] - begins[b];
+        }
+    };
+
+    /**
+     * Takes over a subtree another trie made with the same allocator,
+     * putting it under @a parent. With concurrent readers, its nodes are
+     * made full and its containers retire memory through this trie.
+     */
+    void _adopt(const htnode_ptr &n, htnode *parent) {
+        if (n.type == BUCKET_POINTER) {
+            n.ptr.bucket->parent = parent;
+            n.ptr.bucket->table->set_reclaimer(_reclaimer);
+            return;
+        }
+        htnode *p = n.ptr.node;
+        p->parent = parent;
+        if (_reclaimer) {
+            p->make_full(_alloc);
+        }
+        for (int i = p->next(0); i < HT_ALPHABET_SIZE; i = p->next(i + 1)) {
+            // Only pure containers are adopted, so each is visited once.
+            _adopt(htnode_ptr(p->child(i), p->type(i)), p);
+        }
+    }
+#endif
+
+    /**
+     * Frees a container made by _new_bucket(), and everything in it.
+     */
+    void _delete_bucket(ahnode *b) {
+        b->table->~bucket();
+        typename rebind_alloc<A, bucket>::type(_alloc).deallocate(b->table, 1);
+        b->~ahnode();
+        typename rebind_alloc<A, ahnode>::type(_alloc).deallocate(b, 1);
+    }
+
+    /**
+     * Frees a container that was just taken out of the trie, and
+     * everything in it. Concurrent readers may still be looking at it,
+     * so then it is retired instead.
+     */
+    void _release_bucket(ahnode *b) {
+#if __cplusplus >= 201103L
+        if (_reclaimer) {
+            _reclaimer->retire(b->table, sizeof(bucket),
+                               &_destroy_retired_table);
+            _reclaimer->retire(b, sizeof(ahnode));
+            return;
         }
+#endif
+        _delete_bucket(b);
     }
 
+#if __cplusplus >= 201103L
     /**
-     * Initializes all the fields in a hat_trie as if it had just been
-     * created.
+     * Replaces a container's table with a copy that has twice as many
+     * slots, for concurrent readers. Tables that readers may see can't
+     * grow in place (see array_hash::set_reclaimer()).
      */
-    void _init() {
-        _size = 0;
-        _root = new htnode();
+    void _replace_table(ahnode *b) {
+        typename rebind_alloc<A, bucket>::type a(_alloc);
+        bucket *table = new (a.allocate(1)) bucket(*b->table, _alloc);
+        table->grow();
+        table->set_reclaimer(_reclaimer);
+
+        bucket *old = b->table;
+        store_release(b->table, table);
+        _reclaimer->retire(old, sizeof(bucket), &_destroy_retired_table);
+    }
+
+    // Destroys a retired node. Its memory is freed by the reclaimer
+    static void _destroy_retired_node(void *p,
+                                      typename bucket::allocator_type &a) {
+        htnode *n = (htnode *) p;
+        n->free_children(A(a));
+        n->~htnode();
+    }
+
+    // Destroys a retired table. Its memory is freed by the reclaimer
+    static void _destroy_retired_table(void *p,
+                                       typename bucket::allocator_type &) {
+        ((bucket *) p)->~bucket();
     }
+#endif
 
     /**
      * Locates the position @a s should be in the trie.
      *
-     * @param s  string to search for. After this function completes, if
-     *           <code>*s = '\0'</code>, @a s is in the trie part of this
-     *           data structure. If not, @a s is either completed in a
-     *           container or is not in the trie at all.
+     * @param s     string to search for. After this function completes, if
+     *              <code>s == stop</code>, @a s is in the trie part of this
+     *              data structure. If not, @a s is either completed in a
+     *              container or is not in the trie at all.
+     * @param stop  one past the last byte of @a s
      * @return  a htnode_ptr to the location where @a s should appear
      *          in the trie
      */
-    htnode_ptr _locate(const char *&s) const {
+    htnode_ptr _locate(const char *&s, const char *stop) const {
         htnode *p = _root;
-        child_ptr v;
-        while (*s) {
-            int index = *s;
-            v = p->children[index];
-            if (v.bucket) {
-                ++s;
-                if (p->types[index] == NODE_POINTER) {
+        while (s != stop) {
+            htnode_ptr v = _child(p, (unsigned char) *s);
+            if (v.ptr.bucket) {
+                if (v.type == NODE_POINTER) {
                     // Keep moving down the trie structure.
-                    p = v.node;
-                } else if (p->types[index] == BUCKET_POINTER) {
-                    // s should appear in the container v
-                    return htnode_ptr(v, BUCKET_POINTER);
+                    ++s;
+                    p = v.ptr.node;
+                } else {
+                    // s should appear in the container v. Hybrid
+                    // containers keep the character that leads to them.
+                    if (!v.ptr.bucket->hybrid()) {
+                        ++s;
+                    }
+                    return v;
                 }
             } else {
                 // s should appear underneath this node
@@ -941,39 +2953,144 @@ class hat_trie<std::string> {
         return htnode_ptr(p);
     }
 
+    /**
+     * Searches for a word in the trie, inserting it if it isn't there.
+     *
+     * @param word      word to search for
+     * @param length    number of bytes in @a word
+     * @param value     value to map @a word to if it is inserted
+     * @param inserted  set to true iff @a word was inserted
+     * @return  reference to the value mapped to @a word
+     */
+    mapped_type &_find_or_insert(const char *word, size_t length,
+                                 const mapped_type &value, bool &inserted) {
+        if (_root == _empty_root()) {
+            // moved from
+            _init();
+        }
+        const char *pos = word;
+        const char *stop = word + length;
+        htnode_ptr n = _locate(pos, stop);
+        if (pos == stop) {
+            // word was found in the trie's structure. Mark its location
+            // as the end of a word.
+            inserted = !n.word();
+            if (inserted) {
+                n.value() = value;
+                n.set_word(true);
+                ++_size;
+            }
+            return n.value();
+        }
+
+        // word was not found in the trie's structure. Either make a
+        // new bucket for it or insert it into an already
+        // existing bucket
+        ahnode *at = NULL;
+        if (n.type == NODE_POINTER) {
+            // Make a new bucket for word. With hybrid containers, it
+            // covers every free character around word's.
+            htnode *p = n.ptr.node;
+            int index = (unsigned char) *pos;
+            int first = index;
+            int last = index;
+            if (_traits.hybrid_containers) {
+                first = p->prev(index) + 1;
+                last = p->next(index) - 1;
+            }
+
+            // Insert the new bucket into the trie's structure
+            at = _add_bucket(p, first, last);
+            if (!at->hybrid()) {
+                ++pos;
+            }
+        } else if (n.type == BUCKET_POINTER) {
+            // The container for s already exists.
+            at = n.ptr.bucket;
+        }
+
+        // Insert the rest of word into the container.
+        mapped_type *result = _insert(at, pos, stop - pos, value,
+                                      inserted);
+        if (result == NULL) {
+            // The container burst, which moved word's value. Look it
+            // up again.
+            pos = word;
+            n = _locate(pos, stop);
+            if (pos == stop) {
+                result = &n.value();
+            } else {
+                result = &n.ptr.bucket->table->find(pos, stop - pos).value();
+            }
+        }
+        return *result;
+    }
+
     /**
      * Inserts a word into a container.
      *
      * If the insertion overflows the burst threshold, the container
      * is burst.
      *
-     * @param htc  container to insert into
-     * @param s    word to insert
+     * @param htc       container to insert into
+     * @param s         word to insert
+     * @param length    number of bytes in @a s
+     * @param value     value to map @a s to if it is inserted
+     * @param inserted  set to true if @a s is successfully inserted into
+     *                  @a htc, false otherwise
      *
-     * @return
-     *      true if @a s is successfully inserted into @a htc, false
-     *      otherwise
+     * @return  pointer to the value mapped to @a s, or NULL if the
+     *          container was burst
      */
-    bool _insert(ahnode *htc, const char *s) {
+    mapped_type *_insert(ahnode *htc, const char *s, size_t length,
+                         const mapped_type &value, bool &inserted) {
         // Try to insert s into the container.
-        bool result;
-        if (*s == '\0') {
-            result = !htc->word;
-            htc->word = true;
+        mapped_type *result;
+        if (length == 0) {
+            inserted = !htc->word;
+            if (inserted) {
+                htc->value = value;
+                store_release(htc->word, true);
+            }
+            result = &htc->value;
         } else {
-            result = htc->table->insert(s);
+#if __cplusplus >= 201103L
+            if (_reclaimer && htc->table->grow_pending() &&
+                    !htc->table->exists(s, length)) {
+                _replace_table(htc);
+            }
+#endif
+            result = &htc->table->find_or_insert(s, length, value,
+                                                 inserted).value();
         }
 
-        if (result) {
+        if (inserted) {
             ++_size;
             if (_traits.burst_threshold > 0 &&
                     htc->table->size() > _traits.burst_threshold) {
                 // burst the bucket into nodes
                 _burst(htc);
+                return NULL;
             }
-            return true;
         }
-        return false;
+        return result;
+    }
+
+    /**
+     * Removes an empty container from the trie.
+     *
+     * @param b  container to remove
+     * @return  the container's parent
+     */
+    htnode *_erase_bucket(ahnode *b) {
+        htnode *parent = b->parent;
+        parent->begin_write();
+        for (int i = b->ch; i <= b->end; ++i) {
+            parent->remove_child(i);
+        }
+        parent->end_write();
+        _release_bucket(b);
+        return parent;
     }
 
     /**
@@ -988,28 +3105,17 @@ class hat_trie<std::string> {
         while (current && current != _root && current->word() == false) {
             // Erase all the nodes that aren't words and don't
             // have any children above the erased node or container.
-            // Start by determining whether the current node has any
-            // children.
-            bool children = false;
-            for (int i = 0; i < HT_ALPHABET_SIZE && !children; ++i) {
-                children |= (bool)current->children[i].bucket;
-            }
-
             // If the current node doesn't have any children and isn't a
             // word, delete it.
-            if (children == false) {
+            if (!current->has_children()) {
                 htnode *tmp = current;
                 current = current->parent;
-                delete tmp;
-
-                // Mark the slot in current's parent's children array
-                // as NULL.
-                for (int i = 0; i < HT_ALPHABET_SIZE; ++i) {
-                    if (current->children[i].node == tmp) {
-                        current->children[i].node = NULL;
-                        break;
-                    }
-                }
+
+                // Remove the node from its parent's children.
+                current->begin_write();
+                current->remove_child(tmp->ch);
+                current->end_write();
+                _release_node(tmp);
             } else {
                 // Stop the while loop.
                 current = NULL;
@@ -1041,6 +3147,25 @@ class hat_trie<std::string> {
      * Note: see the doc comment on print() if this notation doesn't make
      * sense.
      *
+     * With hybrid containers (see hat_trie_traits), the new node gets
+     * at most two containers, split by character range as described
+     * below, and a full hybrid container is split in two in place:
+     *
+     *   BEFORE
+     *   t
+     *     a-z *
+     *       an ~
+     *       ree ~
+     *       rust ~
+     *
+     *   AFTER
+     *   t
+     *     a *
+     *       n ~
+     *     r *
+     *       ust ~
+     *       ee ~
+     *
      * The burst operation is described in detail by the paper that
      * originally described burst tries, freely available on the Internet.
      * (The HAT-trie is a derivation of a burst-trie.)
@@ -1048,43 +3173,478 @@ class hat_trie<std::string> {
      * @param htc  container to burst
      */
     void _burst(ahnode *htc) {
-        // Construct a new node.
-        htnode *result = new htnode(htc->ch);
-        result->set_word(htc->word);
-
-        // Make a set of containers for the data in the old container and
-        // add them to the new node.
+        // Count the words that start with each character, and the ones
+        // that are longer than that character.
+        bucket *table = htc->table;
+        size_type counts[HT_ALPHABET_SIZE];
+        size_type longer[HT_ALPHABET_SIZE];
+        memset(counts, 0, sizeof(counts));
+        memset(longer, 0, sizeof(longer));
         typename bucket::iterator it;
-        for (it = htc->table->begin(); it != htc->table->end(); ++it) {
-            int index = (*it)[0];
+        for (it = table->begin(); it != table->end(); ++it) {
+            int index = (unsigned char) (*it)[0];
+            ++counts[index];
+            longer[index] += it.length() > 1;
+        }
+
+        htnode *result;
+        if (htc->hybrid()) {
+            // Split the container in place. Its words keep their first
+            // characters, so they stay under the same node.
+            result = htc->parent;
+        } else {
+            // Construct a new node.
+            result = _new_node(htc->ch);
+            result->set_word(htc->word);
+            result->value = htc->value;
+        }
+
+        // Make the new containers. They are only put under the node once
+        // they are filled, so a concurrent reader never finds one empty.
+        ahnode *children[HT_ALPHABET_SIZE];
+        memset(children, 0, sizeof(children));
+        if (_traits.hybrid_containers) {
+            _split(result, counts, children);
+        } else {
+            for (int i = 0; i < HT_ALPHABET_SIZE; ++i) {
+                if (counts[i]) {
+                    children[i] = _new_bucket(i, result);
+                }
+            }
+        }
+
+        // The words in the old container are distinct, so the new
+        // containers can be filled without searching them. Size every
+        // slot in them first, so each is allocated once. Pure containers
+        // get the rest of each word, and words that end on them are
+        // marked by their word fields instead.
+        for (int i = 0; i < HT_ALPHABET_SIZE; ++i) {
+            if (children[i]) {
+                ahnode *child = children[i];
+                size_type n = 0;
+                for (; i <= child->end; ++i) {
+                    n += child->hybrid() ? counts[i] : longer[i];
+                }
+                --i;
+                child->table->reserve_distinct(n);
+            }
+        }
+        for (it = table->begin(); it != table->end(); ++it) {
+            ahnode *child = children[(unsigned char) (*it)[0]];
+            if (child->hybrid()) {
+                child->table->measure(*it, it.length());
+            } else if (it.length() > 1) {
+                child->table->measure(*it + 1, it.length() - 1);
+            }
+        }
+        for (int i = 0; i < HT_ALPHABET_SIZE; ++i) {
+            if (children[i]) {
+                children[i]->table->allocate_measured();
+                i = children[i]->end;
+            }
+        }
+
+        // Move each word into its container.
+        for (it = table->begin(); it != table->end(); ++it) {
+            ahnode *child = children[(unsigned char) (*it)[0]];
+            if (child->hybrid()) {
+                child->table->append_distinct(*it, it.length()).value() =
+                        it.value();
+            } else if (it.length() == 1) {
+                child->word = true;
+                child->value = it.value();
+            } else {
+                child->table->append_distinct(*it + 1, it.length() - 1)
+                        .value() = it.value();
+            }
+        }
+
+        // Position the new containers under the node, in place of the
+        // old one if it was hybrid.
+        result->begin_write();
+        if (htc->hybrid()) {
+            for (int i = htc->ch; i <= htc->end; ++i) {
+                result->remove_child(i);
+            }
+        }
+        for (int i = 0; i < HT_ALPHABET_SIZE; ++i) {
+            if (children[i]) {
+                _attach(result, children[i]);
+                i = children[i]->end;
+            }
+        }
+        result->end_write();
+
+        if (!htc->hybrid()) {
+            // Position the new node in the trie.
+            htnode *p = htc->parent;
+            result->parent = p;
+            p->begin_write();
+            p->set_child(htc->ch, htnode_ptr(result), _alloc);
+            p->end_write();
+        }
+        _release_bucket(htc);
+    }
+
+    /**
+     * Makes the two containers the words counted in @a counts are split
+     * into. They are not put under @a p yet.
+     *
+     * The words are split at the character that divides them most
+     * evenly, and each container only covers the characters from its
+     * first word to its last. A container that ends up under a single
+     * character is pure. If every word starts with the same character,
+     * only one pure container is made.
+     *
+     * @param p         node the containers go under
+     * @param counts    number of words that start with each character
+     * @param children  set to the container each character's words go to
+     */
+    void _split(htnode *p, const size_type *counts, ahnode **children) {
+        int first = 0;
+        int last = HT_ALPHABET_SIZE - 1;
+        size_type total = 0;
+        while (counts[first] == 0) { ++first; }
+        while (counts[last] == 0) { --last; }
+        for (int i = first; i <= last; ++i) {
+            total += counts[i];
+        }
+
+        // Find the split point. Both halves must get words.
+        int middle = first;
+        size_type below = counts[first];
+        while (middle + 1 < last && below * 2 < total) {
+            below += counts[++middle];
+        }
+
+        int ranges[2][2] = { { first, middle }, { middle + 1, last } };
+        if (first == last) {
+            ranges[1][0] = HT_ALPHABET_SIZE;
+        }
+        for (int j = 0; j < 2; ++j) {
+            int lo = ranges[j][0];
+            int hi = ranges[j][1];
+            if (lo > hi) {
+                continue;
+            }
+            while (counts[lo] == 0) { ++lo; }
+            while (counts[hi] == 0) { --hi; }
+            ahnode *b = _new_bucket(lo, p);
+            b->end = hi;
+            for (int i = lo; i <= hi; ++i) {
+                children[i] = b;
+            }
+        }
+    }
+
+    /// number of words exists_batch() and find_batch() move together
+    static const int _batch_size = 16;
+
+    /**
+     * One word's progress through a batched search. See exists_batch().
+     *
+     * Each stage reads memory the stage before it prefetched, and
+     * prefetches what the next one reads.
+     */
+    struct _probe {
+        enum {
+            NODE,    // at a node: find the child pointer
+            CHILD,   // read the child pointer: move to the child
+            BUCKET,  // at a container: find its table
+            TABLE,   // hash the rest of the word: find its slot
+            SLOT,    // read the slot pointer: find the slot's strings
+            READY    // ready to be searched for where it got to
+        };
+
+        const char *pos;   // rest of the word
+        const char *stop;  // one past the last byte of the word
+        htnode_ptr n;      // node or container the word has got to
+        size_t h;          // hash of the rest of the word, from TABLE on
+        int stage;
+    };
+
+    /**
+     * Moves the next words from [first, last) to where they would be in
+     * the trie.
+     *
+     * @param first   advanced past the words taken
+     * @param probes  set to the words' positions
+     * @return  number of words taken, at most _batch_size
+     */
+    template <class forward_iterator>
+    int _run_batch(forward_iterator &first, const forward_iterator &last,
+                   _probe *probes) const {
+        int n = 0;
+        for (; n < _batch_size && first != last; ++n, ++first) {
+            key_view word = *first;
+            probes[n].pos = word.data();
+            probes[n].stop = word.data() + word.size();
+            probes[n].n = htnode_ptr(_root);
+            probes[n].stage = _probe::NODE;
+        }
+
+        // Take one step of every word in turn until all are done
+        int waiting = n;
+        while (waiting > 0) {
+            for (int i = 0; i < n; ++i) {
+                if (probes[i].stage != _probe::READY && _step(probes[i])) {
+                    --waiting;
+                }
+            }
+        }
+        return n;
+    }
+
+    /**
+     * Takes the next step of a batched search.
+     *
+     * @return  true iff the word is now ready to be searched for
+     */
+    bool _step(_probe &q) const {
+        switch (q.stage) {
+        case _probe::NODE:
+            if (q.pos == q.stop) {
+                break;
+            }
+            q.n.ptr.node->prefetch_child((unsigned char) *q.pos);
+            q.stage = _probe::CHILD;
+            return false;
+
+        case _probe::CHILD: {
+            htnode_ptr child = _child(q.n.ptr.node, (unsigned char) *q.pos);
+            child_ptr v = child.ptr;
+            if (v.node == NULL) {
+                // The word would go under this node
+                break;
+            }
+            q.n = child;
+            if (q.n.type == NODE_POINTER) {
+                ++q.pos;
+                const char *start = (const char *) v.node;
+                for (size_t i = 0; i < sizeof(htnode); i += 64) {
+                    prefetch_read(start + i);
+                }
+                prefetch_read(start + sizeof(htnode) - 1);
+                q.stage = _probe::NODE;
+            } else {
+                prefetch_read(v.bucket);
+                q.stage = _probe::BUCKET;
+            }
+            return false;
+        }
+
+        case _probe::BUCKET: {
+            ahnode *b = q.n.ptr.bucket;
+            if (!b->hybrid()) {
+                ++q.pos;
+            }
+            if (q.pos == q.stop) {
+                break;
+            }
+            prefetch_read(_table(b));
+            q.stage = _probe::TABLE;
+            return false;
+        }
+
+        case _probe::TABLE:
+            q.h = _table(q.n.ptr.bucket)->prefetch(q.pos, q.stop - q.pos);
+            q.stage = _probe::SLOT;
+            return false;
+
+        case _probe::SLOT:
+            _table(q.n.ptr.bucket)->prefetch_slot(q.h);
+            break;
+        }
+        q.stage = _probe::READY;
+        return true;
+    }
+
+    /**
+     * Determines whether the word of a finished batched search is in
+     * the trie. See exists().
+     */
+    bool _exists(const _probe &q) const {
+        htnode_ptr n = q.n;
+        if (q.pos == q.stop) {
+            return n.word();
+        }
+        if (n.type == BUCKET_POINTER) {
+            return _table(n.ptr.bucket)->exists(q.pos, q.stop - q.pos, q.h);
+        }
+        return false;
+    }
+
+    /**
+     * Gets an iterator to the word of a finished batched search. See
+     * find().
+     */
+    iterator _find(const _probe &q) const {
+        htnode_ptr n = q.n;
+        iterator result = end();
+        if (q.pos == q.stop) {
+            if (n.word()) {
+                result = n;
+            }
+        } else if (n.type == BUCKET_POINTER) {
+            bucket *table = _table(n.ptr.bucket);
+            typename bucket::iterator it = table->find(q.pos, q.stop - q.pos,
+                                                       q.h);
+            if (it != table->end()) {
+                result._position = n;
+                result._word = false;
+                result._container_iterator = table->ordered(it);
+            }
+        }
+        return result;
+    }
+
+    /**
+     * State of a bulk_load().
+     *
+     * The records in the batch all go under the last node on the path,
+     * and have not been put into a container yet.
+     */
+    struct _loader {
+        std::vector<htnode *> path;     // nodes from the root down
+        std::vector<value_type> batch;  // records held back, in order
+        size_type longer;  // records in batch that don't end on its child
+
+        _loader() : longer(0) { }
+    };
+
+    /**
+     * Adds the next record of a bulk_load().
+     *
+     * @param record  record to add. Its key is greater than the key of
+     *                every record added before it
+     * @param l       state of the load
+     */
+    void _load(const value_type &record, _loader &l) {
+        // Close the nodes the key isn't under. The input is sorted, so
+        // nothing else goes under them either.
+        const key_type &key = stx::ref(record);
+        size_t depth = 0;
+        while (depth + 1 < l.path.size() && depth < key.size() &&
+                (unsigned char) key[depth] == l.path[depth + 1]->ch) {
+            ++depth;
+        }
+        while (l.path.size() > depth + 1) {
+            _flush(l, l.batch.size());
+            l.path.pop_back();
+        }
+
+        htnode *p = l.path.back();
+        if (key.size() == depth) {
+            p->set_word(true);
+            p->value = record_traits<T>::mapped(record);
+            ++_size;
+            return;
+        }
 
-            // Do we need to make a new container?
-            if (result->children[index].bucket == NULL) {
-                // Make a new container and position it under the new node.
-                ahnode *insertion = new ahnode();
-                insertion->table = new bucket(_ah_traits);
-                insertion->ch = (*it)[0];
-                insertion->parent = result;
-                result->children[index].bucket = insertion;
-                result->types[index] = BUCKET_POINTER;
+        int index = (unsigned char) key[depth];
+        if (!_traits.hybrid_containers && !l.batch.empty() &&
+                index != (unsigned char) stx::ref(l.batch.back())[depth]) {
+            _flush(l, l.batch.size());
+        }
+        l.batch.push_back(record);
+        l.longer += key.size() > depth + 1;
+
+        size_type threshold = _traits.burst_threshold;
+        while (threshold > 0) {
+            if ((unsigned char) stx::ref(l.batch.front())[depth] != index) {
+                // A hybrid container keeps every record in the batch.
+                if (l.batch.size() <= threshold) {
+                    break;
+                }
+                // Too many for one container, so the records before
+                // index's get their own.
+                size_t n = 0;
+                while ((unsigned char) stx::ref(l.batch[n])[depth] != index) {
+                    ++n;
+                }
+                _flush(l, n);
+            } else {
+                // A pure container keeps the records longer than index.
+                if (l.longer > threshold) {
+                    _descend(l, index);
+                }
+                break;
+            }
+        }
+    }
 
-                // Set the new container's word field.
-                insertion->word = (*it)[1] == '\0';
+    /**
+     * Puts the first @a count records of a bulk_load()'s batch into a new
+     * container under the last node on the path.
+     *
+     * The container covers the characters from the first record's to
+     * the last one's, and is filled without searching it.
+     */
+    void _flush(_loader &l, size_t count) {
+        if (count == 0) {
+            return;
+        }
+        size_t depth = l.path.size() - 1;
+        typename std::vector<value_type>::iterator first = l.batch.begin();
+        typename std::vector<value_type>::iterator last = first + count;
+        ahnode *b = _add_bucket(l.path.back(),
+                                (unsigned char) stx::ref(*first)[depth],
+                                (unsigned char) stx::ref(*(last - 1))[depth]);
+
+        // Pure containers get the rest of each key, and a key that ends
+        // on one is marked by its word field instead.
+        size_t skip = b->hybrid() ? depth : depth + 1;
+        size_type n = 0;
+        typename std::vector<value_type>::iterator it;
+        for (it = first; it != last; ++it) {
+            n += stx::ref(*it).size() > skip;
+        }
+        if (n > 0) {
+            b->table->reserve_distinct(n);
+            for (it = first; it != last; ++it) {
+                const key_type &key = stx::ref(*it);
+                if (key.size() > skip) {
+                    b->table->measure(key.data() + skip, key.size() - skip);
+                }
+            }
+            b->table->allocate_measured();
+        }
+        for (it = first; it != last; ++it) {
+            const key_type &key = stx::ref(*it);
+            if (key.size() > skip) {
+                b->table->append_distinct(key.data() + skip,
+                                          key.size() - skip).value() =
+                        record_traits<T>::mapped(*it);
+            } else {
+                b->word = true;
+                b->value = record_traits<T>::mapped(*it);
             }
+        }
+        _size += count;
 
-            // Insert the rest of the word into a container.
-            result->children[index].bucket->table->insert(*it + 1);  /// TODO lolwut?
-            //((_container *)result->children[index])->insert(*(it + 1));
+        l.batch.erase(first, last);
+        l.longer = 0;
+        for (it = l.batch.begin(); it != l.batch.end(); ++it) {
+            l.longer += stx::ref(*it).size() > depth + 1;
         }
+    }
 
-        // Position the new node in the trie.
-        htnode *p = htc->parent;
-        result->parent = p;
-        int index = htc->ch;
-        p->children[index].node = result;
-        p->types[index] = NODE_POINTER;
-        delete htc->table;
-        delete htc;
+    /**
+     * Moves a bulk_load()'s batch, which is all under @a index, under a
+     * new node for @a index.
+     */
+    void _descend(_loader &l, int index) {
+        htnode *n = _new_node(index);
+        n->parent = l.path.back();
+        n->parent->set_child(index, htnode_ptr(n), _alloc);
+        l.path.push_back(n);
+
+        std::vector<value_type> records;
+        records.swap(l.batch);
+        l.longer = 0;
+        for (size_t i = 0; i < records.size(); ++i) {
+            _load(records[i], l);
+        }
     }
 
     /**
@@ -1092,23 +3652,17 @@ class hat_trie<std::string> {
      *
      * @param p  parent node to search under
      * @param pos  starting position in the children array
-     * @param word  cached word in the trie traversal
      * @return  a pointer to the next child under this node starting from
      *          @a pos, or NULL if this node has no children
      */
-    static htnode_ptr _next_child(htnode *p, size_type pos, key_type &word) {
+    static htnode_ptr _next_child(htnode *p, size_type pos) {
         htnode_ptr result;
 
         // Search for the next child under this node starting at pos.
-        for (int i = pos; i < HT_ALPHABET_SIZE && result.ptr.node == NULL; ++i) {
-            if (p->children[i].node) {
-                // Move to the child we just found.
-                result.ptr.node = p->children[i].node;
-                result.type = p->types[i];
-
-                // Add this motion to the word.
-                word += result.ch();
-            }
+        int i = p->next(pos);
+        if (i < HT_ALPHABET_SIZE) {
+            // Move to the child we just found.
+            result = htnode_ptr(p->child(i), p->type(i));
         }
         return result;
     }
@@ -1120,86 +3674,147 @@ class hat_trie<std::string> {
      * or has a word in it).
      *
      * @param n  node to start from
-     * @param word  cached word in the trie traversal
      * @return  a pointer to the next node in the trie that marks a word
      */
-    static htnode_ptr _next_word(htnode_ptr n, key_type &word) {
+    static htnode_ptr _next_word(htnode_ptr n) {
         // Stop early if we get a NULL pointer.
         if (n.ptr.node == NULL) { return htnode_ptr(); }
 
         htnode_ptr result;
         if (n.type == NODE_POINTER) {
             // Move to the leftmost child under this node.
-            result = _next_child(n.ptr.node, 0, word);
+            result = _next_child(n.ptr.node, 0);
         }
 
         if (result.ptr.node == NULL) {
-            // This node has no children. Move up in the trie until
-            // we can move right.
-            htnode_ptr next;
-            int pos;
-            htnode *parent = n.parent();
-            while (parent && next.ptr.node == NULL) {
-                // Looks like we can't move to the right. Move up a level
-                // in the trie and try again.
-                pos = _pop_back(word) + 1;
-                next = _next_child(parent, pos, word);
-                n = parent;
-                parent = n.ptr.node->parent;
-            }
-            result = next;
+            // This node has no children.
+            return _skip(n);
+        }
+
+        // Return the lexicographically least node underneath this one.
+        return _least(result);
+    }
+
+    /**
+     * Finds the next node that marks a word, skipping everything
+     * underneath @a n.
+     *
+     * @param n     node to start from
+     * @return  a pointer to the first node after the subtree rooted at
+     *          @a n that marks a word, or NULL if there is none
+     */
+    static htnode_ptr _skip(htnode_ptr n) {
+        // Move up in the trie until we can move right.
+        htnode_ptr next;
+        htnode *parent = n.parent();
+        while (parent && next.ptr.node == NULL) {
+            // Looks like we can't move to the right. Move up a level
+            // in the trie and try again.
+            next = _next_child(parent, n.last() + 1);
+            n = parent;
+            parent = n.ptr.node->parent;
         }
 
         // Return the lexicographically least node underneath this one.
-        return _least(result, word);
+        return _least(next);
     }
 
     /**
      * Finds the lexicographically least node starting from @a n.
      *
      * @param n     current position in the trie
-     * @param word  cached word in the trie traversal
      * @return  lexicographically least node from @a n. This function
      *          may return @a n itself
      */
-    static htnode_ptr _least(htnode_ptr n, key_type &word) {
+    static htnode_ptr _least(htnode_ptr n) {
         while (n.ptr.node && n.word() == false && n.type == NODE_POINTER) {
             // Find the leftmost child of this node and move in
             // that direction.
-            n = _next_child(n.ptr.node, 0, word);
+            n = _next_child(n.ptr.node, 0);
         }
         return n;
     }
 
     /**
-     * Removes a path record (i.e. a character) from the back of a word.
+     * Finds the previous child under a node.
      *
-     * This function assumes @a word is populated. The string class
-     * will throw an exception if this precondition is not met.
-     *
-     * @param word  cached word in the trie traversal
-     * @return  integer that was formerly the most recent path taken
+     * @param p  parent node to search under
+     * @param pos  character to start searching backward from. May be -1
+     * @return  a pointer to the last child under this node at or before
+     *          @a pos, or NULL if there is none
      */
-    static int _pop_back(key_type &word) {
-        int result = word[word.size() - 1];
-        word.erase(word.size() - 1);
+    static htnode_ptr _prev_child(htnode *p, int pos) {
+        htnode_ptr result;
+        int i = p->prev(pos);
+        if (i >= 0) {
+            result = htnode_ptr(p->child(i), p->type(i));
+        }
         return result;
     }
 
+    /**
+     * Finds the previous node that marks a word.
+     *
+     * A node's own word comes before the words underneath it, so the
+     * previous word is in the subtree of the closest sibling to the left
+     * of @a n or one of its ancestors, or is that ancestor itself.
+     *
+     * @param n  node to start from
+     * @return  a pointer to the last node before the subtree rooted at
+     *          @a n that marks a word, or NULL if there is none
+     */
+    static htnode_ptr _prev_word(htnode_ptr n) {
+        htnode *parent = n.parent();
+        while (parent) {
+            htnode_ptr prev = _prev_child(parent, int(n.ch()) - 1);
+            if (prev.ptr.node) {
+                return _greatest(prev);
+            }
+            if (parent->word()) {
+                return htnode_ptr(parent);
+            }
+            n = parent;
+            parent = n.ptr.node->parent;
+        }
+        return htnode_ptr();
+    }
+
+    /**
+     * Finds the lexicographically greatest node starting from @a n.
+     *
+     * @param n     current position in the trie
+     * @return  the node or container holding the greatest word in the
+     *          subtree rooted at @a n, or the previous word if the
+     *          subtree is empty
+     */
+    static htnode_ptr _greatest(htnode_ptr n) {
+        while (n.ptr.node && n.type == NODE_POINTER &&
+                n.ptr.node->has_children()) {
+            // Find the rightmost child of this node and move in
+            // that direction.
+            n = _prev_child(n.ptr.node, HT_ALPHABET_SIZE - 1);
+        }
+        if (n.ptr.node && n.type == NODE_POINTER && !n.word()) {
+            // Only an empty root has no children and no word.
+            return _prev_word(n);
+        }
+        return n;
+    }
+
   public:
     // comparison operators
-    template <class F>
-    friend bool operator<(const hat_trie<F> &lhs, const hat_trie<F> &rhs);
-    template <class F>
-    friend bool operator>(const hat_trie<F> &lhs, const hat_trie<F> &rhs);
-    template <class F>
-    friend bool operator<=(const hat_trie<F> &lhs, const hat_trie<F> &rhs);
-    template <class F>
-    friend bool operator>=(const hat_trie<F> &lhs, const hat_trie<F> &rhs);
-    template <class F>
-    friend bool operator==(const hat_trie<F> &lhs, const hat_trie<F> &rhs);
-    template <class F>
-    friend bool operator!=(const hat_trie<F> &lhs, const hat_trie<F> &rhs);
+    template <class F, class G, class B>
+    friend bool operator<(const hat_trie<F, G, B> &lhs, const hat_trie<F, G, B> &rhs);
+    template <class F, class G, class B>
+    friend bool operator>(const hat_trie<F, G, B> &lhs, const hat_trie<F, G, B> &rhs);
+    template <class F, class G, class B>
+    friend bool operator<=(const hat_trie<F, G, B> &lhs, const hat_trie<F, G, B> &rhs);
+    template <class F, class G, class B>
+    friend bool operator>=(const hat_trie<F, G, B> &lhs, const hat_trie<F, G, B> &rhs);
+    template <class F, class G, class B>
+    friend bool operator==(const hat_trie<F, G, B> &lhs, const hat_trie<F, G, B> &rhs);
+    template <class F, class G, class B>
+    friend bool operator!=(const hat_trie<F, G, B> &lhs, const hat_trie<F, G, B> &rhs);
 
 };
 
@@ -1207,42 +3822,42 @@ class hat_trie<std::string> {
 // COMPARISON OPERATORS
 // --------------------
 
-template <class T>
+template <class T, class H, class A>
 bool
-operator<(const stx::hat_trie<T> &lhs,
-          const stx::hat_trie<T> &rhs) {
+operator<(const stx::hat_trie<T, H, A> &lhs,
+          const stx::hat_trie<T, H, A> &rhs) {
     return std::lexicographical_compare(lhs.begin(), lhs.end(),
                                         rhs.begin(), rhs.end());
 }
-template <class T>
+template <class T, class H, class A>
 bool
-operator==(const stx::hat_trie<T> &lhs,
-           const stx::hat_trie<T> &rhs) {
+operator==(const stx::hat_trie<T, H, A> &lhs,
+           const stx::hat_trie<T, H, A> &rhs) {
     return lhs.size() == rhs.size() &&
            std::equal(lhs.begin(), lhs.end(), rhs.begin());
 }
-template <class T>
+template <class T, class H, class A>
 bool
-operator>(const stx::hat_trie<T> &lhs,
-          const stx::hat_trie<T> &rhs) {
+operator>(const stx::hat_trie<T, H, A> &lhs,
+          const stx::hat_trie<T, H, A> &rhs) {
     return rhs < lhs;
 }
-template <class T>
+template <class T, class H, class A>
 bool
-operator<=(const stx::hat_trie<T> &lhs,
-           const stx::hat_trie<T> &rhs) {
+operator<=(const stx::hat_trie<T, H, A> &lhs,
+           const stx::hat_trie<T, H, A> &rhs) {
     return !(rhs < lhs);
 }
-template <class T>
+template <class T, class H, class A>
 bool
-operator>=(const stx::hat_trie<T> &lhs,
-           const stx::hat_trie<T> &rhs) {
+operator>=(const stx::hat_trie<T, H, A> &lhs,
+           const stx::hat_trie<T, H, A> &rhs) {
     return !(lhs < rhs);
 }
-template <class T>
+template <class T, class H, class A>
 bool
-operator!=(const stx::hat_trie<T> &lhs,
-           const stx::hat_trie<T> &rhs) {
+operator!=(const stx::hat_trie<T, H, A> &lhs,
+           const stx::hat_trie<T, H, A> &rhs) {
     return !(lhs == rhs);
 }
 
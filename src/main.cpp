@@ -0,0 +1,705 @@
+/*
+ * main.cpp
+ *
+ * Benchmark driver. Reads whitespace separated words from standard input
+ * (make time runs it on test/inputs/kjv), then times the basic operations
+ * on a hat_set built from them and reports how much heap memory the set
+ * uses.
+ *
+ * Usage: bin/main [burst_threshold] < words
+ *        bin/main slab [burst_threshold] < words
+ *        bin/main hash < words
+ *        bin/main iterate < words
+ *        bin/main hybrid [burst_threshold] < words
+ *        bin/main batch < words
+ *        bin/main threads [max_threads] < words
+ *
+ * The slab mode runs the same benchmark on a set that gets its memory
+ * from a slab_allocator. The hash mode compares the array hash policies
+ * on the distinct words and on long URL-like keys built from them. The
+ * iterate mode times full scans of many small array hashes. The hybrid
+ * mode compares pure and hybrid containers on the words and on skewed
+ * keys that mostly share a few first characters, and counts the nodes
+ * and containers each makes. The batch mode compares groups of single
+ * lookups with exists_batch on two million keys. The threads mode times
+ * inserting two million keys into a concurrent_hat_set from 1, 2, 4 ...
+ * threads, sharded by one and by two leading bytes, loading them with
+ * hat_set::parallel_load, and scanning them with parallel_for_each on
+ * as many threads (C++11 only).
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#if __cplusplus >= 201103L
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#endif
+
+#include "array_hash.h"
+#include "concurrent_hat_set.h"
+#include "hat_set.h"
+#include "slab_allocator.h"
+
+using namespace std;
+using namespace stx;
+
+// ---------------
+// HEAP ACCOUNTING
+// ---------------
+
+// Every allocation is prefixed with its size so live bytes can be tracked
+// without help from the allocator. Threaded benchmarks allocate from
+// several threads at once.
+#if __cplusplus >= 201103L
+typedef std::atomic<size_t> heap_counter;
+#else
+typedef size_t heap_counter;
+#endif
+static heap_counter heap_bytes(0);
+static heap_counter heap_allocations(0);
+static const size_t HEADER = 16;
+
+#if __cplusplus >= 201103L
+#define THROWS_BAD_ALLOC
+#define THROWS_NOTHING noexcept
+#else
+#define THROWS_BAD_ALLOC throw(std::bad_alloc)
+#define THROWS_NOTHING throw()
+#endif
+
+void *operator new(size_t size) THROWS_BAD_ALLOC {
+    char *p = (char *) malloc(size + HEADER);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    *((size_t *) p) = size;
+    heap_bytes += size;
+    ++heap_allocations;
+    return p + HEADER;
+}
+
+void *operator new[](size_t size) THROWS_BAD_ALLOC {
+    return operator new(size);
+}
+
+void operator delete(void *p) THROWS_NOTHING {
+    if (p) {
+        char *q = (char *) p - HEADER;
+        heap_bytes -= *((size_t *) q);
+        free(q);
+    }
+}
+
+void operator delete[](void *p) THROWS_NOTHING {
+    operator delete(p);
+}
+
+// C++14 deletes through the sized forms, which have to match ours
+#if defined(__cpp_sized_deallocation)
+void operator delete(void *p, size_t) THROWS_NOTHING {
+    operator delete(p);
+}
+
+void operator delete[](void *p, size_t) THROWS_NOTHING {
+    operator delete(p);
+}
+#endif
+
+// Standard allocator that counts the objects of type T that are alive
+template <class T>
+class counting_allocator : public std::allocator<T> {
+  public:
+    static size_t live;
+
+    template <class U>
+    struct rebind {
+        typedef counting_allocator<U> other;
+    };
+
+    counting_allocator() { }
+
+    template <class U>
+    counting_allocator(const counting_allocator<U> &) { }
+
+    T *allocate(size_t n, const void * = NULL) {
+        live += n;
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, size_t n) {
+        live -= n;
+        std::allocator<T>().deallocate(p, n);
+    }
+};
+
+template <class T>
+size_t counting_allocator<T>::live = 0;
+
+template <class T, class U>
+bool operator==(const counting_allocator<T> &, const counting_allocator<U> &) {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const counting_allocator<T> &, const counting_allocator<U> &) {
+    return false;
+}
+
+// ----------
+// BENCHMARKS
+// ----------
+
+class timer {
+  public:
+    timer() : start(clock()) { }
+
+    double seconds() const {
+        return double(clock() - start) / CLOCKS_PER_SEC;
+    }
+
+  private:
+    clock_t start;
+};
+
+#if __cplusplus >= 201103L
+// Measures elapsed time rather than processor time, which adds up the
+// time every thread spends
+class wall_timer {
+  public:
+    wall_timer() : start(std::chrono::steady_clock::now()) { }
+
+    double seconds() const {
+        return std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+  private:
+    std::chrono::steady_clock::time_point start;
+};
+#endif
+
+static void report(const char *name, double seconds, size_t n) {
+    printf("%-12s %8.3f s  %8.1f ns/op\n", name, seconds,
+           seconds * 1e9 / n);
+}
+
+// Adds up the lengths of the words a set visits
+struct length_counter {
+    size_t n;
+
+    length_counter() : n(0) { }
+
+    void operator()(key_view word) {
+        n += word.size();
+    }
+};
+
+// Times insert, hit, miss and iteration on a set of type S, and reports
+// the heap memory the set uses.
+template <class S>
+static size_t bench_set(const vector<string> &words,
+                        const hat_trie_traits &traits) {
+    // Misses share prefixes with the words in the set
+    vector<string> misses;
+    for (size_t i = 0; i < words.size(); ++i) {
+        misses.push_back(words[i] + "#");
+    }
+
+    size_t base_bytes = heap_bytes;
+    size_t base_allocations = heap_allocations;
+    S set(traits);
+    {
+        timer t;
+        for (size_t i = 0; i < words.size(); ++i) {
+            set.insert(words[i]);
+        }
+        report("insert", t.seconds(), words.size());
+    }
+    size_t set_bytes = heap_bytes - base_bytes;
+    size_t set_allocations = heap_allocations - base_allocations;
+    {
+        // The same set, built from its sorted words without searching
+        vector<string> sorted(set.begin(), set.end());
+        {
+            // Inserted one by one, for comparison
+            timer t;
+            S inserted(sorted.begin(), sorted.end(), traits);
+            report("sorted", t.seconds(), sorted.size());
+        }
+        size_t bytes = heap_bytes;
+        timer t;
+        S loaded(sorted_unique, sorted.begin(), sorted.end(), traits);
+        report("bulk load", t.seconds(), sorted.size());
+        printf("             %.1f bytes/word\n",
+               double(heap_bytes - bytes) / loaded.size());
+    }
+    {
+        // Copies clone the structure instead of inserting every word
+        timer t;
+        S copy(set);
+        report("copy", t.seconds(), copy.size());
+    }
+
+    size_t found = 0;
+    {
+        timer t;
+        for (size_t i = 0; i < words.size(); ++i) {
+            found += set.exists(words[i]);
+        }
+        report("hit", t.seconds(), words.size());
+    }
+    {
+        timer t;
+        for (size_t i = 0; i < misses.size(); ++i) {
+            found += set.exists(misses[i]);
+        }
+        report("miss", t.seconds(), misses.size());
+    }
+    {
+        size_t allocations = heap_allocations;
+        timer t;
+        size_t n = 0;
+        for (typename S::iterator it = set.begin(); it != set.end();
+                ++it) {
+            n += (*it).size();
+        }
+        report("iterate", t.seconds(), set.size());
+        printf("             %lu allocations\n",
+               (unsigned long) (heap_allocations - allocations));
+        found += n;
+    }
+    {
+        timer t;
+        size_t n = 0;
+        for (typename S::reverse_iterator it = set.rbegin();
+                it != set.rend(); ++it) {
+            n += (*it).size();
+        }
+        report("reverse", t.seconds(), set.size());
+        found += n;
+    }
+    {
+        size_t allocations = heap_allocations;
+        timer t;
+        found += set.for_each(length_counter()).n;
+        report("for_each", t.seconds(), set.size());
+        printf("             %lu allocations\n",
+               (unsigned long) (heap_allocations - allocations));
+    }
+
+    printf("%lu words, %lu distinct\n", (unsigned long) words.size(),
+           (unsigned long) set.size());
+    printf("%lu bytes in %lu allocations (%.1f bytes/word)\n",
+           (unsigned long) set_bytes, (unsigned long) set_allocations,
+           double(set_bytes) / set.size());
+    return found;
+}
+
+// Reports how evenly hash policy H spreads keys over the slots of a
+// table loaded like a full container (32 keys per slot), and how fast
+// lookups are in a table and in a trie that use it.
+template <class H>
+static size_t bench_hash(const char *name, const vector<string> &keys,
+                         const vector<string> &lookups) {
+    int slot_count = 1;
+    while (slot_count * 32 < (int) keys.size()) {
+        slot_count *= 2;
+    }
+
+    // Slot chain lengths
+    vector<size_t> chains(slot_count);
+    H hash;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        ++chains[hash(keys[i].data(), keys[i].size()) & (slot_count - 1)];
+    }
+    double mean = double(keys.size()) / slot_count;
+    double variance = 0;
+    double probes = 0;
+    size_t longest = 0;
+    for (int i = 0; i < slot_count; ++i) {
+        variance += (chains[i] - mean) * (chains[i] - mean);
+        probes += chains[i] * (chains[i] + 1) / 2.0;
+        longest = max(longest, chains[i]);
+    }
+    printf("%-20s %d slots, chain mean %.1f, stddev %.1f (ideal %.1f), "
+           "max %lu, %.1f probes/hit\n", name, slot_count, mean,
+           sqrt(variance / slot_count), sqrt(mean), (unsigned long) longest,
+           probes / keys.size());
+
+    size_t found = 0;
+    {
+        timer t;
+        for (size_t i = 0; i < lookups.size(); ++i) {
+            found += hash(lookups[i].data(), lookups[i].size()) & 1;
+        }
+        report("  hash", t.seconds(), lookups.size());
+    }
+    array_hash<string, H> table(keys.begin(), keys.end(),
+                                array_hash_traits(slot_count, 32, 0));
+    {
+        timer t;
+        for (size_t i = 0; i < lookups.size(); ++i) {
+            found += table.exists(lookups[i]);
+        }
+        report("  table hit", t.seconds(), lookups.size());
+    }
+    {
+        // Misses the same length as the keys, so only their bytes (or
+        // fingerprints) tell them apart
+        vector<string> misses(keys);
+        for (size_t i = 0; i < misses.size(); ++i) {
+            misses[i][misses[i].size() - 1] = '#';
+        }
+        timer t;
+        for (int pass = 0; pass < 4; ++pass) {
+            for (size_t i = 0; i < misses.size(); ++i) {
+                found += table.exists(misses[i]);
+            }
+        }
+        report("  table miss", t.seconds(), misses.size() * 4);
+    }
+    hat_set<string, H> set(keys.begin(), keys.end());
+    {
+        timer t;
+        for (size_t i = 0; i < lookups.size(); ++i) {
+            found += set.exists(lookups[i]);
+        }
+        report("  trie hit", t.seconds(), lookups.size());
+    }
+    return found;
+}
+
+// Compares the hash policies on short and long keys.
+static size_t bench_hashes(const vector<string> &words) {
+    vector<string> keys = words;
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+    // URL-like keys, 40 to 80 bytes long, that share long prefixes
+    vector<string> urls;
+    char id[32];
+    for (size_t i = 0; i < keys.size() * 4; ++i) {
+        sprintf(id, "?id=%lu", (unsigned long) i);
+        urls.push_back("https://www.example.com/" + keys[i % keys.size()] +
+                       "/" + keys[(i * 7919) % keys.size()] + id);
+    }
+
+    size_t found = 0;
+    printf("%lu words\n", (unsigned long) keys.size());
+    found += bench_hash<shift_add_xor_hash>("shift_add_xor_hash", keys,
+                                            words);
+    found += bench_hash<word_hash>("word_hash", keys, words);
+    found += bench_hash<fingerprinted<word_hash> >("fingerprinted", keys,
+                                                   words);
+    printf("%lu urls\n", (unsigned long) urls.size());
+    found += bench_hash<shift_add_xor_hash>("shift_add_xor_hash", urls,
+                                            urls);
+    found += bench_hash<word_hash>("word_hash", urls, urls);
+    found += bench_hash<fingerprinted<word_hash> >("fingerprinted", urls,
+                                                   urls);
+    return found;
+}
+
+// Times full scans of the strings in many small tables, unordered as
+// while bursting and ordered as in a set with a small burst threshold.
+// Each table has few strings compared to its number of slots.
+static size_t bench_iterate(const vector<string> &words) {
+    static const int PASSES = 20;
+    int slot_counts[] = { 16, 512 };
+
+    vector<string> keys = words;
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+    size_t found = 0;
+    for (int i = 0; i < 2; ++i) {
+        array_hash_traits ah_traits(slot_counts[i], 32, 0);
+        printf("%d slots\n", slot_counts[i]);
+
+        // One table for every 32 keys
+        vector<array_hash<string> > tables(keys.size() / 32 + 1,
+                                           array_hash<string>(ah_traits));
+        for (size_t j = 0; j < keys.size(); ++j) {
+            tables[j / 32].insert(keys[j]);
+        }
+        {
+            timer t;
+            for (int pass = 0; pass < PASSES; ++pass) {
+                for (size_t j = 0; j < tables.size(); ++j) {
+                    array_hash<string>::iterator it;
+                    for (it = tables[j].begin(); it != tables[j].end(); ++it) {
+                        found += it.length();
+                    }
+                }
+            }
+            report("  tables", t.seconds(), keys.size() * PASSES);
+        }
+
+        // The first pass over a set sorts every container
+        hat_set<string> set(keys.begin(), keys.end(), hat_trie_traits(64),
+                            ah_traits);
+        for (int pass = 0; pass < 2; ++pass) {
+            timer t;
+            for (hat_set<string>::iterator it = set.begin(); it != set.end();
+                    ++it) {
+                found += (*it).size();
+            }
+            report(pass == 0 ? "  set first" : "  set again", t.seconds(),
+                   set.size());
+        }
+    }
+    return found;
+}
+
+// Compares pure and hybrid containers on a set of keys.
+static size_t bench_shape(const vector<string> &keys, size_t burst_threshold) {
+    typedef counting_allocator<char> alloc;
+    typedef hat_set<string, shift_add_xor_hash, alloc> set_type;
+    typedef htnode<string, shift_add_xor_hash, alloc> node_type;
+    typedef ahnode<string, shift_add_xor_hash, alloc> container_type;
+
+    size_t found = 0;
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        printf(hybrid ? "hybrid\n" : "pure\n");
+        found += bench_set<set_type>(keys,
+                hat_trie_traits(burst_threshold, hybrid != 0));
+
+        // Build the set again to count what is in it
+        set_type set(keys.begin(), keys.end(),
+                     hat_trie_traits(burst_threshold, hybrid != 0));
+        printf("%lu nodes, %lu containers (%.1f words/container)\n\n",
+               (unsigned long) counting_allocator<node_type>::live,
+               (unsigned long) counting_allocator<container_type>::live,
+               double(set.size()) / counting_allocator<container_type>::live);
+    }
+    return found;
+}
+
+// Compares pure and hybrid containers on the words and on skewed keys.
+static size_t bench_shapes(const vector<string> &words,
+                           size_t burst_threshold) {
+    size_t found = 0;
+    printf("== words\n");
+    found += bench_shape(words, burst_threshold);
+
+    // Time-prefixed keys, as in a log: most keys share a few first bytes
+    vector<string> skewed;
+    char stamp[32];
+    for (size_t i = 0; i < words.size(); ++i) {
+        sprintf(stamp, "2011-11-%02d ", (int) (i * 30 / words.size()) + 1);
+        skewed.push_back(stamp + words[i]);
+    }
+    printf("== skewed\n");
+    found += bench_shape(skewed, burst_threshold);
+    return found;
+}
+
+// Times lookups of groups of keys, one at a time and with exists_batch,
+// on a set too large for the cache.
+static size_t bench_batch(const vector<string> &words) {
+    static const size_t KEYS = 2000000;
+    static const size_t GROUP = 256;
+
+    vector<string> distinct = words;
+    sort(distinct.begin(), distinct.end());
+    distinct.erase(unique(distinct.begin(), distinct.end()), distinct.end());
+
+    // Pairs of words, in random order
+    vector<string> keys;
+    srand(1);
+    for (size_t i = 0; i < KEYS; ++i) {
+        keys.push_back(distinct[rand() % distinct.size()] + " " +
+                       distinct[rand() % distinct.size()]);
+    }
+    hat_set<string> set(keys.begin(), keys.end());
+    printf("%lu keys\n", (unsigned long) set.size());
+
+    vector<string> hits(keys.begin(), keys.begin() + KEYS / 2);
+#if __cplusplus >= 201103L
+    shuffle(hits.begin(), hits.end(), mt19937(1));
+#else
+    random_shuffle(hits.begin(), hits.end());
+#endif
+    vector<string> misses;
+    for (size_t i = 0; i < hits.size(); ++i) {
+        misses.push_back(hits[i] + "#");
+    }
+
+    size_t found = 0;
+    bool results[GROUP];
+    for (int pass = 0; pass < 2; ++pass) {
+        const vector<string> &lookups = pass == 0 ? hits : misses;
+        printf(pass == 0 ? "hits\n" : "misses\n");
+        {
+            timer t;
+            for (size_t i = 0; i + GROUP <= lookups.size(); i += GROUP) {
+                for (size_t j = 0; j < GROUP; ++j) {
+                    results[j] = set.exists(lookups[i + j]);
+                }
+                found += results[GROUP - 1];
+            }
+            report("  exists", t.seconds(), lookups.size());
+        }
+        {
+            timer t;
+            for (size_t i = 0; i + GROUP <= lookups.size(); i += GROUP) {
+                set.exists_batch(lookups.begin() + i,
+                                 lookups.begin() + i + GROUP, results);
+                found += results[GROUP - 1];
+            }
+            report("  batch", t.seconds(), lookups.size());
+        }
+    }
+    return found;
+}
+
+#if __cplusplus >= 201103L
+static void report_speedup(int threads, double seconds, double serial,
+                           size_t n) {
+    char name[32];
+    sprintf(name, "  %d thread%s", threads, threads == 1 ? "" : "s");
+    printf("%-12s %8.3f s  %8.1f ns/op  %5.2fx\n", name, seconds,
+           seconds * 1e9 / n, serial / seconds);
+}
+
+// Folds the length_counters of a parallel_for_each
+struct add_lengths {
+    void operator()(length_counter &into, const length_counter &from) {
+        into.n += from.n;
+    }
+};
+
+// Times inserting keys into a concurrent_hat_set from more and more
+// threads, each inserting its share of the keys, loading them into a
+// hat_set on as many threads, and scanning the set on as many threads.
+static size_t bench_threads(const vector<string> &words, int max_threads) {
+    static const size_t KEYS = 2000000;
+
+    vector<string> distinct = words;
+    sort(distinct.begin(), distinct.end());
+    distinct.erase(unique(distinct.begin(), distinct.end()), distinct.end());
+
+    // Pairs of words, in random order
+    vector<string> keys;
+    srand(1);
+    for (size_t i = 0; i < KEYS; ++i) {
+        keys.push_back(distinct[rand() % distinct.size()] + " " +
+                       distinct[rand() % distinct.size()]);
+    }
+
+    size_t found = 0;
+    double serial;
+    {
+        wall_timer t;
+        hat_set<string> set(keys.begin(), keys.end());
+        serial = t.seconds();
+        report("hat_set", serial, keys.size());
+        found += set.size();
+    }
+    for (int prefix_length = 1; prefix_length <= 2; ++prefix_length) {
+        printf("sharded by %d byte%s\n", prefix_length,
+               prefix_length == 1 ? "" : "s");
+        for (int n = 1; n <= max_threads; n *= 2) {
+            concurrent_hat_set<string> set(prefix_length);
+            wall_timer t;
+            vector<std::thread> threads;
+            for (int i = 0; i < n; ++i) {
+                threads.push_back(std::thread([&set, &keys, n, i] {
+                    for (size_t j = i; j < keys.size(); j += n) {
+                        set.insert(keys[j]);
+                    }
+                }));
+            }
+            for (size_t i = 0; i < threads.size(); ++i) {
+                threads[i].join();
+            }
+            double seconds = t.seconds();
+
+            report_speedup(n, seconds, serial, keys.size());
+            found += set.size();
+        }
+    }
+    printf("parallel_load\n");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        hat_set<string> set;
+        wall_timer t;
+        set.parallel_load(keys.begin(), keys.end(), n);
+        report_speedup(n, t.seconds(), serial, keys.size());
+        found += set.size();
+    }
+
+    // Containers are sorted the first time, and parallel_for_each doesn't
+    // sort them at all, so the serial scan is timed once they are.
+    hat_set<string> set(keys.begin(), keys.end());
+    found += set.for_each(length_counter()).n;
+    {
+        wall_timer t;
+        found += set.for_each(length_counter()).n;
+        serial = t.seconds();
+        report("for_each", serial, set.size());
+    }
+    printf("parallel_for_each\n");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        wall_timer t;
+        found += set.parallel_for_each(length_counter(), add_lengths(), n).n;
+        report_speedup(n, t.seconds(), serial, set.size());
+    }
+    return found;
+}
+#endif
+
+int main(int argc, char **argv) {
+    vector<string> words;
+    string word;
+    while (cin >> word) {
+        words.push_back(word);
+    }
+
+    if (argc > 1 && string(argv[1]) == "hash") {
+        return bench_hashes(words) == 0;
+    }
+    if (argc > 1 && string(argv[1]) == "iterate") {
+        return bench_iterate(words) == 0;
+    }
+    if (argc > 1 && string(argv[1]) == "batch") {
+        return bench_batch(words) == 0;
+    }
+#if __cplusplus >= 201103L
+    if (argc > 1 && string(argv[1]) == "threads") {
+        int max_threads = argc > 2 ? atoi(argv[2]) :
+                          (int) std::thread::hardware_concurrency();
+        return bench_threads(words, max(max_threads, 1)) == 0;
+    }
+#endif
+    if (argc > 1 && string(argv[1]) == "hybrid") {
+        hat_trie_traits traits;
+        return bench_shapes(words, argc > 2 ? atoi(argv[2]) :
+                                   traits.burst_threshold) == 0;
+    }
+
+    bool slab = argc > 1 && string(argv[1]) == "slab";
+    if (slab) {
+        --argc;
+        ++argv;
+    }
+    hat_trie_traits traits;
+    if (argc > 1) {
+        traits.burst_threshold = atoi(argv[1]);
+    }
+    if (slab) {
+        typedef hat_set<string, shift_add_xor_hash, slab_allocator<char> >
+                slab_set;
+        return bench_set<slab_set>(words, traits) == 0;
+    }
+    return bench_set<hat_set<string> >(words, traits) == 0;
+}
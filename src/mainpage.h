@@ -19,28 +19,29 @@
  * @li @c find(string)
  * @li @c insert(record)
  * @li @c insert(iterator, iterator)
+ * @li @c lower_bound(string), @c upper_bound(string), and
+ * @c equal_range(string)
  * @li @c size()
  * @li @c swap(hat_set &)
- * @li forward iteraton and iterator dereferencing
+ * @li ordered forward iteraton and iterator dereferencing
+ * @li @c operator[](string) and @c insert_or_assign(string, T) (@c hat_map
+ * only)
  *
  * In a @c hat_set, @c record is a @c std::string. In a @c hat_map, @c record
- * is a @c pair<std::string, T>.
+ * is a @c pair<std::string, T>. A @c hat_map stores each value inline next
+ * to its key, so @c T must be safe to copy with @c memcpy.
  *
  * @section Future
  *
  * Here is a list of major operations that have yet to be implemented:
  *
  * @li reverse iteration
- * @li @c lower_bound(string)
- * @li @c upper_bound(string)
- * @li @c equal_range(string)
- * @li @c match_prefix(string) (an extension)
  *
  * @section Usage
  *
  * @subsection Installation
  * Copy all the headers into a directory in your PATH and include @c hat_set.h
- * in your project. Some of the headers require @c stdint.h, which isn't
+ * or @c hat_map.h in your project. Some of the headers require @c stdint.h, which isn't
  * available by default on most Windows platforms. You can find a compatible
  * version of the header on Google.
  *
@@ -72,16 +73,54 @@
  *
  * @li @c exists(string) -- returns true iff there is a record in the trie
  * with a matching key
- * @li @c match_prefix(string) -- returns a set of all strings that have
- * the parameter as a prefix. To be implemented.
+ * @li @c prefix_match(string) -- returns a range of iterators over all the
+ * strings that have the parameter as a prefix
+ * @li @c (const char *, size_t) overloads of every lookup, @c insert and
+ * @c erase -- keys are byte strings of up to 65534 bytes and may contain
+ * NULL characters and bytes >= 0x80. Lookups and inserts also take an
+ * @c stx::key_view, which doesn't copy the key: @c std::string_view under
+ * C++17, and a small (pointer, length) view before that
+ * @li a hash policy template parameter -- @c hat_set<string, word_hash>
+ * hashes container keys eight bytes at a time instead of using the
+ * paper's byte-at-a-time @c shift_add_xor_hash
+ * @li @c fingerprinted<H> -- stores a fingerprint byte with every entry so
+ * slot searches skip mismatches without comparing strings
+ * @li @c slab_allocator<char> (in @c slab_allocator.h) -- an allocator
+ * template parameter that keeps nodes and container slots in large
+ * shared chunks, e.g. <tt>hat_set<string, shift_add_xor_hash,
+ * slab_allocator<char> ></tt>
+ * @li @c hat_trie_traits::hybrid_containers -- uses the paper's hybrid
+ * containers, which are split by character range instead of being burst
+ * into a node with a container for every character
+ * @li @c bulk_load(first, last) and the @c sorted_unique constructors --
+ * build a trie from sorted, distinct keys in one pass, with every
+ * container allocated at its exact size and no searching or bursting
+ * @li @c exists_batch(first, last, out) and @c find_batch -- look up many
+ * keys at once, interleaving their descents and prefetching each next
+ * step so their cache misses overlap
+ * @li @c hat_trie_traits::concurrent_readers (C++11) -- lets any number of
+ * threads call @c exists and @c find without locks while one thread
+ * inserts and erases. Replaced memory is freed through epoch-based
+ * reclamation (see @c epoch.h and @c read_guard)
+ * @li @c concurrent_hat_set (in @c concurrent_hat_set.h, C++11) -- a set
+ * that many threads insert into at once, split into shards by its words'
+ * first one or two bytes, each behind a lock of its own
+ * @li @c parallel_load(first, last, threads) (C++11) -- builds a trie from
+ * unsorted keys on several threads, one subtree under the root per first
+ * byte, ending up exactly as inserting them in order would
+ * @li @c parallel_for_each(f, combine, threads) (C++11) -- scans the trie
+ * on several threads that steal subtrees from each other, each with its
+ * own copy of @c f, folded together with @c combine at the end
  *
  * @section Deviations
  * The hat@_trie interface differs from the standard in a few ways:
  *
  * @li @c insert(record) -- returns a @c bool rather than a <tt> pair<iterator,
  * bool></tt>. See the HTML documentation for rationale.
- * @li iterator traversals are unordered. Ordered traversals are in the
- * works.
+ *
+ * Iterator traversals are ordered. Each container is sorted lazily the
+ * first time it is iterated over, and the order is cached until the
+ * container is next modified.
  *
  * @section Testing
  * The test files in the test/ directory achieve > 95% coverage of hat_trie.h
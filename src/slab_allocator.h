@@ -0,0 +1,353 @@
+/*
+ * Copyright 2010-2011 Chris Vaszauskas and Tyler Richard
+ *
+ * This file is part of a HAT-trie implementation following the paper
+ * entitled "HAT-trie: A Cache-concious Trie-based Data Structure for
+ * Strings" by Nikolas Askitis and Ranjan Sinha.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+
+namespace stx {
+
+/**
+ * @brief Size-class arena that hands out small blocks from large chunks
+ *
+ * Requests are rounded up to a multiple of GRANULE bytes. Each rounded
+ * size has its own free list, so a block that is freed is reused by the
+ * next request of the same size class without going back to the system
+ * allocator. Blocks larger than MAX_BLOCK bytes are passed straight
+ * through to operator new.
+ *
+ * Chunks are only returned to the system when the arena is destroyed,
+ * all at once.
+ *
+ * An arena is not thread safe. Don't share one between threads without
+ * locking.
+ */
+class slab_arena
+{
+  public:
+    /// every block is a multiple of this many bytes, and aligned to it
+    static const size_t GRANULE = 16;
+
+    /// largest block served from a chunk
+    static const size_t MAX_BLOCK = 1024;
+
+    /**
+     * Constructor.
+     *
+     * @param chunk_size  number of bytes to request from the system at a
+     *                    time. Must be >= MAX_BLOCK
+     */
+    slab_arena(size_t chunk_size = 65536) :
+            _chunks(NULL), _cursor(NULL), _limit(NULL),
+            _chunk_size(chunk_size), _chunk_count(0), _references(0)
+    {
+        for (size_t i = 0; i < CLASS_COUNT; ++i) {
+            _free[i] = NULL;
+        }
+    }
+
+    /**
+     * Destructor. Frees every chunk, whether or not the blocks in it
+     * were deallocated.
+     */
+    ~slab_arena()
+    {
+        while (_chunks) {
+            chunk *next = _chunks->next;
+            ::operator delete(_chunks);
+            _chunks = next;
+        }
+    }
+
+    /**
+     * Gets a block of at least @a n bytes.
+     *
+     * O(1)
+     */
+    void *allocate(size_t n)
+    {
+        if (n > MAX_BLOCK) {
+            return ::operator new(n);
+        }
+
+        size_t c = _class(n);
+        if (_free[c]) {
+            // Reuse a block of this size.
+            free_block *result = _free[c];
+            _free[c] = result->next;
+            return result;
+        }
+
+        size_t size = (c + 1) * GRANULE;
+        if (_cursor + size > _limit) {
+            _new_chunk();
+        }
+        void *result = _cursor;
+        _cursor += size;
+        return result;
+    }
+
+    /**
+     * Returns a block of @a n bytes that was returned by allocate(n).
+     *
+     * O(1)
+     */
+    void deallocate(void *p, size_t n)
+    {
+        if (p == NULL) {
+            return;
+        }
+        if (n > MAX_BLOCK) {
+            ::operator delete(p);
+            return;
+        }
+
+        size_t c = _class(n);
+        free_block *block = (free_block *) p;
+        block->next = _free[c];
+        _free[c] = block;
+    }
+
+    /**
+     * Gets the number of chunks this arena has requested from the system.
+     */
+    size_t chunk_count() const
+    {
+        return _chunk_count;
+    }
+
+  private:
+    static const size_t CLASS_COUNT = MAX_BLOCK / GRANULE;
+
+    // Chunks are linked together so they can be freed at once. The
+    // header is padded to keep the blocks after it aligned.
+    union chunk {
+        chunk *next;
+        char padding[GRANULE];
+    };
+
+    // Freed blocks are linked through their first bytes.
+    struct free_block {
+        free_block *next;
+    };
+
+    chunk *_chunks;
+    char *_cursor;      // first unused byte in the newest chunk
+    char *_limit;       // one past the last byte in the newest chunk
+    size_t _chunk_size;
+    size_t _chunk_count;
+    free_block *_free[CLASS_COUNT];  // one free list per size class
+
+    // number of slab_allocators using this arena
+    size_t _references;
+
+    template <class T> friend class slab_allocator;
+
+    // Gets the size class of a block of n bytes
+    static size_t _class(size_t n)
+    {
+        return n == 0 ? 0 : (n - 1) / GRANULE;
+    }
+
+    // Starts carving blocks out of a new chunk. The rest of the old
+    // chunk is too small for the last request and is left unused.
+    void _new_chunk()
+    {
+        chunk *c = (chunk *) ::operator new(sizeof(chunk) + _chunk_size);
+        c->next = _chunks;
+        _chunks = c;
+        _cursor = (char *) (c + 1);
+        _limit = _cursor + _chunk_size;
+        ++_chunk_count;
+    }
+
+    // arenas are shared, not copied
+    slab_arena(const slab_arena &);
+    slab_arena &operator=(const slab_arena &);
+};
+
+/**
+ * @brief STL allocator that gets its memory from a shared slab_arena
+ *
+ * A default constructed slab_allocator makes a new arena. Copies of an
+ * allocator, including copies rebound to other types, share its arena,
+ * and the arena is destroyed along with the last allocator that uses
+ * it. A container that copies its allocator into every node therefore
+ * keeps all of its memory in one arena, and releases it in large chunks
+ * when the container goes away.
+ *
+ * @subsection Usage
+ * @code
+ * hat_set<string, shift_add_xor_hash, slab_allocator<char> > words;
+ * @endcode
+ *
+ * Allocators that share an arena are not thread safe. See slab_arena.
+ */
+template <class T>
+class slab_allocator
+{
+  public:
+    // STL types
+    typedef T                value_type;
+    typedef T *              pointer;
+    typedef const T *        const_pointer;
+    typedef T &              reference;
+    typedef const T &        const_reference;
+    typedef size_t           size_type;
+    typedef std::ptrdiff_t   difference_type;
+
+    template <class U>
+    struct rebind {
+        typedef slab_allocator<U> other;
+    };
+
+    /**
+     * Makes an allocator with a new arena.
+     *
+     * @param chunk_size  see slab_arena::slab_arena()
+     */
+    explicit slab_allocator(size_t chunk_size = 65536) :
+            _arena(new slab_arena(chunk_size))
+    {
+        _arena->_references = 1;
+    }
+
+    /**
+     * Makes an allocator that shares @a rhs's arena.
+     */
+    slab_allocator(const slab_allocator &rhs) : _arena(rhs._arena)
+    {
+        ++_arena->_references;
+    }
+
+    /**
+     * Makes an allocator that shares @a rhs's arena.
+     */
+    template <class U>
+    slab_allocator(const slab_allocator<U> &rhs) : _arena(rhs._arena)
+    {
+        ++_arena->_references;
+    }
+
+    ~slab_allocator()
+    {
+        _release();
+    }
+
+    slab_allocator &operator=(const slab_allocator &rhs)
+    {
+        ++rhs._arena->_references;
+        _release();
+        _arena = rhs._arena;
+        return *this;
+    }
+
+    pointer allocate(size_type n, const void * = NULL)
+    {
+        return (pointer) _arena->allocate(n * sizeof(T));
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+        _arena->deallocate(p, n * sizeof(T));
+    }
+
+    pointer address(reference x) const
+    {
+        return &x;
+    }
+
+    const_pointer address(const_reference x) const
+    {
+        return &x;
+    }
+
+    size_type max_size() const
+    {
+        return size_type(-1) / sizeof(T);
+    }
+
+    void construct(pointer p, const T &value)
+    {
+        new (p) T(value);
+    }
+
+    void destroy(pointer p)
+    {
+        p->~T();
+    }
+
+    /**
+     * Gets the arena this allocator gets its memory from.
+     */
+    const slab_arena &arena() const
+    {
+        return *_arena;
+    }
+
+  private:
+    slab_arena *_arena;
+
+    template <class U> friend class slab_allocator;
+    template <class U, class V>
+    friend bool operator==(const slab_allocator<U> &,
+                           const slab_allocator<V> &);
+
+    // Destroys the arena if this was the last allocator using it
+    void _release()
+    {
+        slab_arena *arena = _arena;
+        _arena = NULL;
+        if (--arena->_references == 0) {
+            _destroy(arena);
+        }
+    }
+
+    // Kept out of line. Inlined into the destructor of a temporary copy,
+    // the delete makes GCC warn that the next copy of the allocator uses
+    // the arena after it was freed, as it can't see the other references
+#if defined(__GNUC__)
+    __attribute__((noinline))
+#endif
+    static void _destroy(slab_arena *arena)
+    {
+        delete arena;
+    }
+};
+
+/// Allocators are equal if they share an arena
+template <class U, class V>
+bool operator==(const slab_allocator<U> &lhs, const slab_allocator<V> &rhs)
+{
+    return lhs._arena == rhs._arena;
+}
+
+template <class U, class V>
+bool operator!=(const slab_allocator<U> &lhs, const slab_allocator<V> &rhs)
+{
+    return !(lhs == rhs);
+}
+
+}  // namespace stx
+
+#endif  // SLAB_ALLOCATOR_H
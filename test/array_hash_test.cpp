@@ -10,14 +10,18 @@
 
 #define TEST BOOST_AUTO_TEST_CASE
 
+#include <algorithm>
+#include <cstdio>
 #include <string>
 #include <set>
 #include <stack>
+#include <vector>
 
 #include <boost/test/unit_test.hpp>
 #include <boost/foreach.hpp>
 
 #include "../src/array_hash.h"
+#include "../src/slab_allocator.h"
 
 #define foreach BOOST_FOREACH
 #define reverse_foreach BOOST_REVERSE_FOREACH
@@ -86,6 +90,40 @@ TEST(testFind)
     }
 }
 
+TEST(testKeyViews)
+{
+    // Keys that are parts of a larger buffer, not strings of their own
+    const char buffer[] = "abcdabcd";
+    array_hash<string> h;
+    for (size_t length = 0; length <= 4; ++length) {
+        BOOST_CHECK(h.insert(buffer, length));
+    }
+    for (size_t length = 0; length <= 4; ++length) {
+        BOOST_CHECK_EQUAL(h.count(buffer + 4, length), 1);
+        BOOST_CHECK(h.find(buffer + 4, length) != h.end());
+    }
+    BOOST_CHECK_EQUAL(h.count(buffer + 1, 2), 0);
+    BOOST_CHECK_EQUAL(h.count(string("abc")), 1);
+
+    key_view view(buffer + 4, 3);
+    BOOST_CHECK(h.exists(view));
+    BOOST_CHECK_EQUAL(h.count(view), 1);
+    BOOST_CHECK_EQUAL(h.find(view).length(), 3);
+    BOOST_CHECK_EQUAL(h.erase(view), 1);
+    BOOST_CHECK(h.exists(view) == false);
+    BOOST_CHECK(h.insert(view));
+    BOOST_CHECK(h.insert(view) == false);
+
+    // Views point at the bytes they were made from instead of copying them
+    string abc("abc");
+    BOOST_CHECK(key_view(abc).data() == abc.data());
+    BOOST_CHECK(key_view(buffer).data() == buffer);
+    BOOST_CHECK_EQUAL(key_view(buffer).size(), 8u);
+    BOOST_CHECK(key_view(abc) == view);
+    BOOST_CHECK(key_view(buffer, 3) == view);
+    BOOST_CHECK(key_view(buffer, 2) < view);
+}
+
 TEST(testCopyConstructor)
 {
     array_hash<string> a(data.begin(), data.end());
@@ -93,6 +131,49 @@ TEST(testCopyConstructor)
     BOOST_CHECK(a == b);
 }
 
+#if __cplusplus >= 201103L
+TEST(testMove)
+{
+    static_assert(
+            std::is_nothrow_move_constructible<array_hash<string> >::value,
+            "array_hash moves without throwing");
+
+    array_hash<string> control(data.begin(), data.end());
+    array_hash<string> a(control);
+    array_hash<string> b(std::move(a));
+    BOOST_CHECK(b == control);
+    BOOST_CHECK(a.empty());
+
+    // A moved from table is empty and can be used as it is
+    BOOST_CHECK(a.begin() == a.end());
+    BOOST_CHECK(a.find("abc") == a.end());
+    BOOST_CHECK_EQUAL(a.erase("abc"), 0u);
+    BOOST_CHECK(array_hash<string>(a).empty());
+    a.insert("abc");
+    BOOST_CHECK(a.exists("abc"));
+    BOOST_CHECK_EQUAL(a.size(), 1u);
+
+    array_hash<string> c(std::move(a));
+    a.grow();
+    a.insert("abc");
+    BOOST_CHECK(a == c);
+    array_hash<string> d(std::move(a));
+    a.clear();
+    BOOST_CHECK(a.empty());
+
+    a = std::move(b);
+    BOOST_CHECK(a == control);
+
+    vector<array_hash<string> > tables;
+    for (int i = 0; i < 10; ++i) {
+        tables.push_back(array_hash<string>(data.begin(), data.end()));
+    }
+    foreach (array_hash<string>& table, tables) {
+        BOOST_CHECK(table == control);
+    }
+}
+#endif
+
 TEST(testTraits)
 {
     // Make an array hash with default values, then some more
@@ -212,6 +293,109 @@ TEST(testReverseIteration)
     }
 }
 
+TEST(testSparseIteration)
+{
+    // A few strings spread over many slots, some of them in the same
+    // bitmap word and some far apart
+    array_hash<string> ah(array_hash_traits(4096, 32, 0));
+    set<string> keys;
+    char buffer[16];
+    for (int i = 0; i < 40; ++i) {
+        sprintf(buffer, "%d", i * i);
+        keys.insert(buffer);
+        ah.insert(buffer);
+    }
+    check_equal(ah, keys);
+
+    // Walk forward, then back down to begin()
+    vector<string> forward;
+    array_hash<string>::iterator it;
+    for (it = ah.begin(); it != ah.end(); ++it) {
+        forward.push_back(*it);
+    }
+    BOOST_CHECK_EQUAL(forward.size(), keys.size());
+    for (size_t i = forward.size(); i > 0; --i) {
+        --it;
+        BOOST_CHECK_EQUAL(forward[i - 1], *it);
+    }
+    BOOST_CHECK(it == ah.begin());
+
+    // Emptied slots are skipped
+    for (size_t i = 0; i < forward.size(); i += 2) {
+        BOOST_CHECK_EQUAL(ah.erase(forward[i]), 1);
+        keys.erase(forward[i]);
+    }
+    check_equal(ah, keys);
+    size_t n = 0;
+    for (it = ah.end(); it != ah.begin(); --it) {
+        ++n;
+    }
+    BOOST_CHECK_EQUAL(n, keys.size());
+}
+
+TEST(testOrderedIteration)
+{
+    array_hash_traits traits(2, 0);
+    array_hash<string> ah(data.begin(), data.end(), traits);
+    array_hash<string>::ordered_iterator it = ah.ordered_begin();
+    foreach (const string& str, data) {
+        BOOST_CHECK_EQUAL(str, *it);
+        ++it;
+    }
+    BOOST_CHECK(it == ah.ordered_end());
+
+    // Walk back down from the end
+    reverse_foreach (const string& str, data) {
+        --it;
+        BOOST_CHECK_EQUAL(str, *it);
+    }
+    BOOST_CHECK(it == ah.ordered_begin());
+
+    // The order is recomputed after the table is modified
+    ah.insert("aa");
+    it = ah.ordered(ah.find("a"));
+    ++it;
+    BOOST_CHECK_EQUAL(string("aa"), *it);
+    ah.erase(it);
+    ++(it = ah.ordered(ah.find("a")));
+    BOOST_CHECK_EQUAL(string("ab"), *it);
+}
+
+// Collects the strings array_hash::for_each visits
+struct string_collector
+{
+    vector<string> strings;
+
+    void operator()(const char *str, size_t length, no_value &)
+    {
+        strings.push_back(string(str, length));
+    }
+};
+
+TEST(testForEach)
+{
+    // Many slots, and binary strings
+    set<string> strings(data);
+    for (int i = 0; i < 1000; ++i) {
+        strings.insert(string("x\0", 2) + char(i) + char(i >> 8));
+    }
+    array_hash<string> ah(strings.begin(), strings.end(),
+                          array_hash_traits(64, 0));
+    vector<string> visited = ah.for_each(string_collector()).strings;
+
+    // Same order as the iterators
+    vector<string> iterated;
+    for (array_hash<string>::iterator it = ah.begin(); it != ah.end(); ++it) {
+        iterated.push_back(string(*it, it.length()));
+    }
+    BOOST_CHECK(visited == iterated);
+    sort(visited.begin(), visited.end());
+    BOOST_CHECK(visited == vector<string>(strings.begin(), strings.end()));
+
+    array_hash<string> empty;
+    BOOST_CHECK(empty.for_each(string_collector()).strings.empty());
+}
+
 TEST(testIteratorBounds)
 {
     array_hash<string> ah(data.begin(), data.end());
@@ -243,6 +427,219 @@ TEST(testEquality)
     BOOST_CHECK(d != e);
 }
 
+TEST(testBinaryKeys)
+{
+    // Strings that only differ after an embedded NUL are distinct
+    string keys[] = { string("a\0b", 3), string("a\0c", 3), string("a", 1),
+                      string("a\0", 2), string("\xff\x80", 2), string() };
+    array_hash<string> a;
+    foreach (const string& key, keys) {
+        BOOST_CHECK(a.insert(key.data(), key.size()));
+    }
+    BOOST_CHECK(a.size() == 6);
+    foreach (const string& key, keys) {
+        BOOST_CHECK(a.exists(key));
+        array_hash<string>::iterator it = a.find(key.data(), key.size());
+        BOOST_CHECK(string(*it, it.length()) == key);
+    }
+    BOOST_CHECK(a.exists("a\0d", 3) == false);
+
+    // Ordered iteration compares bytes as unsigned
+    set<string> sorted(keys, keys + 6);
+    array_hash<string>::ordered_iterator it = a.ordered_begin();
+    foreach (const string& key, sorted) {
+        BOOST_CHECK(string(*it, it.length()) == key);
+        ++it;
+    }
+
+    BOOST_CHECK_EQUAL(a.erase("a\0b", 3), 1);
+    BOOST_CHECK(a.exists("a\0c", 3));
+    BOOST_CHECK(a.exists("a\0b", 3) == false);
+}
+
+TEST(testHashPolicy)
+{
+    // Keys around the word size exercise every path of word_hash
+    set<string> keys;
+    string key;
+    for (int i = 0; i < 40; ++i) {
+        keys.insert(key);
+        key += char('a' + i % 26);
+        keys.insert(key + "!");
+    }
+
+    array_hash<string, word_hash> a(keys.begin(), keys.end());
+    BOOST_CHECK(a.size() == keys.size());
+    foreach (const string& str, keys) {
+        BOOST_CHECK(a.exists(str));
+        BOOST_CHECK(a.exists(str + "?") == false);
+    }
+    check_equal(a, keys);
+
+    // Equal keys hash equally however they are laid out in memory
+    word_hash h;
+    char buffer[] = "xxabcdefghijk";
+    BOOST_CHECK_EQUAL(h(buffer + 2, 11), h("abcdefghijk", 11));
+    BOOST_CHECK(h("abc", 3) != h("abd", 3));
+    BOOST_CHECK(h("", 0) != h("\0", 1));
+}
+
+template <class H>
+void check_policy(const set<string>& keys)
+{
+    array_hash<string, H> a(keys.begin(), keys.end(), array_hash_traits(4));
+    BOOST_CHECK(a.size() == keys.size());
+    foreach (const string& str, keys) {
+        BOOST_CHECK(a.exists(str));
+        BOOST_CHECK(a.exists(str + '\0') == (keys.count(str + '\0') > 0));
+    }
+    typename array_hash<string, H>::ordered_iterator it = a.ordered_begin();
+    foreach (const string& str, keys) {
+        BOOST_CHECK(string(*it, it.length()) == str);
+        ++it;
+    }
+    foreach (const string& str, keys) {
+        BOOST_CHECK_EQUAL(a.erase(str), 1);
+    }
+    BOOST_CHECK(a.empty());
+}
+
+TEST(testFingerprints)
+{
+    // Many keys per slot that share lengths and first bytes
+    set<string> keys;
+    keys.insert("");
+    keys.insert(string(1, '\0'));
+    for (int i = 0; i < 500; ++i) {
+        string key(1 + i % 9, 'a');
+        key[key.size() - 1] = char(i);
+        keys.insert(key);
+    }
+    check_policy<shift_add_xor_hash>(keys);
+    check_policy<fingerprinted<shift_add_xor_hash> >(keys);
+    check_policy<fingerprinted<word_hash> >(keys);
+}
+
+TEST(testGrowth)
+{
+    set<string> keys;
+    char buffer[16];
+    for (int i = 0; i < 2000; ++i) {
+        sprintf(buffer, "%d", i * 7);
+        keys.insert(buffer);
+    }
+
+    // The table starts with one slot and doubles as it fills up
+    array_hash<string> a(array_hash_traits(1, 0, 2));
+    foreach (const string& str, keys) {
+        BOOST_CHECK(a.insert(str));
+        BOOST_CHECK(a.exists(str));
+    }
+    BOOST_CHECK(a.size() == keys.size());
+    foreach (const string& str, keys) {
+        BOOST_CHECK(a.exists(str));
+        BOOST_CHECK(a.exists(str + "x") == false);
+    }
+    check_equal(a, keys);
+
+    // Copies keep the grown table
+    array_hash<string> b(a);
+    array_hash<string> c;
+    c = a;
+    check_equal(b, keys);
+    check_equal(c, keys);
+    BOOST_CHECK(c.exists("7"));
+
+    // A table that never grows holds the same keys
+    array_hash<string> d(keys.begin(), keys.end(), array_hash_traits(2, 32, 0));
+    BOOST_CHECK(a == d);
+
+    foreach (const string& str, keys) {
+        BOOST_CHECK_EQUAL(a.erase(str), 1);
+    }
+    BOOST_CHECK(a.empty());
+    BOOST_CHECK(a.begin() == a.end());
+}
+
+TEST(testFillDistinct)
+{
+    set<string> keys;
+    char buffer[16];
+    for (int i = 0; i < 2000; ++i) {
+        sprintf(buffer, "%d", i * 7);
+        keys.insert(buffer);
+    }
+    keys.insert("");
+
+    // A filled table matches one built by insert() with the same traits
+    array_hash_traits traits(1, 32, 2);
+    array_hash<string> a(keys.begin(), keys.end(), traits);
+    array_hash<string> b(data.begin(), data.end(), traits);
+    b.reserve_distinct(keys.size());
+    foreach (const string& str, keys) {
+        b.measure(str.data(), str.size());
+    }
+    b.allocate_measured();
+    foreach (const string& str, keys) {
+        array_hash<string>::iterator it =
+                b.append_distinct(str.data(), str.size());
+        BOOST_CHECK_EQUAL(*it, str);
+    }
+    BOOST_CHECK(b.size() == keys.size());
+    BOOST_CHECK(a == b);
+    check_equal(b, keys);
+
+    // The table can be modified as usual afterwards
+    BOOST_CHECK(b.insert("x"));
+    BOOST_CHECK(b.exists("x"));
+    foreach (const string& str, keys) {
+        BOOST_CHECK_EQUAL(b.erase(str), 1);
+    }
+    BOOST_CHECK(b.size() == 1);
+
+    // Filling with nothing leaves an empty table
+    b.reserve_distinct(0);
+    b.allocate_measured();
+    BOOST_CHECK(b.empty());
+    BOOST_CHECK(b.begin() == b.end());
+}
+
+TEST(testSlabAllocator)
+{
+    typedef array_hash<string, shift_add_xor_hash, slab_allocator<char> >
+            slab_hash;
+    set<string> keys;
+    char buffer[16];
+    for (int i = 0; i < 1000; ++i) {
+        sprintf(buffer, "%d", i * 13);
+        keys.insert(buffer);
+    }
+
+    slab_hash a(keys.begin(), keys.end(), array_hash_traits(1));
+    check_equal(a, keys);
+
+    // Copies share the arena
+    slab_hash b(a);
+    BOOST_CHECK(a.get_allocator() == b.get_allocator());
+    BOOST_CHECK(a == b);
+    slab_hash c;
+    BOOST_CHECK(a.get_allocator() != c.get_allocator());
+    c = a;
+    BOOST_CHECK(a == c);
+
+    // Freed slots are reused for the next strings
+    size_t chunks = a.get_allocator().arena().chunk_count();
+    foreach (const string& str, keys) {
+        BOOST_CHECK_EQUAL(a.erase(str), 1);
+    }
+    BOOST_CHECK(a.empty());
+    foreach (const string& str, keys) {
+        a.insert(str);
+    }
+    check_equal(a, keys);
+    BOOST_CHECK_EQUAL(a.get_allocator().arena().chunk_count(), chunks);
+}
+
 TEST(testClear)
 {
     array_hash<string> a(data.begin(), data.end());
@@ -0,0 +1,471 @@
+/*
+ * hat_map_test.cpp
+ */
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE hatMap
+#define TEST BOOST_AUTO_TEST_CASE
+
+#include <string>
+#include <iterator>
+#include <map>
+#include <fstream>
+#include <vector>
+
+#if __cplusplus >= 201103L
+#include <atomic>
+#include <thread>
+#endif
+
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "../src/hat_map.h"
+
+#define foreach BOOST_FOREACH
+
+using namespace stx;
+using namespace std;
+
+struct HatMapData
+{
+    map<string, int> data;
+
+    HatMapData()
+    {
+        ifstream file;
+        file.open("test/inputs/kjv");
+        if (!file) {
+            throw "file not opened";
+        }
+
+        string reader;
+        while (file >> reader) {
+            ++data[reader];
+        }
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(hatMap, HatMapData)
+
+template <class A, class B>
+void check_equal(const A& a, const B& b)
+{
+    map<string, int> x;
+    for (typename A::iterator it = a.begin(); it != a.end(); ++it) {
+        x[it.key()] = it.value();
+    }
+    map<string, int> y(b.begin(), b.end());
+    BOOST_CHECK(x == y);
+}
+
+TEST(testConstructor)
+{
+    hat_map<string, int> h;
+    BOOST_CHECK(h.begin() == h.end());
+    BOOST_CHECK(h.size() == 0);
+    BOOST_CHECK(h.empty());
+}
+
+TEST(testInsert)
+{
+    hat_map<string, int> h;
+    BOOST_CHECK(h.insert(make_pair(string("abc"), 1)));
+    BOOST_CHECK(h.insert(make_pair(string("ab"), 2)));
+    BOOST_CHECK(h.insert(make_pair(string("abc"), 3)) == false);
+    BOOST_CHECK_EQUAL(h["abc"], 1);
+    BOOST_CHECK_EQUAL(h["ab"], 2);
+
+    // Test range insert
+    hat_map<string, int> a(data.begin(), data.end());
+    BOOST_CHECK(a.size() == data.size());
+    check_equal(a, data);
+}
+
+TEST(testSubscript)
+{
+    hat_trie_traits traits;
+    traits.burst_threshold = 2;
+    hat_map<string, int> h(traits);
+
+    // Default values are inserted for missing keys
+    BOOST_CHECK_EQUAL(h["a"], 0);
+    BOOST_CHECK(h.size() == 1);
+
+    // Words that end on nodes, on containers, and inside containers all
+    // keep their values through bursts
+    h["a"] = 1;
+    h["ab"] = 2;
+    h["abc"] = 3;
+    h["abd"] = 4;
+    h["b"] = 5;
+    h[""] = 6;
+    BOOST_CHECK_EQUAL(h["a"], 1);
+    BOOST_CHECK_EQUAL(h["ab"], 2);
+    BOOST_CHECK_EQUAL(h["abc"], 3);
+    BOOST_CHECK_EQUAL(h["abd"], 4);
+    BOOST_CHECK_EQUAL(h["b"], 5);
+    BOOST_CHECK_EQUAL(h[""], 6);
+    BOOST_CHECK(h.size() == 6);
+
+    hat_map<string, int> big;
+    typedef pair<string, int> record;
+    foreach (const record& r, data) {
+        big[r.first] = r.second;
+    }
+    check_equal(big, data);
+}
+
+TEST(testInsertOrAssign)
+{
+    hat_trie_traits traits;
+    traits.burst_threshold = 4;
+    hat_map<string, int> h(traits);
+    typedef pair<string, int> record;
+    foreach (const record& r, data) {
+        BOOST_CHECK(h.insert_or_assign(r.first, -1));
+    }
+    foreach (const record& r, data) {
+        BOOST_CHECK(h.insert_or_assign(r.first, r.second) == false);
+    }
+    check_equal(h, data);
+}
+
+TEST(testKeyViews)
+{
+    // Keys that are parts of a larger buffer, not strings of their own
+    const char buffer[] = "abcdabcd";
+    hat_map<string, int> h((hat_trie_traits(2)));
+    for (size_t length = 0; length <= 4; ++length) {
+        BOOST_CHECK(h.insert(buffer, length, (int) length));
+        BOOST_CHECK(h.insert(buffer + 4, length, -1) == false);
+    }
+    BOOST_CHECK_EQUAL(h.size(), 5);
+    BOOST_CHECK(h.insert(string("abcde"), 5));
+    BOOST_CHECK_EQUAL(h["abcde"], 5);
+    BOOST_CHECK_EQUAL(h["abc"], 3);
+
+    BOOST_CHECK_EQUAL(h.count(buffer + 4, 2), 1);
+    BOOST_CHECK_EQUAL(h.count(buffer + 1, 2), 0);
+    BOOST_CHECK(h.lower_bound(buffer + 1, 1) == h.end());
+    BOOST_CHECK_EQUAL(h.upper_bound(buffer, 2).key(), "abc");
+    BOOST_CHECK_EQUAL(distance(h.equal_range(buffer, 3).first,
+                               h.equal_range(buffer, 3).second), 1);
+
+    key_view view(buffer + 4, 3);
+    BOOST_CHECK_EQUAL(h.count(view), 1);
+    BOOST_CHECK_EQUAL(h.find(view).value(), 3);
+    BOOST_CHECK(h.insert(view, 7) == false);
+    BOOST_CHECK_EQUAL(h.erase(view), 1);
+    BOOST_CHECK(h.insert(view, 7));
+    BOOST_CHECK_EQUAL(h[view], 7);
+}
+
+TEST(testFingerprints)
+{
+    // Values stay aligned and intact with a fingerprint in every entry
+    hat_trie_traits traits;
+    traits.burst_threshold = 64;
+    hat_map<string, double, fingerprinted<word_hash> > h(traits);
+    typedef pair<string, int> record;
+    foreach (const record& r, data) {
+        h[r.first] = r.second + 0.5;
+    }
+    BOOST_CHECK(h.size() == data.size());
+    foreach (const record& r, data) {
+        BOOST_CHECK_EQUAL(h.find(r.first).value(), r.second + 0.5);
+    }
+}
+
+TEST(testFind)
+{
+    hat_trie_traits traits;
+    traits.burst_threshold = 2;
+    hat_map<string, int> h(traits);
+    h["abcde"] = 1;
+    h["abcd"] = 2;
+    h["abc"] = 3;
+    h["b"] = 4;
+    BOOST_CHECK(h.find("a") == h.end());
+    BOOST_CHECK_EQUAL(h.find("b").value(), 4);
+    BOOST_CHECK_EQUAL(h.find("abcde").key(), "abcde");
+    BOOST_CHECK_EQUAL(h.find("abcde").value(), 1);
+    BOOST_CHECK((*h.find("abc")).second == 3);
+    BOOST_CHECK(h.find("abcdefg") == h.end());
+
+    // Values can be modified through iterators
+    h.find("abcd").value() = 7;
+    BOOST_CHECK_EQUAL(h["abcd"], 7);
+}
+
+TEST(testErase)
+{
+    hat_map<string, int> h(data.begin(), data.end());
+    map<string, int> control(data);
+    while (control.size() > data.size() / 2) {
+        BOOST_CHECK_EQUAL(h.erase(control.begin()->first), 1);
+        control.erase(control.begin());
+    }
+    BOOST_CHECK(h.size() == control.size());
+    check_equal(h, control);
+}
+
+TEST(testReverseIteration)
+{
+    hat_map<string, int> h(data.begin(), data.end(), hat_trie_traits(64));
+    map<string, int>::reverse_iterator expected = data.rbegin();
+    for (hat_map<string, int>::reverse_iterator it = h.rbegin();
+            it != h.rend(); ++it, ++expected) {
+        BOOST_CHECK_EQUAL(it.key(), expected->first);
+        BOOST_CHECK_EQUAL(it.value(), expected->second);
+        BOOST_CHECK((*it).second == expected->second);
+    }
+    BOOST_CHECK(expected == data.rend());
+}
+
+TEST(testHybridContainers)
+{
+    size_t thresholds[] = { 1, 2, 64 };
+    foreach (size_t threshold, thresholds) {
+        hat_map<string, int> h(hat_trie_traits(threshold, true));
+        for (map<string, int>::iterator it = data.begin(); it != data.end();
+                ++it) {
+            h[it->first] = it->second;
+        }
+        check_equal(h, data);
+        for (map<string, int>::iterator it = data.begin(); it != data.end();
+                ++it) {
+            BOOST_CHECK_EQUAL(h[it->first], it->second);
+        }
+    }
+}
+
+TEST(testBulkLoad)
+{
+    size_t thresholds[] = { 0, 1, 2, 64 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_map<string, int> h(sorted_unique, data.begin(), data.end(),
+                                   hat_trie_traits(threshold, hybrid));
+            BOOST_CHECK_EQUAL(h.size(), data.size());
+            check_equal(h, data);
+            for (map<string, int>::iterator it = data.begin();
+                    it != data.end(); ++it) {
+                BOOST_CHECK_EQUAL(h[it->first], it->second);
+            }
+        }
+    }
+}
+
+#if __cplusplus >= 201103L
+TEST(testConcurrentReaders)
+{
+    // Every count in data is at least 1, so a reader that sees a key
+    // before its value would read a 0
+    typedef pair<string, int> record;
+    vector<record> records(data.begin(), data.end());
+    size_t thresholds[] = { 0, 2, 64 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_map<string, int> h(hat_trie_traits(threshold, hybrid, true));
+            std::atomic<bool> done(false);
+            std::atomic<int> misses(0);
+
+            vector<std::thread> readers;
+            for (int i = 0; i < 3; ++i) {
+                readers.push_back(std::thread([&, i] {
+                    hat_map<string, int>::read_guard guard(h);
+                    do {
+                        for (size_t j = i; j < records.size(); j += 3) {
+                            hat_map<string, int>::iterator it =
+                                    h.find(records[j].first);
+                            if (it != h.end() &&
+                                    it.value() != records[j].second) {
+                                ++misses;
+                            }
+                        }
+                    } while (!done);
+                }));
+            }
+
+            // Each round inserts through a different function
+            for (int round = 0; round < 3; ++round) {
+                foreach (const record& r, records) {
+                    const string &key = r.first;
+                    if (round == 0) {
+                        h.insert(r);
+                    } else if (round == 1) {
+                        h.insert(key.data(), key.size(), r.second);
+                    } else {
+                        h.insert_or_assign(key.data(), key.size(), r.second);
+                    }
+                }
+                if (round < 2) {
+                    foreach (const record& r, records) {
+                        h.erase(r.first);
+                    }
+                }
+            }
+            done = true;
+            foreach (std::thread& reader, readers) {
+                reader.join();
+            }
+            BOOST_CHECK_EQUAL(misses, 0);
+            check_equal(h, data);
+        }
+    }
+}
+
+TEST(testParallelLoad)
+{
+    // Each key appears twice, and keeps its first value
+    vector<pair<string, int> > records(data.begin(), data.end());
+    for (map<string, int>::iterator it = data.begin(); it != data.end();
+            ++it) {
+        records.push_back(make_pair(it->first, -1));
+    }
+
+    hat_map<string, int> h((hat_trie_traits(64)));
+    h.parallel_load(records.begin(), records.end(), 4);
+    BOOST_CHECK_EQUAL(h.size(), data.size());
+    check_equal(h, data);
+    for (map<string, int>::iterator it = data.begin(); it != data.end();
+            ++it) {
+        BOOST_CHECK_EQUAL(h[it->first], it->second);
+    }
+}
+#endif
+
+TEST(testBatch)
+{
+    vector<string> keys;
+    for (map<string, int>::iterator it = data.begin(); it != data.end();
+            ++it) {
+        keys.push_back(it->first);
+        keys.push_back(it->first + "~");
+    }
+
+    hat_map<string, int> h(data.begin(), data.end(), hat_trie_traits(64));
+    vector<hat_map<string, int>::iterator> its;
+    h.find_batch(keys.begin(), keys.end(), back_inserter(its));
+    BOOST_REQUIRE_EQUAL(its.size(), keys.size());
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        BOOST_CHECK(its[i] != h.end());
+        BOOST_CHECK_EQUAL(its[i].value(), data[keys[i]]);
+        BOOST_CHECK(its[i + 1] == h.end());
+    }
+}
+
+// Adds up the values hat_map::for_each visits, then doubles them
+struct doubler
+{
+    size_t keys;
+    int sum;
+
+    doubler() : keys(0), sum(0) { }
+
+    void operator()(key_view, int &value)
+    {
+        ++keys;
+        sum += value;
+        value *= 2;
+    }
+};
+
+TEST(testForEach)
+{
+    hat_map<string, int> h(data.begin(), data.end(), hat_trie_traits(64));
+    doubler d = h.for_each(doubler());
+    BOOST_CHECK_EQUAL(d.keys, data.size());
+
+    int sum = 0;
+    map<string, int> doubled;
+    for (map<string, int>::iterator it = data.begin(); it != data.end(); ++it) {
+        sum += it->second;
+        doubled[it->first] = it->second * 2;
+    }
+    BOOST_CHECK_EQUAL(d.sum, sum);
+    check_equal(h, doubled);
+
+    // Only the keys that start with the prefix are visited
+    string prefix = data.begin()->first.substr(0, 1);
+    d = h.for_each_prefix(prefix, doubler());
+    size_t keys = 0;
+    sum = 0;
+    for (map<string, int>::iterator it = data.lower_bound(prefix);
+            it != data.end() && it->first.compare(0, 1, prefix) == 0; ++it) {
+        ++keys;
+        sum += it->second * 2;
+    }
+    BOOST_CHECK_EQUAL(d.keys, keys);
+    BOOST_CHECK_EQUAL(d.sum, sum);
+}
+
+#if __cplusplus >= 201103L
+struct add_doublers
+{
+    void operator()(doubler &into, const doubler &from)
+    {
+        into.keys += from.keys;
+        into.sum += from.sum;
+    }
+};
+
+TEST(testParallelForEach)
+{
+    hat_map<string, int> h(data.begin(), data.end(), hat_trie_traits(64));
+    doubler d = h.parallel_for_each(doubler(), add_doublers(), 4);
+    BOOST_CHECK_EQUAL(d.keys, data.size());
+
+    // Every value was doubled once
+    int sum = 0;
+    map<string, int> doubled;
+    for (map<string, int>::iterator it = data.begin(); it != data.end(); ++it) {
+        sum += it->second;
+        doubled[it->first] = it->second * 2;
+    }
+    BOOST_CHECK_EQUAL(d.sum, sum);
+    check_equal(h, doubled);
+}
+#endif
+
+TEST(testSwap)
+{
+    hat_map<string, int> a(data.begin(), data.end());
+    hat_map<string, int> b;
+
+    swap(a, b);
+    BOOST_CHECK(a.empty());
+    check_equal(b, data);
+}
+
+TEST(testCopy)
+{
+    size_t thresholds[] = { 2, 64 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_map<string, int> a(data.begin(), data.end(),
+                                   hat_trie_traits(threshold, hybrid));
+            hat_map<string, int> b(a);
+            for (map<string, int>::iterator it = data.begin();
+                    it != data.end(); ++it) {
+                BOOST_CHECK_EQUAL(b[it->first], it->second);
+                ++b[it->first];
+            }
+            check_equal(a, data);
+
+#if __cplusplus >= 201103L
+            hat_map<string, int> c(std::move(a));
+            check_equal(c, data);
+            BOOST_CHECK(a.empty());
+            BOOST_CHECK(a.begin() == a.end());
+            a["abc"] = 1;
+            BOOST_CHECK_EQUAL(a.size(), 1u);
+            a = std::move(b);
+            BOOST_CHECK_EQUAL(a.size(), data.size());
+#endif
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,18 +5,35 @@
  *      Author: chris
  */
 
+#define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE hatSet
 #define TEST BOOST_AUTO_TEST_CASE
 
+#include <algorithm>
+#include <cstdlib>
 #include <string>
+#include <iterator>
+#include <map>
+#include <memory>
 #include <set>
+#include <sstream>
 #include <stack>
+#include <stdexcept>
+#include <vector>
 #include <fstream>
 
+#if __cplusplus >= 201103L
+#include <atomic>
+#include <random>
+#include <thread>
+#endif
+
 #include <boost/test/unit_test.hpp>
 #include <boost/foreach.hpp>
 
+#include "../src/concurrent_hat_set.h"
 #include "../src/hat_set.h"
+#include "../src/slab_allocator.h"
 
 #define foreach BOOST_FOREACH
 #define reverse_foreach BOOST_REVERSE_FOREACH
@@ -43,6 +60,40 @@ struct HatTrieData
     }
 };
 
+// Sizes of the blocks checked_allocator has handed out and not taken back
+static map<void *, size_t> live_blocks;
+
+// Allocator that makes sure every block is freed once, with the size it
+// was allocated with
+template <class T>
+struct checked_allocator : public std::allocator<T>
+{
+    template <class U>
+    struct rebind {
+        typedef checked_allocator<U> other;
+    };
+
+    checked_allocator() { }
+
+    template <class U>
+    checked_allocator(const checked_allocator<U> &) { }
+
+    T *allocate(size_t n, const void * = NULL)
+    {
+        T *p = std::allocator<T>::allocate(n);
+        live_blocks[p] = n * sizeof(T);
+        return p;
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        BOOST_REQUIRE(live_blocks.count(p));
+        BOOST_CHECK_EQUAL(live_blocks[p], n * sizeof(T));
+        live_blocks.erase(p);
+        std::allocator<T>::deallocate(p, n);
+    }
+};
+
 BOOST_FIXTURE_TEST_SUITE(hatSet, HatTrieData)
 
 template <class A, class B>
@@ -53,6 +104,19 @@ void check_equal(const A& a, const B& b)
     BOOST_CHECK(x == y);
 }
 
+// Collects the words hat_set::for_each visits
+struct collector
+{
+    vector<string> *words;
+
+    collector(vector<string> *words) : words(words) { }
+
+    void operator()(key_view word)
+    {
+        words->push_back(string(word.data(), word.size()));
+    }
+};
+
 TEST(testConstructor)
 {
     hat_set<string> h;
@@ -124,6 +188,674 @@ TEST(testForwardIteration)
     check_equal(s, data);
 }
 
+TEST(testOrderedIteration)
+{
+    // Iteration follows byte order no matter how the trie is shaped
+    size_t thresholds[] = { 0, 1, 2, 64, 16384 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_set<string> h(data.begin(), data.end(),
+                              hat_trie_traits(threshold, hybrid));
+            vector<string> v(h.begin(), h.end());
+            BOOST_CHECK(v == vector<string>(data.begin(), data.end()));
+        }
+    }
+}
+
+TEST(testBounds)
+{
+    // Probe with words in the set, prefixes of them, and strings just
+    // after them
+    vector<string> probes;
+    probes.push_back("");
+    probes.push_back("~~~");
+    int i = 0;
+    foreach (const string& str, data) {
+        if (i++ % 97 == 0) {
+            probes.push_back(str);
+            probes.push_back(str.substr(0, str.size() / 2));
+            probes.push_back(str + "a");
+            probes.push_back(str.substr(0, str.size() - 1) + "~");
+        }
+    }
+
+    size_t thresholds[] = { 1, 2, 64, 16384 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_set<string> h(data.begin(), data.end(),
+                              hat_trie_traits(threshold, hybrid));
+            foreach (const string& probe, probes) {
+                set<string>::iterator lower = data.lower_bound(probe);
+                set<string>::iterator upper = data.upper_bound(probe);
+                hat_set<string>::iterator hlower = h.lower_bound(probe);
+                hat_set<string>::iterator hupper = h.upper_bound(probe);
+                BOOST_CHECK((lower == data.end()) == (hlower == h.end()));
+                BOOST_CHECK((upper == data.end()) == (hupper == h.end()));
+                if (lower != data.end() && hlower != h.end()) {
+                    BOOST_CHECK_EQUAL(*lower, *hlower);
+                }
+                if (upper != data.end() && hupper != h.end()) {
+                    BOOST_CHECK_EQUAL(*upper, *hupper);
+                }
+
+                pair<hat_set<string>::iterator,
+                     hat_set<string>::iterator> range;
+                range = h.equal_range(probe);
+                BOOST_CHECK_EQUAL(distance(range.first, range.second),
+                                  distance(lower, upper));
+            }
+        }
+    }
+}
+
+TEST(testPrefixMatch)
+{
+    vector<string> prefixes;
+    prefixes.push_back("");
+    prefixes.push_back("~");
+    int i = 0;
+    foreach (const string& str, data) {
+        if (i++ % 101 == 0) {
+            prefixes.push_back(str);
+            prefixes.push_back(str.substr(0, 1));
+            prefixes.push_back(str.substr(0, 2));
+            prefixes.push_back(str.substr(0, str.size() - 1));
+            prefixes.push_back(str + "~");
+        }
+    }
+
+    size_t thresholds[] = { 1, 2, 64, 16384 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_set<string> h(data.begin(), data.end(),
+                              hat_trie_traits(threshold, hybrid));
+            foreach (const string& prefix, prefixes) {
+                vector<string> expected;
+                set<string>::iterator it = data.lower_bound(prefix);
+                while (it != data.end() &&
+                        it->compare(0, prefix.size(), prefix) == 0) {
+                    expected.push_back(*it++);
+                }
+
+                pair<hat_set<string>::iterator,
+                     hat_set<string>::iterator> range;
+                range = h.prefix_match(prefix);
+                vector<string> actual(range.first, range.second);
+                BOOST_CHECK(expected == actual);
+
+                vector<string> visited;
+                h.for_each_prefix(prefix, collector(&visited));
+                BOOST_CHECK(expected == visited);
+            }
+        }
+    }
+}
+
+TEST(testForEach)
+{
+    vector<string> expected(data.begin(), data.end());
+    size_t thresholds[] = { 1, 2, 64, 16384 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_set<string> h(data.begin(), data.end(),
+                              hat_trie_traits(threshold, hybrid));
+            h.insert("");
+            vector<string> visited;
+            h.for_each(collector(&visited));
+            BOOST_REQUIRE(visited.size() == expected.size() + 1);
+            BOOST_CHECK(visited[0].empty());
+            BOOST_CHECK(equal(expected.begin(), expected.end(),
+                              visited.begin() + 1));
+
+            // Iterators give the same keys without copying them
+            size_t i = 0;
+            for (hat_set<string>::iterator it = h.begin(); it != h.end();
+                    ++it, ++i) {
+                const string &key = *it;
+                BOOST_CHECK(&key == &it.key());
+                BOOST_CHECK_EQUAL(key, visited[i]);
+            }
+        }
+    }
+
+    // Prefixes that end inside a container, on a container and on a
+    // node all visit the same words
+    hat_set<string> h(data.begin(), data.end(), hat_trie_traits(64));
+    string word = *data.rbegin();
+    for (size_t length = 0; length <= word.size(); ++length) {
+        string prefix = word.substr(0, length);
+        vector<string> visited;
+        h.for_each_prefix(prefix.data(), prefix.size(), collector(&visited));
+        pair<hat_set<string>::iterator, hat_set<string>::iterator> range;
+        range = h.prefix_match(prefix);
+        BOOST_CHECK(vector<string>(range.first, range.second) == visited);
+        BOOST_CHECK(visited.empty() == false);
+    }
+}
+
+#if __cplusplus >= 201103L
+// Keeps the words one parallel_for_each thread visits
+struct word_list
+{
+    vector<string> words;
+
+    void operator()(key_view word)
+    {
+        words.push_back(string(word.data(), word.size()));
+    }
+};
+
+struct append_words
+{
+    void operator()(word_list &into, const word_list &from)
+    {
+        into.words.insert(into.words.end(), from.words.begin(),
+                          from.words.end());
+    }
+};
+
+struct ignore_copies
+{
+    template <class F>
+    void operator()(F &, const F &) { }
+};
+
+struct throw_on_word
+{
+    void operator()(key_view word)
+    {
+        if (word == "the") {
+            throw std::runtime_error("the");
+        }
+    }
+};
+
+TEST(testParallelForEach)
+{
+    vector<string> expected(data.begin(), data.end());
+    expected.insert(expected.begin(), "");
+    size_t thresholds[] = { 0, 1, 2, 64, 16384 };
+    unsigned threads[] = { 1, 2, 4, 8 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_set<string> h(data.begin(), data.end(),
+                              hat_trie_traits(threshold, hybrid));
+            h.insert("");
+            foreach (unsigned n, threads) {
+                vector<string> visited = h.parallel_for_each(
+                        word_list(), append_words(), n).words;
+                sort(visited.begin(), visited.end());
+                BOOST_CHECK(visited == expected);
+            }
+        }
+    }
+
+    hat_set<string> empty;
+    BOOST_CHECK(empty.parallel_for_each(word_list(), append_words(), 4)
+                .words.empty());
+
+    hat_set<string> h(data.begin(), data.end(), hat_trie_traits(64));
+    BOOST_CHECK_THROW(h.parallel_for_each(throw_on_word(),
+                                          ignore_copies(), 4),
+                      std::runtime_error);
+}
+#endif
+
+TEST(testBinaryKeys)
+{
+    // Keys with embedded NULs, bytes >= 0x80 and prefixes of each other
+    set<string> keys;
+    srand(7);
+    for (int i = 0; i < 2000; ++i) {
+        string key;
+        int length = rand() % 6;
+        for (int j = 0; j < length; ++j) {
+            const char bytes[] = { '\0', '\x01', 'a', '\x7f', '\x80', '\xff' };
+            key += bytes[rand() % sizeof(bytes)];
+        }
+        keys.insert(key);
+    }
+
+    size_t thresholds[] = { 0, 1, 2, 64, 16384 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_set<string> h((hat_trie_traits(threshold, hybrid)));
+            foreach (const string& key, keys) {
+                BOOST_CHECK(h.insert(key.data(), key.size()));
+                BOOST_CHECK(h.insert(key) == false);
+            }
+            BOOST_CHECK_EQUAL(h.size(), keys.size());
+
+            // Iteration is in byte order, which is std::string's order
+            vector<string> expected(keys.begin(), keys.end());
+            vector<string> actual(h.begin(), h.end());
+            BOOST_CHECK(expected == actual);
+
+            foreach (const string& key, keys) {
+                BOOST_CHECK(h.exists(key.data(), key.size()));
+                BOOST_CHECK(h.find(key) != h.end());
+                BOOST_CHECK_EQUAL(h.find(key).key(), key);
+                BOOST_CHECK(h.exists(key + '\0') ==
+                            (keys.count(key + '\0') > 0));
+            }
+
+            string prefix("a\0", 2);
+            pair<hat_set<string>::iterator, hat_set<string>::iterator> range;
+            range = h.prefix_match(prefix.data(), prefix.size());
+            size_t count = 0;
+            foreach (const string& key, keys) {
+                count += key.compare(0, prefix.size(), prefix) == 0;
+            }
+            BOOST_CHECK_EQUAL(distance(range.first, range.second), count);
+
+            foreach (const string& key, keys) {
+                BOOST_CHECK_EQUAL(h.erase(key.data(), key.size()), 1);
+            }
+            BOOST_CHECK(h.empty());
+        }
+    }
+}
+
+TEST(testKeyViews)
+{
+    // Words that are parts of a larger buffer, not strings of their own
+    const char buffer[] = "abcdabcd";
+    hat_set<string> h((hat_trie_traits(2)));
+    for (size_t length = 0; length <= 4; ++length) {
+        BOOST_CHECK(h.insert(buffer, length));
+        BOOST_CHECK(h.insert(buffer + 4, length) == false);
+    }
+    for (size_t length = 0; length <= 4; ++length) {
+        BOOST_CHECK(h.exists(buffer + 4, length));
+        BOOST_CHECK_EQUAL(h.count(buffer + 4, length), 1);
+        BOOST_CHECK_EQUAL(h.find(buffer + 4, length).key(),
+                          string(buffer, length));
+    }
+    BOOST_CHECK_EQUAL(h.erase(buffer + 4, 2), 1);
+    BOOST_CHECK(h.exists("ab") == false);
+
+    key_view view(buffer + 4, 3);
+    BOOST_CHECK(h.exists(view));
+    BOOST_CHECK_EQUAL(h.count(view), 1);
+    BOOST_CHECK_EQUAL(*h.find(view), "abc");
+    BOOST_CHECK_EQUAL(h.erase(view), 1);
+    BOOST_CHECK(h.insert(view));
+    BOOST_CHECK(h.insert(view) == false);
+
+    hat_trie<string> trie;
+    BOOST_CHECK(trie.insert(view));
+    BOOST_CHECK(trie.exists(view));
+}
+
+TEST(testHashPolicy)
+{
+    size_t thresholds[] = { 2, 64, 16384 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_set<string, word_hash> h(data.begin(), data.end(),
+                                         hat_trie_traits(threshold, hybrid));
+            BOOST_CHECK_EQUAL(h.size(), data.size());
+            vector<string> expected(data.begin(), data.end());
+            vector<string> actual(h.begin(), h.end());
+            BOOST_CHECK(expected == actual);
+            foreach (const string& str, data) {
+                BOOST_CHECK(h.exists(str));
+                BOOST_CHECK(h.exists(str + "~") == (data.count(str + "~") > 0));
+            }
+        }
+    }
+}
+
+TEST(testAllocator)
+{
+    {
+        // Small containers burst often
+        typedef hat_set<string, shift_add_xor_hash, checked_allocator<char> >
+                checked_set;
+        checked_set h(data.begin(), data.end(), hat_trie_traits(64));
+        check_equal(h, data);
+        BOOST_CHECK(live_blocks.empty() == false);
+
+        int i = 0;
+        foreach (const string& str, data) {
+            if (++i % 2) {
+                BOOST_CHECK_EQUAL(h.erase(str), 1);
+            }
+        }
+        h.clear();
+        BOOST_CHECK(h.empty());
+        h.insert(data.begin(), data.end());
+        check_equal(h, data);
+    }
+    BOOST_CHECK(live_blocks.empty());
+
+    // Clearing a set puts its memory back in the arena, so building it
+    // again doesn't take any more memory from the system
+    typedef hat_set<string, shift_add_xor_hash, slab_allocator<char> >
+            slab_set;
+    slab_set s(data.begin(), data.end(), hat_trie_traits(64));
+    check_equal(s, data);
+    size_t chunks = s.get_allocator().arena().chunk_count();
+    BOOST_CHECK(chunks > 0);
+    s.clear();
+    s.insert(data.begin(), data.end());
+    check_equal(s, data);
+    BOOST_CHECK_EQUAL(s.get_allocator().arena().chunk_count(), chunks);
+
+    slab_set t;
+    BOOST_CHECK(s.get_allocator() != t.get_allocator());
+    s.swap(t);
+    check_equal(t, data);
+    BOOST_CHECK(s.empty());
+}
+
+TEST(testReverseIteration)
+{
+    size_t thresholds[] = { 0, 1, 2, 64, 16384 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_set<string> h(data.begin(), data.end(),
+                              hat_trie_traits(threshold, hybrid));
+            vector<string> v(h.rbegin(), h.rend());
+            BOOST_CHECK(v == vector<string>(data.rbegin(), data.rend()));
+
+            // Decrementing from end() visits the same words
+            v.clear();
+            for (hat_set<string>::iterator it = h.end(); it != h.begin(); ) {
+                --it;
+                v.push_back(*it);
+            }
+            BOOST_CHECK(v == vector<string>(data.rbegin(), data.rend()));
+        }
+    }
+}
+
+TEST(testReverseIterationPrefixes)
+{
+    // Words that are prefixes of other words, in nodes and containers
+    const char *words[] = { "", "a", "ab", "abc", "abd", "b", "ba", "bab",
+                            "c", "zz", "zzz" };
+    set<string> control(words, words + 11);
+    size_t thresholds[] = { 0, 1, 2, 16384 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_set<string> h(control.begin(), control.end(),
+                              hat_trie_traits(threshold, hybrid));
+            vector<string> v(h.rbegin(), h.rend());
+            BOOST_CHECK(v == vector<string>(control.rbegin(), control.rend()));
+
+            // Moving back and forth
+            hat_set<string>::iterator it = h.find("b");
+            BOOST_CHECK_EQUAL(*--it, "abd");
+            BOOST_CHECK_EQUAL(*++it, "b");
+            BOOST_CHECK_EQUAL(*--h.end(), "zzz");
+            BOOST_CHECK(--h.begin() == h.end());
+
+            // base() is one past the element, as for std::reverse_iterator
+            hat_set<string>::reverse_iterator r = h.rbegin();
+            BOOST_CHECK(r.base() == h.end());
+            ++r;
+            BOOST_CHECK_EQUAL(*r.base(), "zzz");
+            BOOST_CHECK(h.rend().base() == h.begin());
+            r = h.rend();
+            BOOST_CHECK_EQUAL(*--r, "");
+        }
+    }
+
+    hat_set<string> empty;
+    BOOST_CHECK(empty.rbegin() == empty.rend());
+}
+
+TEST(testHybridContainers)
+{
+    // Skewed words: most start with the same few characters
+    set<string> control;
+    foreach (const string& str, data) {
+        control.insert("s" + str);
+        if (str.size() % 3 == 0) {
+            control.insert(str);
+        }
+    }
+
+    hat_set<string> h(control.begin(), control.end(),
+                      hat_trie_traits(64, true));
+    BOOST_CHECK(h.size() == control.size());
+    foreach (const string& str, control) {
+        BOOST_CHECK(h.exists(str));
+        BOOST_CHECK(h.exists(str + "~") == false);
+        BOOST_CHECK_EQUAL(h.find(str).key(), str);
+    }
+    check_equal(h, control);
+
+    // Erasing empties and removes containers under ranges of characters
+    int i = 0;
+    for (set<string>::iterator it = control.begin(); it != control.end(); ) {
+        if (i++ % 3 == 0) {
+            BOOST_CHECK_EQUAL(h.erase(*it), 1);
+            control.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    BOOST_CHECK(h.size() == control.size());
+    BOOST_CHECK(vector<string>(h.begin(), h.end()) ==
+                vector<string>(control.begin(), control.end()));
+    foreach (const string& str, control) {
+        BOOST_CHECK_EQUAL(h.erase(str), 1);
+    }
+    BOOST_CHECK(h.empty());
+    BOOST_CHECK(h.begin() == h.end());
+
+    // Words can be added again after that
+    h.insert(data.begin(), data.end());
+    check_equal(h, data);
+}
+
+TEST(testIteratorCopies)
+{
+    hat_set<string> h(data.begin(), data.end(), hat_trie_traits(64));
+
+    // Every word in a container has its own position
+    hat_set<string>::iterator a = h.begin();
+    hat_set<string>::iterator b = a;
+    BOOST_CHECK(a == b);
+    ++b;
+    BOOST_CHECK(a != b);
+    BOOST_CHECK(*a != *b);
+
+    // Copies and postfix increments keep their keys
+    set<string>::iterator expected = data.begin();
+    for (hat_set<string>::iterator it = h.begin(); it != h.end(); ) {
+        hat_set<string>::iterator copy = it++;
+        BOOST_CHECK_EQUAL(copy.key(), *expected);
+        ++expected;
+        if (it != h.end()) {
+            BOOST_CHECK_EQUAL(it.key(), *expected);
+        }
+        a = copy;
+        BOOST_CHECK_EQUAL(*a, *copy);
+    }
+    BOOST_CHECK(expected == data.end());
+}
+
+TEST(testEraseRange)
+{
+    hat_set<string> h(data.begin(), data.end(), hat_trie_traits(64));
+    set<string> control(data);
+
+    set<string>::iterator first = control.lower_bound("b");
+    set<string>::iterator last = control.lower_bound("d");
+    h.erase(h.find(*first), h.find(*last));
+    control.erase(first, last);
+    BOOST_CHECK(h.size() == control.size());
+    check_equal(h, control);
+}
+
+TEST(testBulkLoad)
+{
+    // Binary keys too: embedded NULs, bytes >= 0x80 and the empty key
+    set<string> keys(data);
+    keys.insert("");
+    keys.insert(string("a\0b", 3));
+    keys.insert("\x80\xff");
+    keys.insert("\xff");
+
+    size_t thresholds[] = { 0, 1, 2, 64, 16384 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_trie_traits traits(threshold, hybrid);
+            hat_set<string> h(sorted_unique, keys.begin(), keys.end(),
+                              traits);
+            BOOST_CHECK_EQUAL(h.size(), keys.size());
+            BOOST_CHECK(vector<string>(h.begin(), h.end()) ==
+                        vector<string>(keys.begin(), keys.end()));
+            BOOST_CHECK(vector<string>(h.rbegin(), h.rend()) ==
+                        vector<string>(keys.rbegin(), keys.rend()));
+            foreach (const string& key, keys) {
+                BOOST_CHECK(h.exists(key));
+                BOOST_CHECK(h.exists(key + "~") == false);
+                BOOST_CHECK(h.insert(key) == false);
+            }
+
+            // The trie can be modified like one built by insert
+            foreach (const string& key, keys) {
+                h.insert(key + "~");
+            }
+            BOOST_CHECK_EQUAL(h.size(), keys.size() * 2);
+            foreach (const string& key, keys) {
+                BOOST_CHECK_EQUAL(h.erase(key), 1);
+                BOOST_CHECK_EQUAL(h.erase(key + "~"), 1);
+            }
+            BOOST_CHECK(h.empty());
+
+            // Loading replaces what was there
+            h.insert("zzz");
+            h.bulk_load(data.begin(), data.end());
+            check_equal(h, data);
+            BOOST_CHECK(h.exists("zzz") == false);
+        }
+    }
+
+    const char *words[] = { "a", "ab", "abc", "b" };
+    hat_set<string> h((hat_trie_traits(1)));
+    h.bulk_load(words, words + 4);
+    BOOST_CHECK(vector<string>(h.begin(), h.end()) ==
+                vector<string>(words, words + 4));
+    h.bulk_load(words, words + 0);
+    BOOST_CHECK(h.empty());
+    BOOST_CHECK(h.begin() == h.end());
+}
+
+#if __cplusplus >= 201103L
+TEST(testParallelLoad)
+{
+    // Unsorted, with duplicates and binary keys
+    vector<string> keys(data.begin(), data.end());
+    keys.insert(keys.end(), data.begin(), data.end());
+    keys.push_back("");
+    keys.push_back(string("a\0b", 3));
+    keys.push_back("\x80\xff");
+    keys.push_back("\xff");
+    shuffle(keys.begin(), keys.end(), std::mt19937(2));
+    set<string> distinct(keys.begin(), keys.end());
+
+    size_t thresholds[] = { 0, 1, 2, 64, 16384 };
+    for (int concurrent = 0; concurrent < 2; ++concurrent) {
+        for (int hybrid = 0; hybrid < 2; ++hybrid) {
+            foreach (size_t threshold, thresholds) {
+                hat_trie_traits traits(threshold, hybrid, concurrent);
+                hat_set<string> serial(keys.begin(), keys.end(), traits);
+                hat_set<string> h(traits);
+                h.insert("zzz");
+                h.parallel_load(keys.begin(), keys.end(), 4);
+                BOOST_CHECK_EQUAL(h.size(), distinct.size());
+                check_equal(h, distinct);
+
+                // Same structure as inserting the keys in order
+                ostringstream a, b;
+                serial.print(a);
+                h.print(b);
+                BOOST_CHECK(a.str() == b.str());
+
+                // The trie can be modified like one built by insert
+                foreach (const string& key, distinct) {
+                    BOOST_CHECK(h.insert(key + "~"));
+                }
+                foreach (const string& key, distinct) {
+                    BOOST_CHECK_EQUAL(h.erase(key), 1);
+                    BOOST_CHECK_EQUAL(h.erase(key + "~"), 1);
+                }
+                BOOST_CHECK(h.empty());
+            }
+        }
+    }
+
+    hat_set<string> h;
+    h.parallel_load(keys.begin(), keys.begin(), 4);
+    BOOST_CHECK(h.empty());
+    h.parallel_load(keys.begin(), keys.end());
+    check_equal(h, distinct);
+
+    // Slab arenas aren't thread safe, so this inserts on one thread and
+    // every node comes from the set's own arena
+    typedef hat_set<string, shift_add_xor_hash, slab_allocator<char> >
+            slab_set;
+    slab_set s((hat_trie_traits(64)));
+    s.parallel_load(keys.begin(), keys.end(), 4);
+    check_equal(s, distinct);
+    size_t chunks = s.get_allocator().arena().chunk_count();
+    s.clear();
+    s.insert(keys.begin(), keys.end());
+    BOOST_CHECK_EQUAL(s.get_allocator().arena().chunk_count(), chunks);
+}
+#endif
+
+TEST(testBatch)
+{
+    // Hits, misses past the ends of words, prefixes and the empty word
+    vector<string> words;
+    foreach (const string& str, data) {
+        words.push_back(str);
+        words.push_back(str + "~");
+        words.push_back(str.substr(0, str.size() / 2));
+    }
+    words.push_back("");
+
+    size_t thresholds[] = { 0, 1, 2, 64, 16384 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            hat_set<string> h(data.begin(), data.end(),
+                              hat_trie_traits(threshold, hybrid));
+
+            vector<bool> found;
+            h.exists_batch(words.begin(), words.end(), back_inserter(found));
+            BOOST_REQUIRE_EQUAL(found.size(), words.size());
+            for (size_t i = 0; i < words.size(); ++i) {
+                BOOST_CHECK_EQUAL(found[i], h.exists(words[i]));
+            }
+
+            vector<hat_set<string>::iterator> its(words.size());
+            BOOST_CHECK(h.find_batch(words.begin(), words.end(), its.begin())
+                        == its.end());
+            for (size_t i = 0; i < words.size(); ++i) {
+                BOOST_CHECK(its[i] == h.find(words[i]));
+                if (its[i] != h.end()) {
+                    BOOST_CHECK_EQUAL(*its[i], words[i]);
+                }
+            }
+        }
+    }
+
+    // Batches that don't fill a group
+    hat_set<string> h(data.begin(), data.end());
+    bool found[3] = { false, false, false };
+    BOOST_CHECK(h.exists_batch(words.begin(), words.begin() + 3, found) ==
+                found + 3);
+    BOOST_CHECK(found[0] && found[1] == false);
+    BOOST_CHECK(h.exists_batch(words.begin(), words.begin(), found) ==
+                found);
+}
+
 TEST(testSwap)
 {
     hat_set<string> control(data.begin(), data.end());
@@ -135,6 +867,267 @@ TEST(testSwap)
     check_equal(b, control);
 }
 
+TEST(testCopy)
+{
+    typedef hat_set<string, shift_add_xor_hash, checked_allocator<char> >
+            checked_set;
+    size_t thresholds[] = { 0, 2, 64, 16384 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            {
+                checked_set a(data.begin(), data.end(),
+                              hat_trie_traits(threshold, hybrid));
+                checked_set b(a);
+                BOOST_CHECK_EQUAL(b.size(), a.size());
+                BOOST_CHECK(vector<string>(a.begin(), a.end()) ==
+                            vector<string>(b.begin(), b.end()));
+                BOOST_CHECK_EQUAL(b.traits().burst_threshold, threshold);
+
+                // The copy is independent of the original
+                foreach (const string& str, data) {
+                    BOOST_CHECK(b.insert(str + "~"));
+                    BOOST_CHECK(b.exists(str));
+                }
+                BOOST_CHECK_EQUAL(a.size(), data.size());
+                BOOST_CHECK(a.exists(*data.begin() + "~") == false);
+
+                // Assignment frees what was there
+                checked_set c;
+                c.insert("abc");
+                c = a;
+                check_equal(c, data);
+                c = c;
+                check_equal(c, data);
+                a.clear();
+                check_equal(c, data);
+            }
+            BOOST_CHECK(live_blocks.empty());
+        }
+    }
+}
+
+#if __cplusplus >= 201103L
+TEST(testMove)
+{
+    static_assert(std::is_nothrow_move_constructible<hat_set<string> >::value,
+                  "hat_set moves without throwing");
+    static_assert(std::is_nothrow_move_assignable<hat_set<string> >::value,
+                  "hat_set moves without throwing");
+
+    hat_set<string> a(data.begin(), data.end(), hat_trie_traits(64));
+    hat_set<string>::iterator it = a.find(*data.begin());
+    hat_set<string> b(std::move(a));
+    check_equal(b, data);
+    BOOST_CHECK(a.empty());
+    BOOST_CHECK(it == b.begin());
+
+    // A moved from set is empty and can be used as it is
+    BOOST_CHECK(a.begin() == a.end());
+    BOOST_CHECK(a.find("abc") == a.end());
+    BOOST_CHECK(a.lower_bound("abc") == a.end());
+    BOOST_CHECK_EQUAL(a.erase("abc"), 0u);
+    BOOST_CHECK(hat_set<string>(a).empty());
+    a.insert("abc");
+    BOOST_CHECK(a.exists("abc"));
+    BOOST_CHECK_EQUAL(a.size(), 1u);
+
+    hat_set<string> c(std::move(a));
+    a.clear();
+    a.insert("abc");
+    BOOST_CHECK(a == c);
+
+    a = std::move(b);
+    check_equal(a, data);
+
+    // Sets can be kept in vectors
+    vector<hat_set<string> > sets;
+    for (int i = 0; i < 10; ++i) {
+        sets.push_back(hat_set<string>(data.begin(), data.end()));
+    }
+    foreach (const hat_set<string>& set, sets) {
+        check_equal(set, data);
+    }
+}
+#endif
+
+#if __cplusplus >= 201103L
+TEST(testConcurrentReaders)
+{
+    typedef hat_set<string, shift_add_xor_hash, checked_allocator<char> >
+            checked_set;
+
+    // Half the words stay put while the writer inserts and erases the
+    // other half. Readers must always find the ones that stay.
+    vector<string> stable, changing;
+    foreach (const string& str, data) {
+        (stable.size() == changing.size() ? stable : changing).push_back(str);
+    }
+
+    size_t thresholds[] = { 0, 2, 64 };
+    for (int hybrid = 0; hybrid < 2; ++hybrid) {
+        foreach (size_t threshold, thresholds) {
+            {
+                checked_set h(stable.begin(), stable.end(),
+                              hat_trie_traits(threshold, hybrid, true));
+                std::atomic<bool> done(false);
+                std::atomic<int> misses(0);
+
+                vector<std::thread> readers;
+                for (int i = 0; i < 3; ++i) {
+                    readers.push_back(std::thread([&, i] {
+                        checked_set::read_guard guard(h);
+                        do {
+                            for (size_t j = i; j < stable.size(); j += 3) {
+                                checked_set::iterator it = h.find(stable[j]);
+                                if (it == h.end() || *it != stable[j] ||
+                                        !h.exists(stable[j])) {
+                                    ++misses;
+                                }
+                            }
+                        } while (!done);
+                    }));
+                }
+
+                for (int round = 0; round < 2; ++round) {
+                    foreach (const string& str, changing) {
+                        h.insert(str);
+                    }
+                    foreach (const string& str, changing) {
+                        h.erase(str);
+                    }
+                }
+                foreach (const string& str, changing) {
+                    h.insert(str);
+                }
+                done = true;
+                foreach (std::thread& reader, readers) {
+                    reader.join();
+                }
+                BOOST_CHECK_EQUAL(misses, 0);
+                check_equal(h, data);
+
+                // Copies keep the traits and stay usable
+                checked_set c(h);
+                check_equal(c, data);
+                c = h;
+                foreach (const string& str, changing) {
+                    c.erase(str);
+                }
+                BOOST_CHECK_EQUAL(c.size(), stable.size());
+                BOOST_CHECK(c.traits().concurrent_readers);
+            }
+            BOOST_CHECK(live_blocks.empty());
+        }
+    }
+}
+#endif
+
+#if __cplusplus >= 201103L
+TEST(testConcurrentHatSet)
+{
+    // Short words live beside the shards
+    set<string> words(data);
+    words.insert("");
+    words.insert("a");
+    words.insert(string(1, '\0'));
+    words.insert(string("\xff\0", 2));
+    vector<string> keys(words.begin(), words.end());
+
+    for (int prefix_length = 1; prefix_length <= 2; ++prefix_length) {
+        for (int readers = 0; readers < 2; ++readers) {
+            concurrent_hat_set<string> h(prefix_length,
+                                         hat_trie_traits(64, false, readers));
+            BOOST_CHECK_EQUAL(h.prefix_length(), prefix_length);
+
+            // Every thread inserts every word, so they race on each one.
+            // Exactly one of them inserts it.
+            std::atomic<size_t> inserted(0);
+            vector<std::thread> threads;
+            for (int i = 0; i < 4; ++i) {
+                threads.push_back(std::thread([&, i] {
+                    for (size_t j = 0; j < keys.size(); ++j) {
+                        const string &key = keys[(j + i * 997) % keys.size()];
+                        inserted += h.insert(key);
+                        if (!h.exists(key)) {
+                            inserted += keys.size();
+                        }
+                    }
+                }));
+            }
+            foreach (std::thread& thread, threads) {
+                thread.join();
+            }
+            BOOST_CHECK_EQUAL(inserted, keys.size());
+            BOOST_CHECK_EQUAL(h.size(), keys.size());
+
+            // Words come back in byte order
+            vector<string> visited;
+            h.for_each(collector(&visited));
+            BOOST_CHECK(visited == keys);
+
+            // Threads erase every other word
+            threads.clear();
+            for (int i = 0; i < 4; ++i) {
+                threads.push_back(std::thread([&, i] {
+                    for (size_t j = i * 2; j < keys.size(); j += 8) {
+                        h.erase(keys[j]);
+                    }
+                }));
+            }
+            foreach (std::thread& thread, threads) {
+                thread.join();
+            }
+            for (size_t j = 0; j < keys.size(); ++j) {
+                BOOST_CHECK_EQUAL(h.count(keys[j]), j % 2);
+            }
+            BOOST_CHECK_EQUAL(h.size(), keys.size() / 2);
+
+            h.clear();
+            BOOST_CHECK(h.empty());
+            BOOST_CHECK(h.exists("") == false);
+        }
+    }
+}
+#endif
+
+#if __cplusplus >= 201103L
+TEST(testConcurrentHatSetSlab)
+{
+    // Slab arenas aren't thread safe, so each shard needs its own
+    typedef concurrent_hat_set<string, shift_add_xor_hash,
+                               slab_allocator<char> > slab_set;
+    vector<string> keys(data.begin(), data.end());
+    slab_set h(1, hat_trie_traits(64));
+    vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.push_back(std::thread([&, i] {
+            for (size_t j = 0; j < keys.size(); ++j) {
+                h.insert(keys[(j + i * 997) % keys.size()]);
+            }
+        }));
+    }
+    foreach (std::thread& thread, threads) {
+        thread.join();
+    }
+    BOOST_CHECK_EQUAL(h.size(), keys.size());
+
+    threads.clear();
+    for (int i = 0; i < 4; ++i) {
+        threads.push_back(std::thread([&, i] {
+            for (size_t j = i * 2; j < keys.size(); j += 8) {
+                h.erase(keys[j]);
+            }
+        }));
+    }
+    foreach (std::thread& thread, threads) {
+        thread.join();
+    }
+    for (size_t j = 0; j < keys.size(); ++j) {
+        BOOST_CHECK_EQUAL(h.count(keys[j]), j % 2);
+    }
+}
+#endif
+
 TEST(testCount)
 {
     hat_set<string> h;